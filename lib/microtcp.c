@@ -25,12 +25,351 @@
  * (cs335a) microTCP Netwroks Project - Phase A
  */ 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
 #include "microtcp.h"
-#include "../utils/crc32.h"
+#include "segment.h"
+#include "microtcp_slab.h"
+#include "../utils/siphash.h"
+#include "../utils/trace.h"
+
+#define SENDFILE_BOUNCE_LEN (1024 * 1024)  /* chunk size when the file cannot be mapped */
+#define RECVFILE_EXTENT (64 * 1024 * 1024)  /* file growth step when the size is unknown */
+#define RECVFILE_BATCH_LEN (256 * 1024)     /* write batch when the file cannot be mapped */
+#define TFO_CACHE_LEN 32                    /* servers a client remembers a cookie for */
+#define TFO_KEY_LIFETIME_US (3600ULL * 1000000)  /* cookies are valid for one to two of these */
+
+static ssize_t send_segment (microtcp_sock_t *socket, uint32_t seq, uint16_t control,
+                             const uint8_t *payload, size_t len);
+static int recv_ack (microtcp_sock_t *socket, microtcp_header_t *header, int flags);
+static void setup_connection (microtcp_sock_t *socket);
+static uint64_t now_us (void);
+static void passive_close (microtcp_sock_t *socket, uint32_t fin_seq);
+static int send_ack (microtcp_sock_t *socket);
+static void release_connection (microtcp_sock_t *socket);
+static void stream_table_free (struct stream_table **table);
+static void sndq_set_limit (microtcp_sock_t *socket, size_t limit);
+static int sndq_drain (microtcp_sock_t *socket);
+static void sndq_free (microtcp_sock_t *socket);
+
+/* fast open cookies this process got from servers */
+static struct
+{
+  struct sockaddr_in addr;
+  uint32_t cookie;
+} tfo_cache[TFO_CACHE_LEN];
+static unsigned tfo_cache_next;
+static pthread_mutex_t tfo_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the keys of the cookies this process hands out as a server: the
+ * current one, and the one before it so cookies do not all expire at
+ * once when it changes */
+static struct
+{
+  pthread_mutex_t lock;
+  uint8_t key[2][SIPHASH_KEY_LEN];
+  int count;                    /* keys drawn so far, at most 2 */
+  uint64_t stamp;               /* when key[0] was drawn */
+} tfo_keys = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* the environment variable and the valid range of each socket option,
+ * indexed by MICROTCP_SO_* */
+static const struct
+{
+  const char *env;
+  uint32_t min;
+  uint32_t max;
+} sockopt_bounds[] = {
+  { NULL, 0, 0 },
+  { "MICROTCP_MSS", 64, 65507 - sizeof(microtcp_header_t) },  /* the largest UDP payload */
+  { "MICROTCP_RCVBUF", 1024, 1U << 30 },                       /* 16 bits of window, scaled by 14 */
+  { "MICROTCP_INIT_CWND", 1, 1000 },
+  { "MICROTCP_INIT_SSTHRESH", 128, 1U << 30 },
+  { "MICROTCP_ACK_TIMEOUT_US", 1000, 60000000 },
+  { "MICROTCP_SNDBUF", 0, 1U << 30 },
+  { "MICROTCP_MAX_STREAMS", 1, 1U << 20 },
+};
+#define SOCKOPT_COUNT (sizeof(sockopt_bounds) / sizeof(sockopt_bounds[0]))
+
+/* what a new socket starts with */
+static microtcp_sockopt_t sockopt_defaults = {
+  MICROTCP_MSS, MICROTCP_RECVBUF_LEN, MICROTCP_INIT_CWND / MICROTCP_MSS,
+  MICROTCP_INIT_SSTHRESH, MICROTCP_ACK_TIMEOUT_US, MICROTCP_SNDBUF_LEN,
+  MICROTCP_MAX_STREAMS
+};
+static pthread_once_t sockopt_env_once = PTHREAD_ONCE_INIT;
+
+
+/* initial sequence number: a 4us clock as in RFC 793, mixed with the
+ * pid and a counter so that back to back connections never share one */
+static uint32_t
+initial_seq (void)
+{
+  static uint32_t counter;
+  uint32_t x = (uint32_t)(now_us() << 2) ^ ((uint32_t)getpid() << 16)
+      ^ (__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED) * 2654435761u);
+
+  return crc32((const uint8_t *)&x, sizeof(x)) ^ x;
+}
+
+
+/* fills buf from the kernel's random pool */
+static int
+tfo_random (uint8_t *buf, size_t len)
+{
+  ssize_t ret;
+  size_t done = 0;
+
+  while (done < len) {
+    ret = getrandom(buf + done, len - done, 0);
+    if (ret < 0 && errno != EINTR) {
+      perror("Draw a fast open key");
+      return -1;
+    }
+    if (ret > 0) {
+      done += ret;
+    }
+  }
+  return 0;
+}
+
+
+/* the cookies a client address is entitled to, as in RFC 7413: SipHash
+ * of the address under a random key that changes every
+ * TFO_KEY_LIFETIME_US. cookie[0] is handed out, a SYN may carry either.
+ * returns the number of cookies, 0 if no key could be drawn */
+static int
+tfo_cookies (const struct sockaddr_in *addr, uint32_t cookie[2])
+{
+  uint64_t now = now_us();
+  int i, count;
+
+  pthread_mutex_lock(&tfo_keys.lock);
+  if (!tfo_keys.count || now - tfo_keys.stamp >= TFO_KEY_LIFETIME_US) {
+    if (tfo_keys.count) {
+      memcpy(tfo_keys.key[1], tfo_keys.key[0], SIPHASH_KEY_LEN);
+    }
+    if (tfo_random(tfo_keys.key[0], SIPHASH_KEY_LEN) == 0) {
+      tfo_keys.count = tfo_keys.count ? 2 : 1;
+      tfo_keys.stamp = now;
+    } else if (tfo_keys.count) {
+      memcpy(tfo_keys.key[0], tfo_keys.key[1], SIPHASH_KEY_LEN);  /* keep the old one */
+    }
+  }
+  count = tfo_keys.count;
+  for (i = 0; i < count; i++) {
+    cookie[i] = (uint32_t)siphash24(tfo_keys.key[i], (const uint8_t *)&addr->sin_addr,
+                                    sizeof(addr->sin_addr));
+  }
+  pthread_mutex_unlock(&tfo_keys.lock);
+  return count;
+}
+
+
+static int
+tfo_cache_get (const struct sockaddr_in *addr, uint32_t *cookie)
+{
+  int i, found = 0;
+
+  pthread_mutex_lock(&tfo_cache_lock);
+  for (i = 0; i < TFO_CACHE_LEN && !found; i++) {
+    if (tfo_cache[i].addr.sin_family == AF_INET
+        && tfo_cache[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr
+        && tfo_cache[i].addr.sin_port == addr->sin_port) {
+      *cookie = tfo_cache[i].cookie;
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&tfo_cache_lock);
+  return found;
+}
+
+
+static void
+tfo_cache_put (const struct sockaddr_in *addr, uint32_t cookie)
+{
+  int i, slot = -1;
+
+  pthread_mutex_lock(&tfo_cache_lock);
+  for (i = 0; i < TFO_CACHE_LEN && slot < 0; i++) {
+    if (tfo_cache[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr
+        && tfo_cache[i].addr.sin_port == addr->sin_port) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {  /* the oldest entry makes room */
+    slot = tfo_cache_next++ % TFO_CACHE_LEN;
+  }
+  tfo_cache[slot].addr.sin_family = AF_INET;
+  tfo_cache[slot].addr.sin_addr = addr->sin_addr;
+  tfo_cache[slot].addr.sin_port = addr->sin_port;
+  tfo_cache[slot].cookie = cookie;
+  pthread_mutex_unlock(&tfo_cache_lock);
+}
+
+static uint32_t *
+sockopt_field (microtcp_sockopt_t *opt, int optname)
+{
+  switch (optname) {
+    case MICROTCP_SO_MSS:
+      return &opt->mss;
+    case MICROTCP_SO_RCVBUF:
+      return &opt->rcvbuf;
+    case MICROTCP_SO_INIT_CWND:
+      return &opt->init_cwnd;
+    case MICROTCP_SO_INIT_SSTHRESH:
+      return &opt->init_ssthresh;
+    case MICROTCP_SO_ACK_TIMEOUT:
+      return &opt->ack_timeout_us;
+    case MICROTCP_SO_SNDBUF:
+      return &opt->sndbuf;
+    case MICROTCP_SO_MAX_STREAMS:
+      return &opt->max_streams;
+    default:
+      return NULL;
+  }
+}
+
+
+/* process wide defaults from the environment, a bad value is ignored */
+static void
+sockopt_load_env (void)
+{
+  const char *val;
+  char *end;
+  unsigned long v;
+  int i;
+
+  for (i = MICROTCP_SO_MSS; i < (int)SOCKOPT_COUNT; i++) {
+    val = getenv(sockopt_bounds[i].env);
+    if (!val) {
+      continue;
+    }
+    errno = 0;
+    v = strtoul(val, &end, 10);
+    if (errno || end == val || *end || v < sockopt_bounds[i].min || v > sockopt_bounds[i].max) {
+      fprintf(stderr, "microtcp: ignoring %s=%s, the range is %u..%u\n", sockopt_bounds[i].env,
+              val, sockopt_bounds[i].min, sockopt_bounds[i].max);
+      continue;
+    }
+    *sockopt_field(&sockopt_defaults, i) = v;
+  }
+}
+
+
+/* the ACK timeout is the receive timeout of the UDP socket */
+static int
+apply_ack_timeout (microtcp_sock_t *socket)
+{
+  struct timeval timeout;
+
+  timeout.tv_sec = socket->opt.ack_timeout_us / 1000000;
+  timeout.tv_usec = socket->opt.ack_timeout_us % 1000000;
+  if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) < 0) {
+    perror("setsockopt");
+    return -1;
+  }
+  return 0;
+}
+
+
+/* the UDP socket has to hold a whole window of datagrams, it is grown
+ * with the receive buffer but never shrunk: the kernel only charges for
+ * datagrams that are queued. it doubles the value for its bookkeeping
+ * and caps it at net.core.rmem_max */
+static void
+apply_rcvbuf (microtcp_sock_t *socket, size_t size)
+{
+  int cur = 0, want = size;
+  socklen_t len = sizeof(int);
+
+  if (getsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &cur, &len) < 0 || cur / 2 >= want) {
+    return;
+  }
+  if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(int)) < 0) {
+    perror("setsockopt");
+  }
+}
+
+
+/* the smallest window scale that fits the receive buffer in 16 bits */
+static uint8_t
+window_scale_for (size_t rcvbuf)
+{
+  uint8_t shift = 0;
+
+  while (shift < 14 && (rcvbuf >> shift) > 0xffff) {
+    shift++;
+  }
+  return shift;
+}
+
+
+/* how far auto-tuning may grow the receive buffer. the window scale is
+ * announced for it up front, it cannot change later */
+static size_t
+rcvbuf_ceiling (const microtcp_sock_t *socket)
+{
+  if (socket->rcvbuf_locked || socket->opt.rcvbuf > MICROTCP_RCVBUF_MAX) {
+    return socket->opt.rcvbuf;
+  }
+  return MICROTCP_RCVBUF_MAX;
+}
+
+
+/* what our SYN or SYN_ACK announces in future_use2 with OPT_SETUP. the
+ * stream limit goes as a power of two, rounded down */
+static uint32_t
+setup_announce (const microtcp_sock_t *socket)
+{
+  uint32_t streams_log = 0;
+
+  while (socket->opt.max_streams >> (streams_log + 1)) {
+    streams_log++;
+  }
+  return socket->opt.mss | (uint32_t)window_scale_for(rcvbuf_ceiling(socket)) << 16
+      | (streams_log + 1) << 24;
+}
+
+
+/* settles MSS and window scales with what the peer's SYN or SYN_ACK
+ * announced, and starts the congestion control. a peer without
+ * OPT_SETUP has the default MSS and does not scale */
+static void
+setup_negotiate (microtcp_sock_t *socket, const microtcp_header_t *header)
+{
+  uint32_t setup = ntohl(header->future_use2), peer_mss = MICROTCP_MSS;
+
+  socket->mss = socket->opt.mss;
+  socket->rcvbuf_len = socket->opt.rcvbuf;
+  socket->snd_wscale = 0;
+  socket->rcv_wscale = 0;
+  socket->peer_max_streams = UINT32_MAX;
+  if (ntohl(header->future_use0) & OPT_SETUP) {
+    peer_mss = setup & 0xffff;
+    socket->snd_wscale = ((setup >> 16) & 0xff) < 14 ? (setup >> 16) & 0xff : 14;
+    socket->rcv_wscale = window_scale_for(rcvbuf_ceiling(socket));
+    if ((setup >> 24) && (setup >> 24) <= 32) {
+      socket->peer_max_streams = 1U << ((setup >> 24) - 1);
+    }
+  }
+  if (peer_mss < socket->mss) {
+    socket->mss = peer_mss > sockopt_bounds[MICROTCP_SO_MSS].min
+        ? peer_mss : sockopt_bounds[MICROTCP_SO_MSS].min;
+  }
+  socket->cwnd = (size_t)socket->opt.init_cwnd * socket->mss;
+  socket->ssthresh = socket->opt.init_ssthresh;
+}
+
 
 microtcp_sock_t microtcp_socket (int domain, int type, int protocol) {
   microtcp_sock_t sock;
-  struct timeval timeout;
 
   sock.sd = socket(domain,type,protocol);
   if (sock.sd == -1) {
@@ -46,15 +385,62 @@ microtcp_sock_t microtcp_socket (int domain, int type, int protocol) {
   sock.bytes_send = 0;
   sock.bytes_received = 0;
   sock.bytes_lost = 0;
+  sock.bytes_in_flight = 0;
+  sock.bytes_acked = 0;
+  sock.retrans_timeout = 0;
+  sock.retrans_fast = 0;
+  sock.dup_acks = 0;
+  sock.zero_window_events = 0;
+  sock.window_probes = 0;
+  sock.persist_us = 0;
+  sock.send_active_us = 0;
+  sock.srtt_us = 0;
+  sock.rttvar_us = 0;
+  sock.min_rtt_us = 0;
+  sock.rtt_samples = 0;
+  sock.rtt_hist = NULL;
+  sock.trace = NULL;
+  sock.recvbuf = NULL;
+  sock.buf_fill_level = 0;
+  sock.reasm_buf = NULL;
+  sock.reasm_buf_len = 0;
+  sock.cork_buf = NULL;
+  sock.cork_len = 0;
+  sock.cork_stamp = 0;
+  sock.cork_more = 0;
+  sock.cork = 0;
+  sock.nagle = 0;
+  sock.fastopen = 0;
+  sock.syn_data = 0;
+  sock.tx_streams = NULL;
+  sock.rx_streams = NULL;
+  sock.rx_stream = 0;
+  sock.rx_stream_fin = 0;
+  sock.peer_max_streams = UINT32_MAX;
+  sock.message_mode = 0;
   sock.state = UNKNOWN;
 
+  pthread_once(&sockopt_env_once, sockopt_load_env);
+  sock.opt = sockopt_defaults;
+  sock.mss = sock.opt.mss;
+  sock.rcvbuf_len = sock.opt.rcvbuf;
+  sock.snd_wscale = 0;
+  sock.rcv_wscale = 0;
+  sock.rcvbuf_locked = 0;
+  sock.rcv_edge = 0;
+  sock.window_updates = 0;
+  sock.rcv_rtt_us = 0;
+  sock.rcv_rtt_stamp = 0;
+  sock.rcv_space = 0;
+  sock.rcv_space_stamp = 0;
+  sock.last_rx_us = 0;
+  sock.sndq = NULL;
+  sock.sndbuf_locked = 0;
+  sock.duplex = NULL;
 
   /* set timeout */
-  timeout.tv_sec = 0;
-  timeout.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-  if (setsockopt(sock.sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) < 0) {
-    perror("setsockopt");
-  }
+  apply_ack_timeout(&sock);
+  apply_rcvbuf(&sock, sock.opt.rcvbuf);
 
   return sock;
 }
@@ -75,47 +461,149 @@ int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
 
 
 
-/* this is where 3-way handshake takes place... */
-int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
-                  socklen_t address_len)
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int optname, const void *optval,
+                     socklen_t optlen)
+{
+  uint32_t *field = sockopt_field(&socket->opt, optname), value;
+
+  if (!field) {
+    errno = ENOPROTOOPT;
+    return -1;
+  }
+  if (optlen != sizeof(uint32_t)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(&value, optval, sizeof(uint32_t));
+  if (value < sockopt_bounds[optname].min || value > sockopt_bounds[optname].max) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* the peer has already been told */
+  if ((optname == MICROTCP_SO_MSS || optname == MICROTCP_SO_RCVBUF
+       || optname == MICROTCP_SO_MAX_STREAMS)
+      && socket->state != UNKNOWN && socket->state != LISTEN && socket->state != CLOSED) {
+    errno = EISCONN;
+    return -1;
+  }
+
+  *field = value;
+  if (optname == MICROTCP_SO_ACK_TIMEOUT) {
+    return apply_ack_timeout(socket);
+  }
+  if (optname == MICROTCP_SO_RCVBUF) {
+    socket->rcvbuf_locked = 1;
+    apply_rcvbuf(socket, value);
+  }
+  if (optname == MICROTCP_SO_SNDBUF) {
+    socket->sndbuf_locked = 1;
+    sndq_set_limit(socket, value);
+  }
+  return 0;
+}
+
+
+int
+microtcp_getsockopt (const microtcp_sock_t *socket, int optname, void *optval,
+                     socklen_t *optlen)
+{
+  microtcp_sockopt_t opt = socket->opt;
+  uint32_t *field = sockopt_field(&opt, optname);
+
+  if (!field) {
+    errno = ENOPROTOOPT;
+    return -1;
+  }
+  if (*optlen < sizeof(uint32_t)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (optname == MICROTCP_SO_MSS && socket->state == ESTABLISHED) {
+    *field = socket->mss;
+  }
+  memcpy(optval, field, sizeof(uint32_t));
+  *optlen = sizeof(uint32_t);
+  return 0;
+}
+
+
+/* client side of the 3-way handshake. with fast open and a cookie from
+ * an earlier connection, up to an MSS of data goes out with the SYN.
+ * returns the bytes the server took with the SYN or -1 */
+static ssize_t
+client_handshake (microtcp_sock_t *socket, const struct sockaddr *address,
+                  socklen_t address_len, const uint8_t *data, size_t len)
 {
   microtcp_header_t sendToServer, receiveFromServer;
+  struct sockaddr_in server;
+  struct iovec iov[2];
+  struct msghdr msg;
   ssize_t bytes_sent = 0, bytes_recvd = -1;
+  uint32_t opt = 0, cookie = 0, acked;
+  uint64_t syn_stamp = 0;
+  int tries;
 
-  srand(time(NULL));  /* for generating the random sequence number */
+  memset(&server, 0, sizeof(struct sockaddr_in));
+  memcpy(&server, address, address_len < sizeof(server) ? address_len : sizeof(server));
 
   /* update socket fields before starting 3-way handshake */
   socket->id = CLIENT;
-  socket->seq_number =rand();  /* random SYN number */
+  socket->seq_number = initial_seq();  /* random SYN number */
   socket->ack_number = 0;      /* ack should not have a value, only SYN */
-  socket->cwnd = MICROTCP_INIT_CWND;  /* the window size */
-
-  /* setup 1st header with SYN message (send from client) */
-  sendToServer.seq_number  = htonl(socket->seq_number);
-  sendToServer.ack_number  = htonl(socket->ack_number);
-  sendToServer.control     = htons(SYN);  /* first message is SYN */
-  sendToServer.window      = htons(MICROTCP_WIN_SIZE);  /* how much data to receive */
-  sendToServer.data_len    = htonl(DATA_LENGTH);  /* set to 32 bytes */
-  sendToServer.future_use0 = htonl(0);
-  sendToServer.future_use1 = htonl(0);
-  sendToServer.future_use2 = htonl(0);
+  socket->syn_data = 0;
 
-  bytes_sent = sendto(socket->sd, &sendToServer, sizeof(microtcp_header_t), 0, address, address_len);
-  if (bytes_sent < 0) {
-      socket->state = INVALID;
-      perror("Error sending SYN to server");
-      return -1;
-  } else {
-      socket->packets_send++;
-      socket->bytes_send += bytes_sent;
+  opt = OPT_SETUP;
+  if (socket->fastopen) {
+    opt |= OPT_TFO_REQ;
+    if (tfo_cache_get(&server, &cookie)) {
+      opt |= OPT_TFO_COOKIE;
+    }
+  }
+  if (!(opt & OPT_TFO_COOKIE)) {
+    len = 0;  /* no cookie yet, the data waits for the handshake */
   }
 
+  /* setup 1st header with SYN message (send from client). the window of
+   * a SYN is never scaled */
+  segment_encode_opt(&sendToServer, socket->seq_number, 0, SYN,
+                     socket->opt.rcvbuf < 0xffff ? socket->opt.rcvbuf : 0xffff,
+                     opt, cookie, setup_announce(socket), data, len);
+
+  iov[0].iov_base = &sendToServer;
+  iov[0].iov_len  = sizeof(microtcp_header_t);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len  = len;
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_name    = (void *)address;
+  msg.msg_namelen = address_len;
+  msg.msg_iov     = iov;
+  msg.msg_iovlen  = len ? 2 : 1;
+
+  /* the SYN is repeated on every ACK timeout, the server may not be
+   * listening yet or the SYN may have been lost */
+  for (tries = 0; bytes_recvd < 0 && tries < MICROTCP_SYN_RETRIES; tries++) {
+    syn_stamp = now_us();
+    bytes_sent = sendmsg(socket->sd, &msg, 0);
+    if (bytes_sent < 0) {
+        socket->state = INVALID;
+        perror("Error sending SYN to server");
+        return -1;
+    } else {
+        socket->packets_send++;
+        socket->bytes_send += bytes_sent;
+    }
 
-
-
-  /* get the header from server with an expected SYNACK message */
-  while (bytes_recvd < 0) {
-  	bytes_recvd = recvfrom(socket->sd, &receiveFromServer, sizeof(microtcp_header_t), 0, (struct sockaddr *)address, &address_len);
+    /* get the header from server with an expected SYNACK message */
+    bytes_recvd = recvfrom(socket->sd, &receiveFromServer, sizeof(microtcp_header_t), 0, NULL, NULL);
+  }
+  /* the receiver's first RTT estimate, unless the SYN had to be repeated */
+  socket->rcv_rtt_us = tries == 1 ? now_us() - syn_stamp : 0;
+  if (bytes_recvd < 0) {
+    socket->state = INVALID;
+    errno = ETIMEDOUT;
+    perror("Error --> Server never answered the SYN");
+    return -1;
   }
   
   socket->packets_received++;
@@ -123,29 +611,34 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
 
 
 
-  /* check if ack is seq + 1 and if the response is actually SYN_ACK */
-  if (ntohl(receiveFromServer.ack_number) == ntohl(sendToServer.seq_number) + 1) {
-    if (ntohl(receiveFromServer.control) == SYN_ACK) {
-      socket->seq_number = ntohl(receiveFromServer.ack_number);
-      socket->ack_number = ntohl(receiveFromServer.seq_number) + 1;
-      socket->init_win_size = ntohs(receiveFromServer.window);
-      socket->curr_win_size = ntohs(receiveFromServer.window);
-
-
-      /* setup header to send ACK after the SYN_ACK we got from the server */
-      sendToServer.seq_number = htonl(socket->seq_number);
-      sendToServer.ack_number = htonl(socket->ack_number);
-      sendToServer.control    = htons(ACK);
-    } else {
-        socket->state = INVALID;
-        perror("Error --> Server did not send SYN_ACK");
-        return -1;
-    }
-  } else {
+  /* the ack is seq + 1, plus the SYN data if the server took it */
+  acked = ntohl(receiveFromServer.ack_number) - socket->seq_number - 1;
+  if (ntohs(receiveFromServer.control) != SYN_ACK) {
+      socket->state = INVALID;
+      perror("Error --> Server did not send SYN_ACK");
+      return -1;
+  }
+  if (acked && acked != len) {
       socket->state = INVALID;
       perror("Error in +1 in SYN(client) ACK(server)");
       return -1;
   }
+  if (socket->fastopen && (ntohl(receiveFromServer.future_use0) & OPT_TFO_COOKIE)) {
+    tfo_cache_put(&server, ntohl(receiveFromServer.future_use1));
+  }
+
+  socket->syn_data = acked;
+  socket->seq_number = ntohl(receiveFromServer.ack_number);
+  socket->ack_number = ntohl(receiveFromServer.seq_number) + 1;
+  socket->init_win_size = ntohs(receiveFromServer.window);
+  socket->curr_win_size = ntohs(receiveFromServer.window);
+  setup_negotiate(socket, &receiveFromServer);
+
+  /* setup header to send ACK after the SYN_ACK we got from the server */
+  memset(&sendToServer, 0, sizeof(microtcp_header_t));
+  sendToServer.seq_number = htonl(socket->seq_number);
+  sendToServer.ack_number = htonl(socket->ack_number);
+  sendToServer.control    = htons(ACK);
 
   /* the last header to send with ACK message and hoping to establish a connection... */
   bytes_sent = sendto(socket->sd, &sendToServer, sizeof(microtcp_header_t), 0, address, address_len);
@@ -158,9 +651,51 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
       socket->bytes_send += bytes_sent;
   }  
 
-  memcpy(&(socket->address), address, sizeof(struct sockaddr));
-  memcpy(&(socket->address_len), &address_len, sizeof(socklen_t));
+  memcpy(&(socket->address), &server, sizeof(struct sockaddr_in));
+  socket->address_len = sizeof(struct sockaddr_in);
+
+  setup_connection(socket);
   socket->state = ESTABLISHED;  /* connection is made! */
+  return acked;
+}
+
+
+/* this is where 3-way handshake takes place... */
+int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
+                  socklen_t address_len)
+{
+  return client_handshake(socket, address, address_len, NULL, 0) < 0 ? -1 : 0;
+}
+
+
+ssize_t
+microtcp_connect_data (microtcp_sock_t *socket, const struct sockaddr *address,
+                       socklen_t address_len, const void *buffer, size_t length)
+{
+  ssize_t acked;
+  size_t max_syn;
+
+  socket->fastopen = 1;
+  /* the server takes SYN data up to the default MSS, whatever its own */
+  max_syn = socket->opt.mss < MICROTCP_MSS ? socket->opt.mss : MICROTCP_MSS;
+  acked = client_handshake(socket, address, address_len, buffer,
+                           length < max_syn ? length : max_syn);
+  if (acked < 0) {
+    return -1;
+  }
+  /* the rest, or all of it when the server had no cookie for us */
+  if ((size_t)acked < length
+      && microtcp_send(socket, (const uint8_t *)buffer + acked, length - acked, 0) < 0) {
+    return -1;
+  }
+  return length;
+}
+
+
+int
+microtcp_set_fastopen (microtcp_sock_t *socket, int on)
+{
+  socket->fastopen = on ? 1 : 0;
   return 0;
 }
 
@@ -173,44 +708,72 @@ microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len)
 {
   microtcp_header_t sendToClient, receiveFromClient;
+  uint8_t syn_data[MICROTCP_MSS];
+  struct iovec iov[2];
+  struct msghdr msg;
   ssize_t bytes_sent = 0, bytes_recvd = -1;
+  uint32_t opt = 0, cookie = 0, valid[2];
+  int valid_count;
+  uint64_t synack_stamp;
+  size_t len = 0;
 
   socket->id = SERVER;
-  socket->init_win_size = MICROTCP_WIN_SIZE;
-  socket->curr_win_size = MICROTCP_WIN_SIZE;
-
-  /* receive the first packet from client (should be SYN) */
-  while (bytes_recvd < 0) {
-    bytes_recvd = recvfrom(socket->sd, &receiveFromClient, sizeof(microtcp_header_t), 0, address, &address_len);
+  socket->syn_data = 0;
+
+  /* receive the first packet from client (should be SYN). leftovers of
+   * a previous connection on this port are skipped. a fast open SYN
+   * carries data, so the payload is received as well */
+  while (bytes_recvd < (ssize_t)sizeof(microtcp_header_t)
+         || ntohs(receiveFromClient.control) != SYN) {
+    iov[0].iov_base = &receiveFromClient;
+    iov[0].iov_len  = sizeof(microtcp_header_t);
+    iov[1].iov_base = syn_data;
+    iov[1].iov_len  = MICROTCP_MSS;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_name    = address;
+    msg.msg_namelen = address_len;
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 2;
+
+    bytes_recvd = recvmsg(socket->sd, &msg, 0);
+    if (bytes_recvd >= 0) {
+      socket->packets_received++;
+      socket->bytes_received += bytes_recvd;
+    }
   }
+  len = bytes_recvd - sizeof(microtcp_header_t);
 
-  socket->packets_received++;
-  socket->bytes_received += bytes_recvd;
-
-
-  /* server side: check if client message was SYN */
-  if (ntohs(receiveFromClient.control) != SYN) {
-      socket->state = INVALID;
-      perror("Error --> Expected SYN from client");
-      return -1;
+  /* a client doing fast open gets a cookie, a valid one lets its data in */
+  valid_count = 0;
+  if (socket->fastopen && (ntohl(receiveFromClient.future_use0) & OPT_TFO_REQ)) {
+    valid_count = tfo_cookies((const struct sockaddr_in *)address, valid);
+  }
+  if (valid_count) {
+    cookie = valid[0];
+    opt = OPT_TFO_COOKIE;
+    if ((ntohl(receiveFromClient.future_use0) & OPT_TFO_COOKIE)
+        && (ntohl(receiveFromClient.future_use1) == valid[0]
+            || (valid_count > 1 && ntohl(receiveFromClient.future_use1) == valid[1]))
+        && len && !(msg.msg_flags & MSG_TRUNC)
+        && segment_verify(&receiveFromClient, syn_data, len)) {
+      socket->syn_data = len;
+    }
   }
 
-  srand(time(NULL));
   /* update server's socket info */
-  socket->seq_number = rand();
-  socket->ack_number = ntohl(receiveFromClient.seq_number) + 1;
-  socket->packets_received++;
-  socket->bytes_received += bytes_recvd;
-  socket->init_win_size = MICROTCP_WIN_SIZE;
-  socket->curr_win_size = MICROTCP_WIN_SIZE;
+  socket->seq_number = initial_seq();
+  socket->ack_number = ntohl(receiveFromClient.seq_number) + 1 + socket->syn_data;
+  socket->init_win_size = ntohs(receiveFromClient.window);
+  socket->curr_win_size = ntohs(receiveFromClient.window);
+  setup_negotiate(socket, &receiveFromClient);
 
 
   /* setup server response header to client's SYN with SYN_ACK */
-  sendToClient.seq_number = htonl(socket->seq_number);
-  sendToClient.ack_number = ntohl(socket->ack_number);
-  sendToClient.control    = htons(SYN_ACK);
-  sendToClient.window     = htons(socket->curr_win_size);
+  segment_encode_opt(&sendToClient, socket->seq_number, socket->ack_number, SYN_ACK,
+                     socket->opt.rcvbuf < 0xffff ? socket->opt.rcvbuf : 0xffff,
+                     opt | OPT_SETUP, cookie, setup_announce(socket), NULL, 0);
 
+  synack_stamp = now_us();
   bytes_sent = sendto(socket->sd, &sendToClient, sizeof(microtcp_header_t), 0, address, address_len);
   if (bytes_sent < 0) {
       socket->state = INVALID;
@@ -224,11 +787,23 @@ microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
 
 
 
-  /* expect ACK from client on receive */
+  /* expect ACK from client on receive. a repeated SYN means our SYN_ACK
+   * got lost, it is sent again */
   bytes_recvd = -1;
   while (bytes_recvd < 0) {
-    bytes_recvd = recvfrom(socket->sd, &receiveFromClient, sizeof(microtcp_header_t), 0, address, &address_len);
+    bytes_recvd = recvfrom(socket->sd, &receiveFromClient, sizeof(microtcp_header_t), 0, NULL, NULL);
+    if (bytes_recvd >= 0 && ntohs(receiveFromClient.control) == SYN) {
+      socket->packets_received++;
+      socket->bytes_received += bytes_recvd;
+      bytes_recvd = -1;
+      synack_stamp = 0;  /* no RTT from a repeated SYN_ACK */
+      if (sendto(socket->sd, &sendToClient, sizeof(microtcp_header_t), 0, address, address_len) > 0) {
+        socket->packets_send++;
+        socket->bytes_send += sizeof(microtcp_header_t);
+      }
+    }
   }
+  socket->rcv_rtt_us = synack_stamp ? now_us() - synack_stamp : 0;
   socket->packets_received++;
   socket->bytes_received += bytes_recvd;
 
@@ -240,6 +815,18 @@ microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
     }
   }
 
+  /* keep the peer's address, data and termination go there */
+  memcpy(&(socket->address), address, sizeof(struct sockaddr_in));
+  socket->address_len = sizeof(struct sockaddr_in);
+
+  setup_connection(socket);
+
+  /* the SYN data is the first thing microtcp_recv() returns */
+  if (socket->syn_data) {
+    memcpy(socket->recvbuf, syn_data, socket->syn_data);
+    socket->buf_fill_level = socket->syn_data;
+  }
+
 
   return 0;  /* SUCCESSFULL accept and connection ESTABLISHED!! */
 }
@@ -250,317 +837,2895 @@ microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
 int
 microtcp_shutdown (microtcp_sock_t *socket, int how)
 {
-  microtcp_header_t client_h, server_h;
-  ssize_t bytes_sent = 0, bytes_recvd = -1;
-  struct sockaddr_in addr = socket->address;   
-  socklen_t addr_len = socket->address_len;
+  microtcp_header_t header;
+  uint32_t fin_seq, peer_fin = 0;
+  uint64_t deadline;
+  int ret, tries, acked = 0, got_fin = 0;
 
 
-
-
-  /* check if a connection exists before attempting to shutdown */
-  if (socket->state != ESTABLISHED) {
-    socket->state = INVALID;
+  /* check if a connection exists before attempting to shutdown, a peer
+   * that already sent its FIN_ACK leaves us in CLOSING_BY_PEER */
+  if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER) {
     perror("Error --> Cannot shutdown a non established connection");
-    return -1;
+    goto fail;
   }
 
-  /* setup client header with FIN_ACK to server 
-   * this is the first message for terminating the connection
-   */
-  srand(time(NULL));  
-  client_h.seq_number = htonl(rand());
-  client_h.ack_number = htonl(0);
-  client_h.control    = htons(FIN_ACK);
-  client_h.window     = htons(MICROTCP_WIN_SIZE);
-  client_h.data_len   = htonl(32);
-/* future_used members are not used so no need to initialize them.... */
-
-  bytes_sent = sendto(socket->sd, &client_h, sizeof(microtcp_header_t), 0, (struct sockaddr *)&addr, addr_len);
-  if (bytes_sent < 0) {
-      socket->state = INVALID;
-      perror("Error sending FIN_ACK to server for terminating connection");
-      return -1;
-  } else {
-    socket->packets_send++;
-    socket->bytes_send += bytes_sent;
+  /* whatever is still corked must reach the peer before the FIN */
+  if (socket->state == ESTABLISHED && microtcp_flush(socket) < 0) {
+    goto fail;
   }
+  fin_seq = socket->seq_number;
 
-  
 
-  while (bytes_recvd < 0) {
-  	bytes_recvd = recvfrom(socket->sd, &server_h, sizeof(microtcp_header_t), 0, (struct sockaddr *)&addr, &addr_len);
+  /* send FIN_ACK until the peer ACKs it. the peer's own FIN_ACK
+   * acknowledges ours too, so it may arrive instead of the plain ACK */
+  for (tries = 0; !acked && tries < MICROTCP_FIN_RETRIES; tries++) {
+    if (send_segment(socket, fin_seq, FIN_ACK, NULL, 0) < 0) {
+      perror("Error sending FIN_ACK for terminating connection");
+      goto fail;
+    }
+    /* a peer that is still sending must not keep us here forever */
+    deadline = now_us() + socket->opt.ack_timeout_us;
+    while (now_us() < deadline && (ret = recv_ack(socket, &header, 0)) >= 0) {
+      if (ret && ntohl(header.ack_number) == fin_seq + 1) {
+        acked = 1;
+        if (ntohs(header.control) == FIN_ACK) {
+          got_fin = 1;
+          peer_fin = ntohl(header.seq_number);
+        }
+        break;
+      }
+    }
   }
-  socket->packets_received++;
-  socket->bytes_received += bytes_recvd;
-  socket->state = CLOSING_BY_PEER;
-
-
-
-  /* client-side: check if server responded with ACK on client's FIN_ACK */
-  if (socket->id == CLIENT && ntohs(server_h.control) == ACK
-    && ntohl(server_h.ack_number) == ntohl(client_h.seq_number) + 1) {
-    socket->state = CLOSING_BY_HOST;
-  } else {
-      socket->state = INVALID;
-      perror("Error in closing connection");
-      return -1;
+  if (!acked) {
+    perror("Error in closing connection, FIN_ACK was never ACKed");
+    goto fail;
   }
+  socket->seq_number = fin_seq + 1;
 
 
-  /* any other things to be done before server sending FIN_ACK
-   * will change the state when it gets called the 2nd time 
-   */
-  if (socket->id == SERVER) {
+  /* passive side: the peer's FIN was ACKed in the receive path, all done */
+  if (socket->state == CLOSING_BY_PEER) {
+    socket->state = CLOSED;
+    release_connection(socket);
     return 0;
-  } else {
-  	  bytes_recvd = -1;
-      while (bytes_recvd < 0) {
-        bytes_recvd = recvfrom(socket->sd, &server_h, sizeof(microtcp_header_t), 0, (struct sockaddr *)&addr, &addr_len);
-      }
-      socket->packets_received++;
-      socket->bytes_received += bytes_recvd;
-      /* checking if server sent FINACK message */
-      if (ntohs(server_h.control) != FIN_ACK) {
-        perror("Error sending FIN_ACK in shutdown");
-        return -1;
-      }
-
+  }
 
-      /* should pass here if FIN_ACK was sent */
-      /* setup final ACK response to server's FIN_ACK message */
-      client_h.seq_number = server_h.ack_number;
-      client_h.ack_number = htonl(ntohl(server_h.seq_number) + 1);
-      client_h.control = htons(ACK);
-      bytes_sent = sendto(socket->sd, &client_h, sizeof(microtcp_header_t), 0, (struct sockaddr *)&addr, addr_len);
-      
-      if (bytes_sent < 0) {
-        perror("Error sending ACK to server (in response of FIN_ACK) in shutdown");
-        return -1;
-      } else {
-        socket->packets_send++;
-        socket->bytes_send += bytes_sent;
+  /* active side: wait for the peer to finish as well */
+  socket->state = CLOSING_BY_HOST;
+  for (tries = 0; !got_fin && tries < MICROTCP_FIN_RETRIES; tries++) {
+    deadline = now_us() + socket->opt.ack_timeout_us;
+    while (now_us() < deadline && (ret = recv_ack(socket, &header, 0)) >= 0) {
+      if (ret && ntohs(header.control) == FIN_ACK) {
+        got_fin = 1;
+        peer_fin = ntohl(header.seq_number);
+        break;
       }
+    }
+  }
 
-      socket->state = CLOSED;   /* connection CLOSED!! */
-
+  /* setup final ACK response to peer's FIN_ACK message */
+  if (got_fin) {
+    socket->ack_number = peer_fin + 1;
+    if (send_ack(socket) < 0) {
+      perror("Error sending ACK (in response of FIN_ACK) in shutdown");
+      goto fail;
+    }
   }
 
+  release_connection(socket);
+  socket->state = CLOSED;   /* connection CLOSED!! */
   return 0;
-}
-
 
+fail:
+  /* the connection is over either way, nothing may stay allocated. a
+   * peer that closed during the flush has closed it already */
+  if (socket->state != CLOSED) {
+    socket->state = INVALID;
+  }
+  release_connection(socket);
+  return -1;
+}
+
+
+int
+microtcp_close (microtcp_sock_t *socket)
+{
+  int ret;
+
+  if (socket->sd < 0) {
+    return 0;  /* never created, or closed already */
+  }
+  release_connection(socket);
+  ret = close(socket->sd);
+  socket->sd = -1;
+  if (socket->state != CLOSED) {
+    socket->state = INVALID;
+  }
+  return ret;
+}
+
+
+
+
+
+/* ------> For the 2nd phase <------ */
+
+
+/* current monotonic time in microseconds, used for the cork timer */
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* full duplex. whichever thread waits for a segment reads the UDP
+ * socket, the others wait on the condition. segments for the other side
+ * go to its queue: data, probes and FINs are the receiver's, plain ACKs
+ * and a copy of each FIN the sender's. the receiver leaves its ACK
+ * number and window here for the segments the sender builds */
+#define DUPLEX_TX 0
+#define DUPLEX_RX 1
+#define DUPLEX_QUEUE_LEN 256            /* segments a queue holds at most */
+#define DUPLEX_QUEUE_BYTES (512 * 1024)  /* and the bytes */
+
+struct seg_queue
+{
+  uint8_t *slots;               /* cap segments of slot_len bytes */
+  size_t slot_len;
+  unsigned cap;
+  size_t len[DUPLEX_QUEUE_LEN];
+  uint8_t carried[DUPLEX_QUEUE_LEN];  /* the ACK of a data segment */
+  unsigned head;
+  unsigned count;
+};
+
+struct duplex
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int reading;                  /* a thread is in recvmsg() */
+  struct seg_queue q[2];
+  uint8_t *scratch;             /* the sender reads whole segments into it */
+  uint32_t ack;                 /* what the receiver ACKed last */
+  uint16_t window;
+  uint32_t seq;                 /* the sender's next sequence number on the wire */
+  uint64_t srtt_us;             /* the sender's srtt, 0 before the first sample */
+  uint32_t carried_ack;         /* highest ACK taken from a data segment */
+};
+
+
+/* builds the header of a segment and sends it together with the payload.
+ * header and payload go out with a single sendmsg() so the payload is
+ * never copied into an intermediate buffer
+ */
+static ssize_t
+send_segment_opt (microtcp_sock_t *socket, uint32_t seq, uint16_t control,
+                  uint32_t opt0, uint32_t opt1, uint32_t opt2,
+                  const uint8_t *payload, size_t len)
+{
+  struct duplex *d = socket->duplex;
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t bytes_sent;
+  uint32_t ack;
+  uint16_t window;
+
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+    ack = d->ack;
+    window = d->window;
+    pthread_mutex_unlock(&d->lock);
+  } else {
+    ack = socket->ack_number;
+    window = window_encode(socket);
+  }
+  segment_encode_opt(&header, seq, ack, control, window, opt0, opt1, opt2, payload, len);
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len  = sizeof(microtcp_header_t);
+  iov[1].iov_base = (void *)payload;
+  iov[1].iov_len  = len;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_name    = &socket->address;
+  msg.msg_namelen = socket->address_len;
+  msg.msg_iov     = iov;
+  msg.msg_iovlen  = len ? 2 : 1;
+
+  bytes_sent = sendmsg(socket->sd, &msg, 0);
+  if (bytes_sent < 0) {
+    perror("Error sending segment");
+    return -1;
+  }
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+    /* only the sending thread sends data */
+    if (len && reasm_seq_before(d->seq, seq + len)) {
+      d->seq = seq + len;
+    }
+  }
+  socket->packets_send++;
+  socket->bytes_send += bytes_sent;
+  if (d) {
+    pthread_mutex_unlock(&d->lock);
+  }
+  return bytes_sent;
+}
+
+
+static ssize_t
+send_segment (microtcp_sock_t *socket, uint32_t seq, uint16_t control,
+              const uint8_t *payload, size_t len)
+{
+  return send_segment_opt(socket, seq, control, 0, 0, 0, payload, len);
+}
+
+
+/* a pure ACK of the receive path. with full duplex it also leaves the
+ * ACK number and the window for the sender's segments, and takes the
+ * sequence number from what the sender put on the wire */
+static int
+send_ack (microtcp_sock_t *socket)
+{
+  struct duplex *d = socket->duplex;
+  uint32_t seq;
+
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+    d->ack = socket->ack_number;
+    d->window = window_encode(socket);
+    seq = d->seq;
+    pthread_mutex_unlock(&d->lock);
+  } else {
+    seq = socket->seq_number;
+  }
+  return send_segment(socket, seq, ACK, NULL, 0) < 0 ? -1 : 0;
+}
+
+
+/* with full duplex the receiving thread moves the state on the peer's
+ * FIN or an error, the sending thread reads it under the same lock */
+static void
+set_state (microtcp_sock_t *socket, mircotcp_state_t state)
+{
+  struct duplex *d = socket->duplex;
+
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+  }
+  socket->state = state;
+  if (d) {
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+
+/* whether the sending calls may go on. once the peer closed, or we did,
+ * they fail with EPIPE like send(2) */
+static int
+send_ready (microtcp_sock_t *socket)
+{
+  struct duplex *d = socket->duplex;
+  mircotcp_state_t state;
+
+  if (d) {
+    pthread_mutex_lock(&d->lock);
+  }
+  state = socket->state;
+  if (d) {
+    pthread_mutex_unlock(&d->lock);
+  }
+  if (state == ESTABLISHED) {
+    return 1;
+  }
+  if (state == CLOSING_BY_PEER || state == CLOSING_BY_HOST || state == CLOSED) {
+    errno = EPIPE;
+    return 0;
+  }
+  perror("Error : Connection not established");
+  return 0;
+}
+
+
+static void
+seg_queue_push (struct seg_queue *q, const uint8_t *seg, size_t len, int carried)
+{
+  unsigned i;
+
+  if (len > q->slot_len) {
+    return;
+  }
+  if (q->count == q->cap) {  /* the oldest goes, like a drop on the way */
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+  }
+  i = (q->head + q->count) % q->cap;
+  memcpy(q->slots + i * q->slot_len, seg, len);
+  q->len[i] = len;
+  q->carried[i] = carried;
+  q->count++;
+}
+
+
+/* scatters the oldest segment of q over the iovecs of msg */
+static ssize_t
+seg_queue_pop (struct seg_queue *q, struct msghdr *msg, int *carried)
+{
+  const uint8_t *seg = q->slots + q->head * q->slot_len;
+  size_t len = q->len[q->head], off = 0, n, i;
+
+  for (i = 0; i < msg->msg_iovlen && off < len; i++) {
+    n = len - off < msg->msg_iov[i].iov_len ? len - off : msg->msg_iov[i].iov_len;
+    memcpy(msg->msg_iov[i].iov_base, seg + off, n);
+    off += n;
+  }
+  msg->msg_flags = off < len ? MSG_TRUNC : 0;
+  if (carried) {
+    *carried = q->carried[q->head];
+  }
+  q->head = (q->head + 1) % q->cap;
+  q->count--;
+  return len;
+}
+
+
+/* the side of the connection a segment is for */
+static int
+seg_side (const microtcp_header_t *header, size_t len)
+{
+  if (len != sizeof(microtcp_header_t) || (ntohs(header->control) & FIN)
+      || (ntohl(header->future_use0) & OPT_PROBE)) {
+    return DUPLEX_RX;
+  }
+  return DUPLEX_TX;
+}
+
+
+/* recvmsg() on the UDP socket for one side of the connection. with full
+ * duplex the segment may come from the side's queue, or be read here and
+ * handed to the other side. carried, if set, tells the sender that the
+ * segment is the ACK part of a data segment */
+static ssize_t
+seg_recv (microtcp_sock_t *socket, int side, struct msghdr *msg, int flags, int *carried)
+{
+  struct duplex *d = socket->duplex;
+  microtcp_header_t *header;
+  struct timespec until;
+  struct iovec iov;
+  struct msghdr tmp;
+  ssize_t bytes_recvd;
+  uint64_t deadline;
+  int err;
+
+  if (carried) {
+    *carried = 0;
+  }
+  if (!d) {
+    bytes_recvd = recvmsg(socket->sd, msg, flags);
+    if (bytes_recvd > 0) {
+      socket->packets_received++;
+      socket->bytes_received += bytes_recvd;
+    }
+    return bytes_recvd;
+  }
+
+  deadline = now_us() + socket->opt.ack_timeout_us;
+  until.tv_sec = 0;
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    if (d->q[side].count) {
+      bytes_recvd = seg_queue_pop(&d->q[side], msg, carried);
+      pthread_mutex_unlock(&d->lock);
+      return bytes_recvd;
+    }
+
+    if (d->reading) {
+      if (flags & MSG_DONTWAIT) {
+        pthread_mutex_unlock(&d->lock);
+        errno = EAGAIN;
+        return -1;
+      }
+      if (!until.tv_sec) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += socket->opt.ack_timeout_us / 1000000;
+        until.tv_nsec += (socket->opt.ack_timeout_us % 1000000) * 1000;
+        if (until.tv_nsec >= 1000000000) {
+          until.tv_sec++;
+          until.tv_nsec -= 1000000000;
+        }
+      }
+      if (pthread_cond_timedwait(&d->wake, &d->lock, &until) == ETIMEDOUT
+          && !d->q[side].count) {
+        pthread_mutex_unlock(&d->lock);
+        errno = EAGAIN;
+        return -1;
+      }
+      continue;
+    }
+
+    /* read it ourselves. the receiver reads in place, the sender into
+     * scratch since it only takes headers */
+    d->reading = 1;
+    pthread_mutex_unlock(&d->lock);
+    if (side == DUPLEX_RX) {
+      bytes_recvd = recvmsg(socket->sd, msg, flags);
+      header = msg->msg_iov[0].iov_base;
+    } else {
+      iov.iov_base = d->scratch;
+      iov.iov_len = d->q[DUPLEX_RX].slot_len;
+      memset(&tmp, 0, sizeof(struct msghdr));
+      tmp.msg_iov = &iov;
+      tmp.msg_iovlen = 1;
+      bytes_recvd = recvmsg(socket->sd, &tmp, flags);
+      header = (microtcp_header_t *)d->scratch;
+    }
+    err = errno;
+    pthread_mutex_lock(&d->lock);
+    d->reading = 0;
+    pthread_cond_broadcast(&d->wake);
+    if (bytes_recvd < 0) {
+      pthread_mutex_unlock(&d->lock);
+      errno = err;
+      return -1;
+    }
+    socket->packets_received++;
+    socket->bytes_received += bytes_recvd;
+
+    if (side == DUPLEX_RX) {
+      if (seg_side(header, bytes_recvd) == DUPLEX_RX) {
+        if (ntohs(header->control) & FIN) {
+          seg_queue_push(&d->q[DUPLEX_TX], (uint8_t *)header, sizeof(microtcp_header_t), 0);
+        }
+        pthread_mutex_unlock(&d->lock);
+        return bytes_recvd;
+      }
+      seg_queue_push(&d->q[DUPLEX_TX], (uint8_t *)header, bytes_recvd, 0);
+    } else if (tmp.msg_flags & MSG_TRUNC) {
+      /* too large for the receiver as well */
+    } else if (seg_side(header, bytes_recvd) == DUPLEX_RX) {
+      seg_queue_push(&d->q[DUPLEX_RX], d->scratch, bytes_recvd, 0);
+      if (ntohs(header->control) & FIN) {
+        seg_queue_push(&d->q[DUPLEX_TX], d->scratch, sizeof(microtcp_header_t), 0);
+      }
+    } else {
+      seg_queue_push(&d->q[DUPLEX_TX], d->scratch, bytes_recvd, 0);
+    }
+    if (flags & MSG_DONTWAIT && !d->q[side].count) {
+      pthread_mutex_unlock(&d->lock);
+      errno = EAGAIN;
+      return -1;
+    }
+    if (now_us() >= deadline && !d->q[side].count) {
+      pthread_mutex_unlock(&d->lock);
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+}
+
+
+/* the receiver took a data segment: its ACK goes to the sender as well,
+ * unless the sender has seen it already */
+static void
+duplex_carry_ack (microtcp_sock_t *socket, const microtcp_header_t *header)
+{
+  struct duplex *d = socket->duplex;
+  microtcp_header_t ack_h;
+  uint32_t ack = ntohl(header->ack_number);
+
+  if (!(ntohs(header->control) & ACK)) {
+    return;
+  }
+  pthread_mutex_lock(&d->lock);
+  if (reasm_seq_before(d->carried_ack, ack)) {
+    d->carried_ack = ack;
+    segment_encode(&ack_h, ntohl(header->seq_number), ack, ACK, ntohs(header->window),
+                   NULL, 0);
+    seg_queue_push(&d->q[DUPLEX_TX], (uint8_t *)&ack_h, sizeof(microtcp_header_t), 1);
+    pthread_cond_broadcast(&d->wake);
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+
+/* the queues and the state itself, any of them may be missing */
+static void
+duplex_release (struct duplex *d)
+{
+  slab_free(d->q[DUPLEX_TX].slots, d->q[DUPLEX_TX].cap * d->q[DUPLEX_TX].slot_len);
+  slab_free(d->q[DUPLEX_RX].slots, d->q[DUPLEX_RX].cap * d->q[DUPLEX_RX].slot_len);
+  slab_free(d->scratch, d->q[DUPLEX_RX].slot_len);
+  slab_free(d, sizeof(struct duplex));
+}
+
+
+static void
+duplex_free (microtcp_sock_t *socket)
+{
+  struct duplex *d = socket->duplex;
+
+  if (d) {
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->wake);
+    duplex_release(d);
+    socket->duplex = NULL;
+  }
+}
+
+
+/* waits for an ACK from the peer, flags go to recvmsg().
+ * returns -1 on timeout, 0 for a corrupted or a non ACK segment, 1 for
+ * an ACK, 2 for the ACK of a data segment, which is never a duplicate
+ */
+static int
+recv_ack (microtcp_sock_t *socket, microtcp_header_t *header, int flags)
+{
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t bytes_recvd;
+  int carried;
+
+  iov.iov_base = header;
+  iov.iov_len = sizeof(microtcp_header_t);
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  bytes_recvd = seg_recv(socket, DUPLEX_TX, &msg, flags, &carried);
+  if (bytes_recvd < 0) {
+    return -1;
+  }
+  if (bytes_recvd < (ssize_t)sizeof(microtcp_header_t)) {
+    return 0;
+  }
+
+  if (!segment_verify(header, NULL, 0)) {
+    return 0;
+  }
+  if (!(ntohs(header->control) & ACK)) {
+    return 0;
+  }
+  return carried ? 2 : 1;
+}
+
+
+/* for timeout case */
+int min(int MSS, int SSTHRESH) {
+  if (MSS < SSTHRESH)
+    return MSS;
+  else
+    return SSTHRESH;
+}
+
+
+#if MICROTCP_TRACE
+/* dumps the trace in $MICROTCP_TRACE_DIR when the connection goes away */
+static void
+trace_dump_at_close (microtcp_sock_t *socket)
+{
+  const char *dir = getenv("MICROTCP_TRACE_DIR");
+  char path[512];
+  int fd;
+
+  if (!dir) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/microtcp-%d-%d.trace", dir, (int)getpid(), socket->sd);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Error opening trace dump");
+    return;
+  }
+  if (trace_dump(socket->trace, fd) < 0) {
+    perror("Error writing trace dump");
+  }
+  close(fd);
+}
+#endif
+
+
+static inline size_t
+recvbuf_len (const microtcp_sock_t *socket)
+{
+  return socket->mss > MICROTCP_MSS ? socket->mss : MICROTCP_MSS;
+}
+
+
+/* per connection state that lives from the handshake until shutdown */
+static void
+setup_connection (microtcp_sock_t *socket)
+{
+  /* recvbuf only keeps what is left of one segment, or the SYN data.
+   * the window itself lives in the caller's buffer and the UDP socket */
+  socket->recvbuf = slab_alloc(recvbuf_len(socket));
+  socket->buf_fill_level = 0;
+  reasm_clear(&socket->reasm);
+
+  socket->rcv_edge = socket->ack_number + socket->rcvbuf_len;
+  socket->persist_us = 0;
+  socket->rcv_rtt_stamp = 0;
+  socket->rcv_space = 0;
+  socket->rcv_space_stamp = 0;
+  socket->last_rx_us = 0;
+
+  socket->rtt_hist = slab_alloc(sizeof(histogram_t));
+  if (socket->rtt_hist && histogram_init(socket->rtt_hist, 3) < 0) {
+    slab_free(socket->rtt_hist, sizeof(histogram_t));
+    socket->rtt_hist = NULL;
+  }
+#if MICROTCP_TRACE
+  socket->trace = trace_ring_new();
+#endif
+}
+
+
+static void
+release_connection (microtcp_sock_t *socket)
+{
+  slab_free(socket->recvbuf, recvbuf_len(socket));
+  socket->recvbuf = NULL;
+  slab_free(socket->reasm_buf, socket->reasm_buf_len);
+  socket->reasm_buf = NULL;
+  socket->reasm_buf_len = 0;
+  reasm_clear(&socket->reasm);
+  slab_free(socket->cork_buf, socket->mss);
+  socket->cork_buf = NULL;
+  socket->cork_len = 0;
+  sndq_free(socket);
+  duplex_free(socket);
+  stream_table_free(&socket->tx_streams);
+  stream_table_free(&socket->rx_streams);
+  if (socket->rtt_hist) {
+    histogram_free(socket->rtt_hist);
+    slab_free(socket->rtt_hist, sizeof(histogram_t));
+    socket->rtt_hist = NULL;
+  }
+#if MICROTCP_TRACE
+  if (socket->trace) {
+    trace_dump_at_close(socket);
+    free(socket->trace);
+    socket->trace = NULL;
+  }
+#endif
+}
+
+
+/* RTT estimation of RFC 6298 */
+static void
+rtt_sample (microtcp_sock_t *socket, uint64_t rtt)
+{
+  uint64_t err;
+
+  if (!socket->rtt_samples) {
+    socket->srtt_us = rtt;
+    socket->rttvar_us = rtt / 2;
+    socket->min_rtt_us = rtt;
+  } else {
+    err = socket->srtt_us > rtt ? socket->srtt_us - rtt : rtt - socket->srtt_us;
+    socket->rttvar_us = (3 * socket->rttvar_us + err) / 4;
+    socket->srtt_us = (7 * socket->srtt_us + rtt) / 8;
+    if (rtt < socket->min_rtt_us) {
+      socket->min_rtt_us = rtt;
+    }
+  }
+  socket->rtt_samples++;
+  if (socket->duplex) {
+    pthread_mutex_lock(&socket->duplex->lock);
+    socket->duplex->srtt_us = socket->srtt_us;
+    pthread_mutex_unlock(&socket->duplex->lock);
+  }
+  if (socket->rtt_hist) {
+    histogram_record(socket->rtt_hist, rtt);
+  }
+}
+
+
+/* how long tx_collect_acks() goes on */
+#define TX_ROUND 0              /* until everything sent is ACKed */
+#define TX_SOME 1               /* until the window moved and no ACK is queued */
+#define TX_POLL 2               /* only the ACKs already queued */
+
+
+/* counts a segment at offset off that just went out */
+static void
+tx_account (microtcp_sock_t *socket, tx_state_t *tx, size_t off, size_t len)
+{
+  if (off < tx->sent_max) {
+    TRACE_EVENT(socket, TRACE_RETX, tx->base + off, 0, len);
+    socket->packets_lost++;
+    socket->bytes_lost += len;
+  } else {
+    TRACE_EVENT(socket, TRACE_TX, tx->base + off, 0, len);
+  }
+  /* time one segment per round trip, never a retransmitted one */
+  if (off >= tx->sent_max && !tx->rtt_end) {
+    tx->rtt_end = off + len;
+    tx->rtt_stamp = now_us();
+  }
+  tx->sent = off + len;
+  if (tx->sent > tx->sent_max) {
+    tx->sent_max = tx->sent;
+  }
+}
+
+
+/* the persist timer: with nothing in flight and a zero window, an
+ * empty segment makes the peer repeat its window. the wait for the
+ * answer ends with the first ACK that opens the window. every probe
+ * that goes unanswered doubles the wait, starting from the ACK timeout.
+ * returns -1 if the peer closed meanwhile */
+static int
+tx_persist (microtcp_sock_t *socket, tx_state_t *tx)
+{
+  microtcp_header_t ack_h;
+  struct pollfd pfd;
+  uint64_t deadline, now;
+  int ret;
+
+  if (!socket->persist_us) {
+    socket->persist_us = socket->opt.ack_timeout_us;
+  }
+  if (send_segment_opt(socket, tx->base + tx->acked, ACK, OPT_PROBE, 0, 0, NULL, 0) < 0) {
+    return -1;
+  }
+  socket->window_probes++;
+
+  /* with full duplex the socket is shared, the ACK timeout is the
+   * granularity of the wait then */
+  pfd.fd = socket->sd;
+  pfd.events = POLLIN;
+  deadline = now_us() + socket->persist_us;
+  while (!socket->curr_win_size && (now = now_us()) < deadline) {
+    if (!socket->duplex) {
+      ret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+      if (ret < 0 && errno != EINTR) {
+        perror("Error waiting for a window update");
+        return -1;
+      }
+      if (ret <= 0) {
+        continue;
+      }
+    }
+    if (recv_ack(socket, &ack_h, socket->duplex ? 0 : MSG_DONTWAIT) <= 0) {
+      continue;
+    }
+    if (ntohs(ack_h.control) == FIN_ACK) {
+      if (!socket->duplex) {
+        passive_close(socket, ntohl(ack_h.seq_number));
+      }
+      errno = EPIPE;
+      return -1;
+    }
+    socket->curr_win_size = window_decode(socket, &ack_h);
+  }
+
+  if (socket->curr_win_size) {
+    socket->persist_us = 0;
+    TRACE_EVENT(socket, TRACE_WND, 0, tx->base + tx->acked, 0);
+  } else if (socket->persist_us < MICROTCP_PERSIST_MAX_US / 2) {
+    socket->persist_us *= 2;
+  } else {
+    socket->persist_us = MICROTCP_PERSIST_MAX_US;
+  }
+  return 0;
+}
+
+
+/* the retransmission timer fired, the caller goes back to tx->acked */
+static void
+tx_timeout (microtcp_sock_t *socket, tx_state_t *tx)
+{
+  socket->ssthresh = halve_cwnd(socket);
+  socket->cwnd = min(socket->mss, socket->ssthresh);
+  socket->retrans_timeout++;
+  TRACE_EVENT(socket, TRACE_TIMEOUT, tx->base + tx->acked, 0, tx->sent - tx->acked);
+  TRACE_EVENT(socket, TRACE_CWND, tx->base + tx->acked, 0, socket->ssthresh);
+  tx->rtt_end = 0;
+}
+
+
+/* collects the ACKs of one round. returns 0 once everything sent is
+ * ACKed, or on a timeout or the third duplicate ACK, after which the
+ * caller goes back to tx->acked. with TX_SOME or TX_POLL it may return
+ * 1 before, nothing is lost then. on_ack, if set, sees every ACK first.
+ * returns -1 if the peer closed meanwhile */
+static int
+tx_collect_acks (microtcp_sock_t *socket, tx_state_t *tx, int mode,
+                 void (*on_ack) (void *arg, const microtcp_header_t *h), void *arg)
+{
+  microtcp_header_t ack_h;
+  int ret, flags, moved = 0;
+
+  socket->bytes_in_flight = tx->sent - tx->acked;
+  while (tx->acked < tx->sent) {
+    flags = (mode == TX_POLL || (mode == TX_SOME && moved)) ? MSG_DONTWAIT : 0;
+    ret = recv_ack(socket, &ack_h, flags);
+    if (ret < 0 && flags && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    }
+    if (ret < 0) {  /* we have a timeout and need to retransmit */
+      tx_timeout(socket, tx);
+      break;
+    } else if (!ret) {
+      continue;
+    }
+
+    /* the peer closed while we were still sending. with full duplex the
+     * receiving thread sees the FIN as well and ACKs it */
+    if (ntohs(ack_h.control) == FIN_ACK) {
+      if (!socket->duplex) {
+        passive_close(socket, ntohl(ack_h.seq_number));
+      }
+      socket->bytes_in_flight = 0;
+      errno = EPIPE;
+      return -1;
+    }
+    if (on_ack) {
+      on_ack(arg, &ack_h);
+    }
+
+    ret = ack_process(socket, tx, &ack_h, ret == 2);
+    if (ret == ACK_MOVED) {
+      if (tx->rtt_end && tx->acked >= tx->rtt_end) {
+        rtt_sample(socket, now_us() - tx->rtt_stamp);
+        tx->rtt_end = 0;
+      }
+      tx->moved_us = now_us();
+      moved = 1;
+    } else if (ret == ACK_FAST_RETRANSMIT) {
+      break;
+    }
+  }
+  return 0;
+}
+
+
+/* sends length bytes with go-back-N inside the congestion/flow control
+ * window and returns once all of them have been ACKed
+ */
+static ssize_t
+transmit (microtcp_sock_t *socket, const uint8_t *buffer, size_t length)
+{
+  tx_state_t tx;
+  size_t window, len;
+  uint64_t start = now_us();
+
+  memset(&tx, 0, sizeof(tx_state_t));
+  tx.base = socket->seq_number;
+
+  while (tx.acked < length) {
+    window = socket->cwnd < socket->curr_win_size ? socket->cwnd : socket->curr_win_size;
+
+    /* 4. Flow Control */
+    if (!window) {  /* probe until the window opens again */
+      if (tx_persist(socket, &tx) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    /* 1. send as many segments as the window allows, a runt is only
+     * allowed when nothing else is in flight */
+    tx.sent = tx.acked;
+    while (tx.sent < length) {
+      len = length - tx.sent < socket->mss ? length - tx.sent : socket->mss;
+      if (tx.sent - tx.acked + len > window) {
+        if (tx.sent > tx.acked) {
+          break;
+        }
+        len = window;
+      }
+      if (send_segment(socket, tx.base + tx.sent, ACK, buffer + tx.sent, len) < 0) {
+        return -1;
+      }
+      tx_account(socket, &tx, tx.sent, len);
+    }
+
+    /* 2. collect the ACKs, on loss go back to the first unacked byte */
+    if (tx_collect_acks(socket, &tx, TX_ROUND, NULL, NULL) < 0) {
+      return -1;
+    }
+  }
+
+  socket->bytes_in_flight = 0;
+  socket->send_active_us += now_us() - start;
+  socket->seq_number = tx.base + length;
+  return length;
+}
+
+
+/* the send buffer. buf holds the bytes from tx.base on, those before
+ * tx.acked are ACKed and only wait for the space to be reused */
+struct send_queue
+{
+  uint8_t *buf;
+  size_t cap;                   /* allocated */
+  size_t len;                   /* queued, counted from tx.base */
+  size_t limit;                 /* the most bytes not ACKed yet */
+  tx_state_t tx;
+};
+
+
+static void
+sndq_set_limit (microtcp_sock_t *socket, size_t limit)
+{
+  if (socket->sndq) {
+    socket->sndq->limit = limit;
+  }
+}
+
+
+static void
+sndq_free (microtcp_sock_t *socket)
+{
+  if (socket->sndq) {
+    slab_free(socket->sndq->buf, socket->sndq->cap);
+    slab_free(socket->sndq, sizeof(struct send_queue));
+    socket->sndq = NULL;
+  }
+}
+
+
+/* the buffer holds the window in flight and as much again to send when
+ * its ACKs come back */
+static void
+sndq_tune (microtcp_sock_t *socket)
+{
+  size_t want = socket->cwnd < socket->curr_win_size ? socket->cwnd : socket->curr_win_size;
+
+  want = 2 * want < MICROTCP_SNDBUF_MAX ? 2 * want : MICROTCP_SNDBUF_MAX;
+  if (!socket->sndbuf_locked && want > socket->sndq->limit) {
+    socket->sndq->limit = want;
+  }
+}
+
+
+/* makes room for len more bytes at the end of the buffer. the ACKed
+ * head is dropped first, the buffer grows only up to the limit */
+static int
+sndq_reserve (struct send_queue *q, size_t len)
+{
+  tx_state_t *tx = &q->tx;
+  size_t cap;
+  uint8_t *buf;
+
+  if (q->len + len <= q->cap) {
+    return 0;
+  }
+  if (tx->acked) {
+    memmove(q->buf, q->buf + tx->acked, q->len - tx->acked);
+    tx->base += tx->acked;
+    tx->sent -= tx->acked;
+    tx->sent_max -= tx->acked;
+    if (tx->rtt_end) {
+      tx->rtt_end -= tx->acked;
+    }
+    tx->recover = tx->recover > tx->acked ? tx->recover - tx->acked : 0;
+    q->len -= tx->acked;
+    tx->acked = 0;
+  }
+  if (q->len + len <= q->cap) {
+    return 0;
+  }
+  cap = q->limit > q->len + len ? q->limit : q->len + len;
+  buf = slab_realloc(q->buf, q->cap, cap, q->len);
+  if (!buf) {
+    perror("Allocate send buffer");
+    return -1;
+  }
+  q->buf = buf;
+  q->cap = cap;
+  return 0;
+}
+
+
+/* a runt held back by Nagle goes once nothing is in flight, one held
+ * back by cork or MICROTCP_MSG_MORE once it waited for the timeout */
+static int
+cork_due (const microtcp_sock_t *socket)
+{
+  const struct send_queue *q = socket->sndq;
+
+  if (!socket->cork_len) {
+    return 0;
+  }
+  if (now_us() - socket->cork_stamp >= MICROTCP_CORK_TIMEOUT_US) {
+    return 1;
+  }
+  return !socket->cork_more && (!q || q->tx.acked == q->len);
+}
+
+
+/* appends the corked runt to the send buffer, the pump sends it */
+static int
+cork_queue (microtcp_sock_t *socket)
+{
+  struct send_queue *q = socket->sndq;
+
+  if (sndq_reserve(q, socket->cork_len) < 0) {
+    return -1;
+  }
+  memcpy(q->buf + q->len, socket->cork_buf, socket->cork_len);
+  q->len += socket->cork_len;
+  socket->seq_number = q->tx.base + q->len;
+  socket->cork_len = 0;
+  return 0;
+}
+
+
+/* moves the send buffer along: sends what the windows allow, then takes
+ * the ACKs. TX_POLL never blocks, the retransmission timer is checked
+ * by hand then. TX_SOME waits for the window to move */
+static int
+sndq_pump (microtcp_sock_t *socket, int mode)
+{
+  struct send_queue *q = socket->sndq;
+  tx_state_t *tx = &q->tx;
+  size_t window, len;
+  int ret;
+
+  if (cork_due(socket) && cork_queue(socket) < 0) {
+    return -1;
+  }
+
+  /* with data in flight its ACKs bring the window back */
+  window = socket->cwnd < socket->curr_win_size ? socket->cwnd : socket->curr_win_size;
+  if (!window && tx->sent == tx->acked) {
+    return mode == TX_POLL ? 0 : tx_persist(socket, tx);
+  }
+
+  /* same rules as transmit(), but what is in flight stays there */
+  if (tx->sent == tx->acked) {
+    tx->moved_us = now_us();
+  }
+  while (tx->sent < q->len) {
+    len = q->len - tx->sent < socket->mss ? q->len - tx->sent : socket->mss;
+    if (tx->sent - tx->acked + len > window) {
+      if (tx->sent > tx->acked) {
+        break;
+      }
+      len = window;
+    }
+    if (send_segment(socket, tx->base + tx->sent, ACK, q->buf + tx->sent, len) < 0) {
+      return -1;
+    }
+    tx_account(socket, tx, tx->sent, len);
+  }
+  if (tx->acked == tx->sent) {
+    return 0;
+  }
+
+  /* the socket is released if the peer closed, q is gone then */
+  ret = tx_collect_acks(socket, tx, mode, NULL, NULL);
+  if (ret < 0) {
+    return -1;
+  }
+  if (ret && mode == TX_POLL && tx->acked < tx->sent
+      && now_us() - tx->moved_us >= socket->opt.ack_timeout_us) {
+    tx_timeout(socket, tx);
+    ret = 0;
+  }
+  if (!ret) {
+    tx->sent = tx->acked;
+  }
+  sndq_tune(socket);
+  return 0;
+}
+
+
+/* copies length bytes into the send buffer, waiting for ACKs while it
+ * is full. without a send buffer it is transmit() */
+static ssize_t
+sndq_write (microtcp_sock_t *socket, const uint8_t *data, size_t length)
+{
+  struct send_queue *q = socket->sndq;
+  uint64_t start = now_us();
+  size_t done = 0, room, take;
+
+  if (!socket->opt.sndbuf) {
+    return transmit(socket, data, length);
+  }
+  if (!q) {
+    q = slab_zalloc(sizeof(struct send_queue));
+    if (!q) {
+      perror("Allocate send buffer");
+      return -1;
+    }
+    q->limit = socket->opt.sndbuf;
+    socket->sndq = q;
+  }
+  /* an empty buffer starts over where transmit() and friends left off */
+  if (q->tx.acked == q->len) {
+    memset(&q->tx, 0, sizeof(tx_state_t));
+    q->tx.base = socket->seq_number;
+    q->len = 0;
+  }
+
+  while (done < length) {
+    room = q->limit > q->len - q->tx.acked ? q->limit - (q->len - q->tx.acked) : 0;
+    if (!room) {
+      if (sndq_pump(socket, TX_SOME) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    take = length - done < room ? length - done : room;
+    if (sndq_reserve(q, take) < 0) {
+      return -1;
+    }
+    memcpy(q->buf + q->len, data + done, take);
+    q->len += take;
+    done += take;
+    socket->seq_number = q->tx.base + q->len;
+    if (sndq_pump(socket, TX_POLL) < 0) {
+      return -1;
+    }
+  }
+
+  socket->send_active_us += now_us() - start;
+  return length;
+}
+
+
+/* waits until everything in the send buffer is ACKed. a buffer that
+ * auto-tuning grew is freed, an idle connection keeps none */
+static int
+sndq_drain (microtcp_sock_t *socket)
+{
+  struct send_queue *q = socket->sndq;
+  uint64_t start = now_us();
+
+  if (!q || q->tx.acked == q->len) {
+    return 0;
+  }
+  while (q->tx.acked < q->len) {
+    if (sndq_pump(socket, TX_SOME) < 0) {
+      return -1;
+    }
+  }
+  socket->bytes_in_flight = 0;
+  socket->send_active_us += now_us() - start;
+  if (q->cap > socket->opt.sndbuf) {
+    slab_free(q->buf, q->cap);
+    q->buf = NULL;
+    q->cap = 0;
+  }
+  return 0;
+}
+
+
+/* sends count messages like transmit(). a segment never spans two
+ * messages, and the one that ends a message carries OPT_MSG_END */
+static ssize_t
+transmit_msgs (microtcp_sock_t *socket, const struct iovec *msgs, size_t count)
+{
+  tx_state_t tx;
+  size_t one, *end, total, window, len, m, lo, hi, i;
+  uint64_t start = now_us();
+  uint32_t opt;
+
+  /* end offset of every message, no allocation for a single one */
+  end = count > 1 ? slab_alloc(count * sizeof(size_t)) : &one;
+  if (!end) {
+    perror("Allocate message offsets");
+    return -1;
+  }
+  for (i = 0, total = 0; i < count; i++) {
+    total += msgs[i].iov_len;
+    end[i] = total;
+  }
+
+  memset(&tx, 0, sizeof(tx_state_t));
+  tx.base = socket->seq_number;
+
+  while (tx.acked < total) {
+    window = socket->cwnd < socket->curr_win_size ? socket->cwnd : socket->curr_win_size;
+    if (!window) {
+      if (tx_persist(socket, &tx) < 0) {
+        goto fail;
+      }
+      continue;
+    }
+
+    /* the message holding the first unacked byte */
+    for (lo = 0, hi = count - 1; lo < hi; ) {
+      m = (lo + hi) / 2;
+      if (end[m] <= tx.acked) {
+        lo = m + 1;
+      } else {
+        hi = m;
+      }
+    }
+    m = lo;
+
+    tx.sent = tx.acked;
+    while (tx.sent < total) {
+      if (end[m] == tx.sent) {
+        m++;
+      }
+      len = end[m] - tx.sent < socket->mss ? end[m] - tx.sent : socket->mss;
+      if (tx.sent - tx.acked + len > window) {
+        if (tx.sent > tx.acked) {
+          break;
+        }
+        len = window;
+      }
+      opt = tx.sent + len == end[m] ? OPT_MSG_END : 0;
+      if (send_segment_opt(socket, tx.base + tx.sent, ACK, opt, 0, 0,
+                           (const uint8_t *)msgs[m].iov_base + msgs[m].iov_len - (end[m] - tx.sent),
+                           len) < 0) {
+        goto fail;
+      }
+      tx_account(socket, &tx, tx.sent, len);
+    }
+
+    if (tx_collect_acks(socket, &tx, TX_ROUND, NULL, NULL) < 0) {
+      goto fail;
+    }
+  }
+
+  socket->bytes_in_flight = 0;
+  socket->send_active_us += now_us() - start;
+  socket->seq_number = tx.base + total;
+  if (end != &one) {
+    slab_free(end, count * sizeof(size_t));
+  }
+  return total;
+
+fail:
+  if (end != &one) {
+    slab_free(end, count * sizeof(size_t));
+  }
+  return -1;
+}
+
+
+/* offsets of the streams of a connection, one table per direction. a
+ * stream is added on its first byte and dropped after its FIN */
+typedef struct
+{
+  uint32_t id;
+  uint32_t off;                 /* next offset to send or to receive */
+} stream_entry_t;
+
+struct stream_table
+{
+  stream_entry_t *entry;        /* sorted by id */
+  size_t count;
+  size_t cap;
+};
+
+
+/* the index of id in the table, or the one it goes to */
+static size_t
+stream_find (const struct stream_table *t, uint32_t id)
+{
+  size_t lo = 0, hi = t->count, m;
+
+  while (lo < hi) {
+    m = (lo + hi) / 2;
+    if (t->entry[m].id < id) {
+      lo = m + 1;
+    } else {
+      hi = m;
+    }
+  }
+  return lo;
+}
+
+
+static int
+stream_known (const struct stream_table *t, uint32_t id)
+{
+  size_t i;
+
+  if (!t) {
+    return 0;
+  }
+  i = stream_find(t, id);
+  return i < t->count && t->entry[i].id == id;
+}
+
+
+/* returns the entry of id, adding it at offset 0 if it's new. fails
+ * with ENOBUFS when limit streams are open already, or ENOMEM */
+static stream_entry_t *
+stream_lookup (struct stream_table **table, uint32_t id, size_t limit)
+{
+  struct stream_table *t = *table;
+  stream_entry_t *grown;
+  size_t i;
+
+  if (!t) {
+    t = *table = slab_zalloc(sizeof(struct stream_table));
+    if (!t) {
+      perror("Allocate stream table");
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  i = stream_find(t, id);
+  if (i < t->count && t->entry[i].id == id) {
+    return &t->entry[i];
+  }
+  if (t->count >= limit) {
+    errno = ENOBUFS;
+    return NULL;
+  }
+  if (t->count == t->cap) {
+    grown = slab_realloc(t->entry, t->cap * sizeof(stream_entry_t),
+                         (t->cap ? 2 * t->cap : 8) * sizeof(stream_entry_t),
+                         t->count * sizeof(stream_entry_t));
+    if (!grown) {
+      perror("Allocate stream table");
+      errno = ENOMEM;
+      return NULL;
+    }
+    t->entry = grown;
+    t->cap = t->cap ? 2 * t->cap : 8;
+  }
+  memmove(&t->entry[i + 1], &t->entry[i], (t->count - i) * sizeof(stream_entry_t));
+  t->entry[i].id = id;
+  t->entry[i].off = 0;
+  t->count++;
+  return &t->entry[i];
+}
+
+
+static void
+stream_forget (struct stream_table *t, uint32_t id)
+{
+  size_t i;
+
+  if (!t) {
+    return;
+  }
+  i = stream_find(t, id);
+  if (i < t->count && t->entry[i].id == id) {
+    t->count--;
+    memmove(&t->entry[i], &t->entry[i + 1], (t->count - i) * sizeof(stream_entry_t));
+  }
+}
+
+
+static void
+stream_table_free (struct stream_table **table)
+{
+  if (*table) {
+    slab_free((*table)->entry, (*table)->cap * sizeof(stream_entry_t));
+    slab_free(*table, sizeof(struct stream_table));
+    *table = NULL;
+  }
+}
+
+
+/* one segment of transmit_streams(), in the order it first went out.
+ * go-back-N replays the log from the first unacked entry */
+typedef struct
+{
+  uint32_t off;                 /* connection offset from base */
+  uint32_t len;
+  uint32_t stream;              /* index in the caller's array */
+  uint32_t stream_off;          /* offset in this call's data of the stream */
+} tx_entry_t;
+
+/* per stream progress of transmit_streams() */
+typedef struct
+{
+  const microtcp_stream_t *streams;
+  size_t count;
+  size_t *queued;               /* bytes put in the log */
+  size_t *acked;                /* bytes ACKed */
+  size_t *credit;               /* bytes the receiver lets us have in flight */
+} tx_streams_t;
+
+
+/* the receiver grants each stream its credit in the ACKs */
+static void
+stream_credit (void *arg, const microtcp_header_t *h)
+{
+  tx_streams_t *ts = arg;
+  size_t i;
+
+  if (!(ntohl(h->future_use0) & OPT_STREAM)) {
+    return;
+  }
+  for (i = 0; i < ts->count; i++) {
+    if (ts->streams[i].id == ntohl(h->future_use1)) {
+      ts->credit[i] = ntohl(h->future_use2);
+      break;
+    }
+  }
+}
+
+
+/* sends the streams interleaved round robin, a segment per stream in
+ * turn while it has credit left. everything shares the congestion
+ * window and the go-back-N recovery of transmit() */
+static ssize_t
+transmit_streams (microtcp_sock_t *socket, const microtcp_stream_t *streams,
+                  size_t count, const uint32_t *stream_base)
+{
+  tx_state_t tx;
+  tx_streams_t ts;
+  tx_entry_t *log, *e;
+  size_t total = 0, maxlog = 0, nlog = 0, ack_idx = 0, idx, logged = 0;
+  size_t window, len = 0, i, s = 0, rr = 0;
+  uint32_t opt;
+  uint64_t start = now_us();
+
+  for (i = 0; i < count; i++) {
+    total += streams[i].length;
+    maxlog += (streams[i].length + socket->mss - 1) / socket->mss;
+  }
+  log = slab_alloc(maxlog * sizeof(tx_entry_t));
+  ts.streams = streams;
+  ts.count = count;
+  ts.queued = slab_zalloc(3 * count * sizeof(size_t));
+  if (!log || !ts.queued) {
+    perror("Allocate stream send state");
+    slab_free(log, maxlog * sizeof(tx_entry_t));
+    slab_free(ts.queued, 3 * count * sizeof(size_t));
+    return -1;
+  }
+  ts.acked = ts.queued + count;
+  ts.credit = ts.acked + count;
+  for (i = 0; i < count; i++) {
+    ts.credit[i] = MICROTCP_STREAM_WIN;
+  }
+
+  memset(&tx, 0, sizeof(tx_state_t));
+  tx.base = socket->seq_number;
+
+  while (tx.acked < total) {
+    window = socket->cwnd < socket->curr_win_size ? socket->cwnd : socket->curr_win_size;
+    if (!window) {
+      if (tx_persist(socket, &tx) < 0) {
+        goto fail;
+      }
+      continue;
+    }
+
+    /* replay the log from the first unacked entry, then add new
+     * segments. a stream with nothing in flight may always send one */
+    tx.sent = tx.acked;
+    for (idx = ack_idx; ; idx++) {
+      if (idx == nlog) {
+        for (i = 0; i < count; i++) {
+          s = (rr + i) % count;
+          len = streams[s].length - ts.queued[s];
+          if (len > socket->mss) {
+            len = socket->mss;
+          }
+          if (len && (ts.queued[s] == ts.acked[s]
+                      || ts.queued[s] - ts.acked[s] + len <= ts.credit[s])) {
+            break;
+          }
+        }
+        if (i == count || (tx.sent > tx.acked && tx.sent - tx.acked + len > window)) {
+          break;
+        }
+        e = &log[nlog++];
+        e->off = logged;
+        e->len = len;
+        e->stream = s;
+        e->stream_off = ts.queued[s];
+        logged += len;
+        ts.queued[s] += len;
+        rr = s + 1;
+      } else {
+        e = &log[idx];
+        if (tx.sent > tx.acked && tx.sent - tx.acked + e->len > window) {
+          break;
+        }
+      }
+
+      opt = OPT_STREAM;
+      if (streams[e->stream].fin && e->stream_off + e->len == streams[e->stream].length) {
+        opt |= OPT_STREAM_FIN;
+      }
+      if (send_segment_opt(socket, tx.base + e->off, ACK, opt, streams[e->stream].id,
+                           stream_base[e->stream] + e->stream_off,
+                           (const uint8_t *)streams[e->stream].buffer + e->stream_off,
+                           e->len) < 0) {
+        goto fail;
+      }
+      tx_account(socket, &tx, e->off, e->len);
+    }
+
+    if (tx_collect_acks(socket, &tx, TX_ROUND, stream_credit, &ts) < 0) {
+      goto fail;
+    }
+    while (ack_idx < nlog && log[ack_idx].off + log[ack_idx].len <= tx.acked) {
+      ts.acked[log[ack_idx].stream] = log[ack_idx].stream_off + log[ack_idx].len;
+      ack_idx++;
+    }
+  }
+
+  socket->bytes_in_flight = 0;
+  socket->send_active_us += now_us() - start;
+  socket->seq_number = tx.base + total;
+  slab_free(log, maxlog * sizeof(tx_entry_t));
+  slab_free(ts.queued, 3 * count * sizeof(size_t));
+  return total;
+
+fail:
+  slab_free(log, maxlog * sizeof(tx_entry_t));
+  slab_free(ts.queued, 3 * count * sizeof(size_t));
+  return -1;
+}
+
+
+/* moves what is corked to the send buffer */
+static int
+cork_flush (microtcp_sock_t *socket)
+{
+  size_t len = socket->cork_len;
+
+  /* emptied first, the pump must not queue the same bytes again */
+  socket->cork_len = 0;
+  return len && sndq_write(socket, socket->cork_buf, len) < 0 ? -1 : 0;
+}
+
+
+/* whatever is held back or queued goes out and is ACKed, the peer may
+ * wait for it before it answers */
+static int
+send_pending (microtcp_sock_t *socket)
+{
+  return cork_flush(socket) < 0 ? -1 : sndq_drain(socket);
+}
+
+
+/* the bytes sent and not ACKed yet, what Nagle waits for */
+static inline int
+unacked (const microtcp_sock_t *socket)
+{
+  return socket->sndq && socket->sndq->tx.acked < socket->sndq->len;
+}
+
+
+/* queues a partial segment in the cork buffer */
+static int
+cork_data (microtcp_sock_t *socket, const uint8_t *data, size_t len, int more)
+{
+  if (!socket->cork_buf) {
+    socket->cork_buf = slab_alloc(socket->mss);
+    if (!socket->cork_buf) {
+      perror("Allocate cork buffer");
+      return -1;
+    }
+  }
+  if (!socket->cork_len) {
+    socket->cork_stamp = now_us();
+  }
+  memcpy(socket->cork_buf + socket->cork_len, data, len);
+  socket->cork_len += len;
+  socket->cork_more = more;
+  return 0;
+}
+
+
+ssize_t
+microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
+               int flags)
+{
+  const uint8_t *data = buffer;
+  size_t remaining = length, take, full;
+  int hold = socket->cork || (flags & MICROTCP_MSG_MORE);
+  struct iovec msg;
+
+  if (!send_ready(socket)) {
+    return -1;
+  }
+
+  if (socket->message_mode) {
+    if (!length) {
+      return 0;
+    }
+    msg.iov_base = (void *)buffer;
+    msg.iov_len = length;
+    return sndq_drain(socket) < 0 ? -1 : transmit_msgs(socket, &msg, 1);
+  }
+
+  /* a runt that waited long enough goes out first */
+  if (socket->cork_len && now_us() - socket->cork_stamp >= MICROTCP_CORK_TIMEOUT_US) {
+    if (cork_flush(socket) < 0) {
+      return -1;
+    }
+  }
+
+  /* top up the corked segment before touching the rest of the data */
+  if (socket->cork_len) {
+    take = socket->mss - socket->cork_len;
+    if (take > remaining) {
+      take = remaining;
+    }
+    memcpy(socket->cork_buf + socket->cork_len, data, take);
+    socket->cork_len += take;
+    socket->cork_more = hold;
+    data += take;
+    remaining -= take;
+
+    if (socket->cork_len == socket->mss) {
+      if (cork_flush(socket) < 0) {
+        return -1;
+      }
+    } else if (!hold && !(socket->nagle && unacked(socket))) {
+      return cork_flush(socket) < 0 ? -1 : (ssize_t)length;
+    }
+  }
+
+  /* only full segments go out right away when coalescing */
+  full = (hold || socket->nagle) ? remaining - remaining % socket->mss : remaining;
+  if (full) {
+    if (sndq_write(socket, data, full) < 0) {
+      return -1;
+    }
+    data += full;
+    remaining -= full;
+  }
+
+  /* Nagle holds the runt only while sent data is not ACKed yet */
+  if (remaining) {
+    if (hold || (socket->nagle && unacked(socket))) {
+      if (cork_data(socket, data, remaining, hold) < 0) {
+        return -1;
+      }
+    } else if (sndq_write(socket, data, remaining) < 0) {
+      return -1;
+    }
+  }
+
+  return length;
+}
+
+
+int
+microtcp_flush (microtcp_sock_t *socket)
+{
+  if (!socket->cork_len && !socket->sndq) {
+    return 0;
+  }
+  if (!send_ready(socket)) {
+    return -1;
+  }
+  return send_pending(socket);
+}
+
+
+ssize_t
+microtcp_send_streams (microtcp_sock_t *socket, const microtcp_stream_t *streams,
+                       size_t count)
+{
+  stream_entry_t *entry;
+  uint32_t *base;
+  ssize_t ret;
+  size_t i, j, open;
+
+  if (!send_ready(socket)) {
+    return -1;
+  }
+  if (socket->duplex) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    /* a FIN rides on the last data segment of its stream */
+    if (streams[i].fin && !streams[i].length) {
+      errno = EINVAL;
+      return -1;
+    }
+    for (j = 0; j < i; j++) {
+      if (streams[j].id == streams[i].id) {
+        errno = EINVAL;
+        return -1;
+      }
+    }
+  }
+
+  /* every stream of the call may be open at the peer at once, together
+   * with those left open by earlier calls */
+  open = socket->tx_streams ? socket->tx_streams->count : 0;
+  for (i = 0; i < count; i++) {
+    open += !stream_known(socket->tx_streams, streams[i].id);
+  }
+  if (open > socket->peer_max_streams) {
+    errno = EMFILE;
+    return -1;
+  }
+
+  /* corked data precedes the streams */
+  if (microtcp_flush(socket) < 0) {
+    return -1;
+  }
+
+  base = slab_alloc(count * sizeof(uint32_t));
+  if (!base) {
+    perror("Allocate stream offsets");
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    entry = stream_lookup(&socket->tx_streams, streams[i].id, SIZE_MAX);
+    if (!entry) {
+      slab_free(base, count * sizeof(uint32_t));
+      return -1;
+    }
+    base[i] = entry->off;
+  }
+
+  ret = transmit_streams(socket, streams, count, base);
+  if (ret >= 0) {
+    for (i = 0; i < count; i++) {
+      if (streams[i].fin) {
+        stream_forget(socket->tx_streams, streams[i].id);
+      } else {
+        stream_lookup(&socket->tx_streams, streams[i].id, SIZE_MAX)->off = base[i] + streams[i].length;
+      }
+    }
+  }
+  slab_free(base, count * sizeof(uint32_t));
+  return ret;
+}
+
+
+ssize_t
+microtcp_stream_send (microtcp_sock_t *socket, uint32_t id, const void *buffer,
+                      size_t length, int fin)
+{
+  microtcp_stream_t stream;
+
+  stream.id = id;
+  stream.buffer = buffer;
+  stream.length = length;
+  stream.fin = fin;
+  return microtcp_send_streams(socket, &stream, 1);
+}
+
+
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count)
+{
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+  off_t map_off = offset - offset % page;  /* mmap wants page aligned offsets */
+  size_t lead = offset - map_off, done = 0, len;
+  uint8_t *map, *bounce;
+  ssize_t ret;
+
+  if (!send_ready(socket)) {
+    return -1;
+  }
+
+  /* like sendfile(2), a regular file is sent up to its end at most.
+   * mapping past the end would fault */
+  if (fstat(fd, &st) < 0) {
+    perror("Error in sendfile fstat");
+    return -1;
+  }
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size <= offset) {
+      return 0;
+    }
+    if (!count || count > (size_t)(st.st_size - offset)) {
+      count = st.st_size - offset;
+    }
+  } else if (!count) {
+    return 0;
+  }
+
+  /* corked data precedes the file in the stream */
+  if (microtcp_flush(socket) < 0) {
+    return -1;
+  }
+
+  map = mmap(NULL, lead + count, PROT_READ, MAP_SHARED, fd, map_off);
+  if (map != MAP_FAILED) {
+    posix_madvise(map, lead + count, POSIX_MADV_SEQUENTIAL | POSIX_MADV_WILLNEED);
+    ret = transmit(socket, map + lead, count);
+    munmap(map, lead + count);
+    return ret;
+  }
+
+  /* pipes and the like cannot be mapped, go through a large bounce buffer */
+  bounce = slab_alloc(SENDFILE_BOUNCE_LEN);
+  if (!bounce) {
+    perror("Allocate sendfile buffer");
+    return -1;
+  }
+  while (done < count) {
+    len = count - done < SENDFILE_BOUNCE_LEN ? count - done : SENDFILE_BOUNCE_LEN;
+    ret = pread(fd, bounce, len, offset + done);
+    if (ret < 0 && errno == ESPIPE) {
+      ret = read(fd, bounce, len);
+    }
+    if (ret <= 0) {
+      if (ret < 0) {
+        perror("Error in sendfile read");
+      }
+      break;
+    }
+    if (transmit(socket, bounce, ret) < 0) {
+      slab_free(bounce, SENDFILE_BOUNCE_LEN);
+      return -1;
+    }
+    done += ret;
+  }
+  slab_free(bounce, SENDFILE_BOUNCE_LEN);
+  return done;
+}
+
+
+int
+microtcp_set_cork (microtcp_sock_t *socket, int on)
+{
+  socket->cork = on ? 1 : 0;
+  return on ? 0 : microtcp_flush(socket);
+}
+
+
+int
+microtcp_set_nagle (microtcp_sock_t *socket, int on)
+{
+  socket->nagle = on ? 1 : 0;
+  return on ? 0 : microtcp_flush(socket);
+}
+
+
+int
+microtcp_set_duplex (microtcp_sock_t *socket, int on)
+{
+  struct duplex *d;
+  size_t slot_len = sizeof(microtcp_header_t) + socket->mss;
+
+  if (!on) {
+    duplex_free(socket);
+    return 0;
+  }
+  if (socket->state != ESTABLISHED || socket->message_mode) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (socket->duplex) {
+    return 0;
+  }
+  /* whatever is queued goes out first, the ACKs it waits for are read
+   * the old way */
+  if (microtcp_flush(socket) < 0) {
+    return -1;
+  }
+
+  d = slab_zalloc(sizeof(struct duplex));
+  if (!d) {
+    perror("Allocate full duplex state");
+    return -1;
+  }
+  d->q[DUPLEX_TX].slot_len = sizeof(microtcp_header_t);
+  d->q[DUPLEX_TX].cap = DUPLEX_QUEUE_LEN;
+  d->q[DUPLEX_RX].slot_len = slot_len;
+  d->q[DUPLEX_RX].cap = DUPLEX_QUEUE_BYTES / slot_len;
+  if (d->q[DUPLEX_RX].cap > DUPLEX_QUEUE_LEN) {
+    d->q[DUPLEX_RX].cap = DUPLEX_QUEUE_LEN;
+  } else if (d->q[DUPLEX_RX].cap < 8) {
+    d->q[DUPLEX_RX].cap = 8;
+  }
+  d->q[DUPLEX_TX].slots = slab_alloc(d->q[DUPLEX_TX].cap * sizeof(microtcp_header_t));
+  d->q[DUPLEX_RX].slots = slab_alloc(d->q[DUPLEX_RX].cap * slot_len);
+  d->scratch = slab_alloc(slot_len);
+  if (!d->q[DUPLEX_TX].slots || !d->q[DUPLEX_RX].slots || !d->scratch) {
+    perror("Allocate full duplex state");
+    duplex_release(d);
+    return -1;
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->wake, NULL);
+  d->ack = socket->ack_number;
+  d->window = window_encode(socket);
+  d->carried_ack = socket->seq_number;
+  d->seq = socket->seq_number;
+  d->srtt_us = socket->rtt_samples ? socket->srtt_us : 0;
+  socket->duplex = d;
+  return 0;
+}
+
+
+int
+microtcp_set_message_mode (microtcp_sock_t *socket, int on)
+{
+  if (on && socket->duplex) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* corked bytes belong to the byte stream, send them before */
+  if (on && microtcp_flush(socket) < 0) {
+    return -1;
+  }
+  socket->message_mode = on ? 1 : 0;
+  return 0;
+}
+
+
+ssize_t
+microtcp_send_msgs (microtcp_sock_t *socket, const struct iovec *msgs, size_t count)
+{
+  size_t i;
+
+  if (!send_ready(socket)) {
+    return -1;
+  }
+  if (!socket->message_mode) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (!msgs[i].iov_len) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  if (sndq_drain(socket) < 0) {
+    return -1;
+  }
+  return count ? transmit_msgs(socket, msgs, count) : 0;
+}
+
+
+
+
+/* the peer sent its FIN_ACK: ACK it and finish the termination from our side */
+static void
+passive_close (microtcp_sock_t *socket, uint32_t fin_seq)
+{
+  socket->ack_number = fin_seq + 1;
+  if (send_ack(socket) < 0) {
+    set_state(socket, INVALID);
+    return;
+  }
+  set_state(socket, CLOSING_BY_PEER);  /* set to this after sending ACK to FIN_ACK */
+  /* with full duplex the sending thread may still be in the socket, the
+   * application shuts down once both are done */
+  if (!socket->duplex) {
+    microtcp_shutdown(socket, SHUT_RDWR);
+  }
+}
+
+
+/* takes the next segment queued on an idle connection, a full one so a
+ * data segment is not cut to its header. data the application has not
+ * read yet stays queued for microtcp_recv() and fails the check with
+ * EBUSY: the connection is not idle and handing it out would put the
+ * next user out of step with the peer. returns 1 if header holds a
+ * valid segment, 0 if the datagram was not one */
+static int
+keepalive_segment (microtcp_sock_t *socket, uint8_t *buf, size_t size, int flags)
+{
+  microtcp_header_t *header = (microtcp_header_t *)buf;
+  ssize_t bytes_recvd;
+  uint32_t seq;
+  size_t len;
+  int valid = 0;
+
+  bytes_recvd = recvfrom(socket->sd, buf, size, flags | MSG_PEEK, NULL, NULL);
+  if (bytes_recvd < 0) {
+    return -1;
+  }
+  if (bytes_recvd >= (ssize_t)sizeof(microtcp_header_t)) {
+    len = bytes_recvd - sizeof(microtcp_header_t);
+    valid = segment_verify(header, buf + sizeof(microtcp_header_t), len);
+    seq = ntohl(header->seq_number);
+    if (valid && len && reasm_seq_before(socket->ack_number, seq + len)) {
+      errno = EBUSY;
+      return -1;
+    }
+  }
+
+  /* a stale ACK, a FIN, a duplicate of data already taken or garbage */
+  recvfrom(socket->sd, buf, 0, MSG_DONTWAIT, NULL, NULL);
+  socket->packets_received++;
+  socket->bytes_received += bytes_recvd;
+  return valid;
+}
+
+
+int
+microtcp_keepalive (microtcp_sock_t *socket, int probe)
+{
+  size_t size = sizeof(microtcp_header_t) + socket->mss;
+  microtcp_header_t *header;
+  uint64_t deadline;
+  uint8_t *buf;
+  int ret;
+
+  if (socket->state != ESTABLISHED || socket->duplex || send_pending(socket) < 0) {
+    return -1;
+  }
+  if (socket->buf_fill_level || socket->reasm.count) {
+    errno = EBUSY;
+    return -1;
+  }
 
+  buf = slab_alloc(size);
+  if (!buf) {
+    return -1;
+  }
+  header = (microtcp_header_t *)buf;
 
+  /* whatever is queued: stale ACKs of the last transfer, or the peer's
+   * FIN_ACK if it closed while we were idle */
+  while ((ret = keepalive_segment(socket, buf, size, MSG_DONTWAIT)) >= 0) {
+    if (ret && ntohs(header->control) == FIN_ACK) {
+      goto closed;
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    goto fail;
+  }
+  if (!probe) {
+    slab_free(buf, size);
+    return 0;
+  }
+
+  /* the probe is an empty segment one below the next sequence number,
+   * it holds no new data and the peer answers it with an ACK */
+  if (send_segment(socket, socket->seq_number - 1, ACK, NULL, 0) < 0) {
+    goto fail;
+  }
+  deadline = now_us() + socket->opt.ack_timeout_us;
+  while (now_us() < deadline) {
+    ret = keepalive_segment(socket, buf, size, 0);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      goto fail;
+    }
+    if (ret && ntohs(header->control) == FIN_ACK) {
+      goto closed;
+    }
+    if (ret && (ntohs(header->control) & ACK)
+        && ntohl(header->ack_number) == (uint32_t)socket->seq_number) {
+      slab_free(buf, size);
+      return 0;
+    }
+  }
+  slab_free(buf, size);
+  errno = ETIMEDOUT;
+  return -1;
+
+closed:
+  passive_close(socket, ntohl(header->seq_number));
+  errno = ECONNRESET;
+fail:
+  slab_free(buf, size);
+  return -1;
+}
 
-/* ------> For the 2nd phase <------ */
 
+/* dynamic right-sizing of the receive buffer, after in-order data moved
+ * ack_number. once per RTT the buffer grows to twice what the
+ * application took in that RTT, so the window stays ahead of the
+ * bandwidth-delay product as long as the application keeps up, and a
+ * connection that went idle starts over from the default. the RTT is
+ * the sender side srtt if this end sends too, otherwise the handshake
+ * RTT or the time one full window took to arrive, whichever is less */
+static void
+rcvbuf_tune (microtcp_sock_t *socket)
+{
+  uint64_t now = now_us(), sample, rtt;
+  size_t copied, want, limit;
+
+  if (socket->last_rx_us && now - socket->last_rx_us > MICROTCP_RCVBUF_IDLE_US
+      && !socket->rcvbuf_locked) {
+    socket->rcvbuf_len = socket->opt.rcvbuf;
+    socket->rcv_space = 0;
+    socket->rcv_rtt_stamp = 0;
+    socket->rcv_space_stamp = 0;
+  }
+  socket->last_rx_us = now;
+  if (socket->rcvbuf_locked) {
+    return;
+  }
 
-/* determines how many bytes to send based on the current congestion window */
-int get_max_bytes(int remaining_bytes, int cwnd, int curr_window) {
-  int size = 0;
+  /* a window takes longer than an RTT unless the sender is window
+   * limited, so only the smallest sample counts */
+  if (socket->rcv_rtt_stamp && !reasm_seq_before(socket->ack_number, socket->rcv_rtt_seq)) {
+    sample = now - socket->rcv_rtt_stamp;
+    if (!socket->rcv_rtt_us || (sample && sample < socket->rcv_rtt_us)) {
+      socket->rcv_rtt_us = sample ? sample : 1;
+    }
+    socket->rcv_rtt_stamp = 0;
+  }
+  if (!socket->rcv_rtt_stamp) {
+    socket->rcv_rtt_seq = socket->ack_number + socket->rcvbuf_len;
+    socket->rcv_rtt_stamp = now;
+  }
 
-  if (remaining_bytes < cwnd && remaining_bytes < curr_window) {
-    size = remaining_bytes;
-  } else if (cwnd < curr_window) {
-    size = cwnd;
+  if (!socket->rcv_space_stamp) {
+    socket->rcv_space_seq = socket->ack_number;
+    socket->rcv_space_stamp = now;
+    return;
+  }
+  if (socket->duplex) {
+    pthread_mutex_lock(&socket->duplex->lock);
+    rtt = socket->duplex->srtt_us;
+    pthread_mutex_unlock(&socket->duplex->lock);
   } else {
-    size = curr_window;
+    rtt = socket->rtt_samples ? socket->srtt_us : 0;
+  }
+  if (!rtt) {
+    rtt = socket->rcv_rtt_us;
+  }
+  if (!rtt || now - socket->rcv_space_stamp < rtt) {
+    return;
   }
 
-  return size;
+  copied = (uint32_t)(socket->ack_number - socket->rcv_space_seq);
+  if (copied > socket->rcv_space) {
+    socket->rcv_space = copied;
+    limit = rcvbuf_ceiling(socket);
+    if (limit > (size_t)0xffff << socket->rcv_wscale) {
+      limit = (size_t)0xffff << socket->rcv_wscale;
+    }
+    want = 2 * copied < limit ? 2 * copied : limit;
+    if (want > socket->rcvbuf_len) {
+      socket->rcvbuf_len = want;
+      apply_rcvbuf(socket, want);
+    }
+  }
+  socket->rcv_space_seq = socket->ack_number;
+  socket->rcv_space_stamp = now;
 }
 
 
-/* for timeout case */
-int min(int MSS, int SSTHRESH) {
-  if (MSS < SSTHRESH)
-    return MSS;
-  else
-    return SSTHRESH;
+/* the application took bytes out of recvbuf. if the window we
+ * advertised was too small for the sender to use, it hears about the
+ * new one right away instead of at its next zero window probe */
+static void
+window_update (microtcp_sock_t *socket)
+{
+  size_t step = socket->rcvbuf_len / 2 < socket->mss ? socket->rcvbuf_len / 2 : socket->mss;
+  uint32_t win = 0;
+
+  if (reasm_seq_before(socket->ack_number, socket->rcv_edge)) {
+    win = (uint32_t)(socket->rcv_edge - socket->ack_number) >> socket->rcv_wscale << socket->rcv_wscale;
+  }
+  if (win < step && window_advance(socket)) {
+    socket->window_updates++;
+    send_ack(socket);
+  }
 }
 
 
-ssize_t
-microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
-               int flags)
+/* receives segments until new in-order data is available. dst corresponds
+ * to sequence number ack_number and can take room bytes. while there are
+ * no holes the payload is scattered straight into dst, otherwise it lands
+ * in recvbuf and is copied to its offset. in-order bytes that do not fit
+ * are kept in recvbuf for the next call.
+ * returns the in-order bytes placed in dst, 0 on FIN or -1 on error
+ */
+static ssize_t
+receive_into (microtcp_sock_t *socket, uint8_t *dst, size_t room)
 {
-  int i, chunks = 0, packet_size = 0, bytes_sent = 0, bytes_received = 0, bytes_lost = 0, prev_ack = 0, dup_acks = 0;
-  size_t remaining_bytes = length, data_sent = 0;
-  socklen_t address_len = socket->address_len;  /* get the address for the server */
-  
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint8_t *land;
+  ssize_t bytes_recvd;
+  size_t len, off, delivered = 0;
+  uint32_t seq, next;
+
+  while (!delivered) {
+    land = (socket->reasm.count || room < socket->mss) ? socket->recvbuf : dst;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(microtcp_header_t);
+    iov[1].iov_base = land;
+    iov[1].iov_len  = socket->mss;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+
+    bytes_recvd = seg_recv(socket, DUPLEX_RX, &msg, 0, NULL);
+    if (bytes_recvd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;  /* just the ACK timeout, keep waiting */
+      }
+      if (errno != EINTR) {
+        set_state(socket, INVALID);
+        perror("Error receiving segment");
+      }
+      return -1;
+    }
 
-  struct sockaddr_in address = socket->address;
-  /* buffer has size of the header + the data to be sent/received */
-  void *sending_buffer   = malloc(sizeof(microtcp_header_t) + MICROTCP_MSS);
-  void *receiving_buffer = malloc(sizeof(microtcp_header_t) + MICROTCP_MSS);
+    if (bytes_recvd < (ssize_t)sizeof(microtcp_header_t) || (msg.msg_flags & MSG_TRUNC)) {
+      continue;
+    }
+    len = bytes_recvd - sizeof(microtcp_header_t);
+    if (!segment_verify(&header, land, len)) {
+      continue;  /* corrupted, the sender will retransmit */
+    }
+    if (socket->duplex && len) {
+      duplex_carry_ack(socket, &header);
+    }
 
-  microtcp_header_t sendToServer, receiveFromServer;
-  memset(&sendToServer,0,sizeof(microtcp_header_t));
+    seq = ntohl(header.seq_number);
+    TRACE_EVENT(socket, TRACE_RX, seq, socket->ack_number, len);
+    if (ntohs(header.control) == FIN_ACK) {
+      passive_close(socket, seq);
+      return 0;
+    }
 
+    off = (uint32_t)(seq - socket->ack_number);
+    if (len && off < room) {
+      if (!off) {
+        if (len > room) {  /* only in the recvbuf path, keep the rest */
+          memcpy(dst, land, room);
+          memmove(socket->recvbuf, land + room, len - room);
+          socket->buf_fill_level = len - room;
+          delivered = room;
+        } else {
+          if (land != dst) {
+            memcpy(dst, land, len);
+          }
+          delivered = len;
+        }
+        socket->ack_number += len;
 
+        /* pull in whatever was already reassembled behind it */
+        next = reasm_deliver(&socket->reasm, socket->ack_number);
+        delivered += (uint32_t)(next - socket->ack_number);
+        socket->ack_number = next;
+        rcvbuf_tune(socket);
+      } else {
+        if (len > room - off) {
+          len = room - off;
+        }
+        if (!reasm_insert(&socket->reasm, seq, seq + len)) {
+          memmove(dst + off, land, len);
+        }
+      }
+    }
 
-  /* keep sending until you meet the specified length */
-  while (data_sent < length) {
-    packet_size = get_max_bytes(remaining_bytes, socket->cwnd, socket->curr_win_size);
-    chunks = packet_size / MICROTCP_MSS;   /* how many of those to send based on the bytes */
-    
+    /* ACK every segment, duplicates tell the sender about the holes */
+    if (send_ack(socket) < 0) {
+      return -1;
+    }
+  }
 
-    /* start sending the chunks to server.... */
-    for (i = 0; i < chunks; i++) {
-      memset(sending_buffer,0,sizeof(sizeof(microtcp_header_t) + MICROTCP_MSS));  /* initialize buffer before setup */
-      ((microtcp_header_t *)sending_buffer)->data_len   = htonl(MICROTCP_MSS);
-      ((microtcp_header_t *)sending_buffer)->seq_number = htonl(socket->seq_number + i * MICROTCP_MSS);  /* pair seq with the corresponding chunk */
-      ((microtcp_header_t *)sending_buffer)->checksum = htonl(crc32(sending_buffer, sizeof(microtcp_header_t) + MICROTCP_MSS));  /* provide the checksum */
+  return delivered;
+}
 
-      /* copy the contents of the incoming buffer + data sent (for ACK later) to our custom buffer that will be sent over up to the MSS */
-      memcpy(sending_buffer+sizeof(microtcp_header_t), buffer+data_sent, MICROTCP_MSS);
-      
 
-      bytes_sent = sendto(socket->sd, sending_buffer, sizeof(microtcp_header_t)+MICROTCP_MSS,0, (struct sockaddr *)&address, address_len);
-      socket->packets_send++;
-      socket->bytes_send += bytes_sent;
+/* out of order bytes are placed in the caller's buffer, which is gone
+ * once the call returns. the bytes of the ranges still ahead of
+ * ack_number move to reasm_buf, dst being where ack_number would have
+ * gone. if they cannot be kept the ranges are forgotten and the sender
+ * retransmits them */
+static void
+reasm_stash (microtcp_sock_t *socket, const uint8_t *dst)
+{
+  const reasm_t *r = &socket->reasm;
+  size_t len, off;
+  uint32_t i;
+
+  if (!r->count) {
+    return;
+  }
+  len = (uint32_t)(r->range[r->count - 1].end - socket->ack_number);
+  socket->reasm_buf = slab_alloc(len);
+  if (!socket->reasm_buf) {
+    reasm_clear(&socket->reasm);
+    return;
+  }
+  socket->reasm_buf_len = len;
+  for (i = 0; i < r->count; i++) {
+    off = (uint32_t)(r->range[i].start - socket->ack_number);
+    memcpy(socket->reasm_buf + off, dst + off, r->range[i].end - r->range[i].start);
+  }
+}
 
-      data_sent += MICROTCP_MSS;  /* that's the max length to be sent with each packet so increase by that */
-      remaining_bytes = length - data_sent;  /* calc how much left */
-    }
 
+/* puts the stashed ranges back in the buffer of the next call, keeping
+ * only what fits in its room bytes */
+static void
+reasm_restore (microtcp_sock_t *socket, uint8_t *dst, size_t room)
+{
+  reasm_t *r = &socket->reasm;
+  size_t off;
+  uint32_t i;
 
-    /* 1. check for any leftovers of the remaining that didn't fit to last segment */
-    if (packet_size % MICROTCP_MSS) {
-      memset(sending_buffer, 0, sizeof(microtcp_header_t) + MICROTCP_MSS);  /* clear the buffer before sending the final packet */
-      ((microtcp_header_t*)sending_buffer)->data_len   = htonl(packet_size % MICROTCP_MSS);  /* whatever is left to be sent */
-      ((microtcp_header_t*)sending_buffer)->seq_number = htonl(socket->seq_number + i * MICROTCP_MSS);
-      ((microtcp_header_t*)sending_buffer)->checksum   = htonl(crc32(sending_buffer, sizeof(microtcp_header_t) + packet_size % MICROTCP_MSS));
+  if (!socket->reasm_buf) {
+    return;
+  }
+  if (room < socket->reasm_buf_len) {
+    reasm_trim(r, socket->ack_number + room);
+  }
+  for (i = 0; i < r->count; i++) {
+    off = (uint32_t)(r->range[i].start - socket->ack_number);
+    memcpy(dst + off, socket->reasm_buf + off, r->range[i].end - r->range[i].start);
+  }
+  slab_free(socket->reasm_buf, socket->reasm_buf_len);
+  socket->reasm_buf = NULL;
+  socket->reasm_buf_len = 0;
+}
 
-      memcpy(sending_buffer+sizeof(microtcp_header_t), buffer+data_sent, MICROTCP_MSS);
-      bytes_sent = sendto(socket->sd,sending_buffer,sizeof(microtcp_header_t) + packet_size % MICROTCP_MSS,0,(struct sockaddr *)&address,address_len);
-      socket->packets_send++;
-      socket->bytes_send += bytes_sent;
 
-      data_sent += packet_size % MICROTCP_MSS;
-      chunks++;  /* this is the final chunk to be sent [increase num of chunks] */
-    }
-
-
-    /* 2. check for any dup acks [retransmissions here] */
-    for (i = 0; i < chunks; i++) {   /* receive the acks from the server */
-      bytes_received = recvfrom(socket->sd, &receiveFromServer, sizeof(microtcp_header_t), 0, &(socket->address), &(socket->address_len));
-      if (bytes_received < 0) {      /* we have a timeout and need to retransmit*/
-        socket->ssthresh = socket->cwnd / 2;
-        socket->cwnd = min(MICROTCP_MSS, socket->ssthresh);
-
-        bytes_lost = socket->seq_number - ntohl(receiveFromServer.ack_number);  /* because seq-ack differ in num of bytes to be sent */
-        socket->seq_number    = ntohl(receiveFromServer.ack_number);
-        socket->curr_win_size = ntohl(receiveFromServer.window);
-        data_sent -= bytes_lost;
-
-        if (ntohs(receiveFromServer.control) != ACK) {
-          continue;
-        } else if (ntohl(receiveFromServer.ack_number) > socket->seq_number) {  /* ack if bigger than seq so we proceed */
-          socket->seq_number = ntohl(receiveFromServer.ack_number);
-          socket->curr_win_size = ntohl(receiveFromServer.window);
-          prev_ack = ntohl(receiveFromServer.ack_number);  /* keep track of it to check against the next two incoming acks */
-          dup_acks = 0;
-        } else if (prev_ack == ntohl(receiveFromServer.ack_number)) {
-          dup_acks++;  /* found a dup ack!! */
-        } else if (dup_acks == 3) {  /* fast retransmit activated */
-          bytes_lost = socket->seq_number - ntohl(receiveFromServer.ack_number);
-          socket->seq_number    = ntohl(receiveFromServer.ack_number);  /* re-initialize with server's ack */
-          socket->curr_win_size = ntohl(receiveFromServer.window);
-          data_sent -= bytes_lost;
+/* receives the next message in order. the payload is scattered straight
+ * into dst while a whole MSS still fits, the rest goes through recvbuf
+ * and whatever does not fit in room is dropped. unless wait is set it
+ * gives up with EAGAIN if no segment of a new message is queued.
+ * returns the length of the message, 0 on FIN or -1 on error
+ */
+static ssize_t
+receive_msg (microtcp_sock_t *socket, uint8_t *dst, size_t room, int wait)
+{
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint8_t *land;
+  ssize_t bytes_recvd;
+  size_t len, got = 0;
+  int started = 0, last;
+
+  for (;;) {
+    land = (got < room && room - got >= socket->mss) ? dst + got : socket->recvbuf;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(microtcp_header_t);
+    iov[1].iov_base = land;
+    iov[1].iov_len  = socket->mss;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+
+    bytes_recvd = recvmsg(socket->sd, &msg, (wait || started) ? 0 : MSG_DONTWAIT);
+    if (bytes_recvd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!wait && !started) {
+          return -1;
         }
+        continue;  /* just the ACK timeout, keep waiting */
+      }
+      if (errno != EINTR) {
+        socket->state = INVALID;
+        perror("Error receiving segment");
       }
+      return -1;
+    }
+    socket->packets_received++;
+    socket->bytes_received += bytes_recvd;
+
+    if (bytes_recvd < (ssize_t)sizeof(microtcp_header_t) || (msg.msg_flags & MSG_TRUNC)) {
+      continue;
+    }
+    len = bytes_recvd - sizeof(microtcp_header_t);
+    if (!segment_verify(&header, land, len)) {
+      continue;  /* corrupted, the sender will retransmit */
+    }
 
+    TRACE_EVENT(socket, TRACE_RX, ntohl(header.seq_number), socket->ack_number, len);
+    if (ntohs(header.control) == FIN_ACK) {
+      passive_close(socket, ntohl(header.seq_number));
+      return 0;
+    }
+    if (!len) {
+      continue;  /* a window probe or a stale ACK */
+    }
 
-      /* 3. Slow Start - Congestion Avoidance */
-      if (ntohl(receiveFromServer.ack_number) > socket->seq_number) {  /* correct ACK -> slow start */
-          socket->cwnd += MICROTCP_MSS;
-      } else if (socket->cwnd > socket->ssthresh){ /* Congestion Avoidance */
-          socket->ssthresh = socket->cwnd / 2;
-          socket->cwnd = (socket->cwnd / 2) + 1;
+    /* only in order segments are taken, anything else gets a duplicate
+     * ACK and comes again with go-back-N */
+    last = 0;
+    if (ntohl(header.seq_number) == socket->ack_number) {
+      if (land != dst + got && got < room) {
+        memcpy(dst + got, land, len < room - got ? len : room - got);
       }
+      got += len;
+      started = 1;
+      last = ntohl(header.future_use0) & OPT_MSG_END;
+      socket->ack_number += len;
+      rcvbuf_tune(socket);
+    }
+    if (send_ack(socket) < 0) {
+      return -1;
+    }
+    if (last) {
+      return got;
+    }
+  }
+}
+
+
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+  ssize_t received;
 
+  /* with full duplex a closed peer leaves the connection open until the
+   * application shuts it down */
+  if (socket->state == CLOSED || (socket->duplex && socket->state == CLOSING_BY_PEER)) {
+    return 0;
+  }
+  if (socket->state != ESTABLISHED) {
+    perror("Error : Connection not established");
+    return -1;
+  }
+  /* half duplex: what we sent is ACKed before the peer's data comes */
+  if (!socket->duplex && send_pending(socket) < 0) {
+    return -1;
+  }
 
-      /* 4. Flow Control */ 
-       if (!socket->curr_win_size) {  /* send empty payload to get back to normal */
-        sendto(socket->sd, sending_buffer, sizeof(microtcp_header_t), 0, (struct sockaddr *)&address, address_len);
-        chunks++;
-        usleep(rand()%MICROTCP_ACK_TIMEOUT_US);
-       }
+  if (socket->message_mode && !socket->buf_fill_level) {
+    received = receive_msg(socket, buffer, length, 1);
+    if (received > (ssize_t)length && !(flags & MICROTCP_MSG_TRUNC)) {
+      received = length;
     }
+    return received;
+  }
 
+  /* leftovers of a segment that did not fit at the previous call */
+  if (socket->buf_fill_level) {
+    received = socket->buf_fill_level < length ? socket->buf_fill_level : length;
+    memcpy(buffer, socket->recvbuf, received);
+    memmove(socket->recvbuf, socket->recvbuf + received, socket->buf_fill_level - received);
+    socket->buf_fill_level -= received;
+    window_update(socket);
+    return received;
   }
 
-  return data_sent;
+  reasm_restore(socket, buffer, length);
+  received = receive_into(socket, buffer, length);
+  reasm_stash(socket, (uint8_t *)buffer + (received > 0 ? received : 0));
+  return received;
+}
+
+
+/* ACKs a segment of a stream, granting the stream what is left of its
+ * credit besides the bytes waiting in recvbuf */
+static int
+stream_ack (microtcp_sock_t *socket, uint32_t id)
+{
+  uint32_t held = socket->rx_stream == id ? socket->buf_fill_level : 0;
+
+  return send_segment_opt(socket, socket->seq_number, ACK, OPT_STREAM, id,
+                          held < MICROTCP_STREAM_WIN ? MICROTCP_STREAM_WIN - held : 0,
+                          NULL, 0) < 0 ? -1 : 0;
 }
 
 
+/* hands leftover bytes of the last segment to the caller */
+static ssize_t
+stream_leftover (microtcp_sock_t *socket, uint32_t *id, uint8_t *buffer,
+                 size_t length, int *fin)
+{
+  size_t n = socket->buf_fill_level < length ? socket->buf_fill_level : length;
+
+  memcpy(buffer, socket->recvbuf, n);
+  memmove(socket->recvbuf, socket->recvbuf + n, socket->buf_fill_level - n);
+  socket->buf_fill_level -= n;
+  window_update(socket);
+  *id = socket->rx_stream;
+  *fin = !socket->buf_fill_level && socket->rx_stream_fin;
+  return n;
+}
 
 
 ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+microtcp_stream_recv (microtcp_sock_t *socket, uint32_t *id, void *buffer,
+                      size_t length, int *fin)
 {
-  uint32_t seq;
-  microtcp_header_t receiveFromServer, sendToClient;
-  size_t remaining_bytes = length, bytes_recvd = 0, bytes_sent = 0, total_bytes = 0;
-  struct sockaddr_in address = socket->address; /* get the address */
-  socklen_t address_len = socket->address_len;
-  uint8_t *buff = malloc(sizeof(microtcp_header_t) + MICROTCP_MSS);
-  uint8_t *socket_rcv_buffer = socket->recvbuf;
+  microtcp_header_t header;
+  stream_entry_t *entry = NULL;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t bytes_recvd;
+  size_t len;
+  uint32_t seq, sid, soff, opt;
+
+  *fin = 0;
+  if (socket->state == CLOSED) {
+    return 0;
+  }
+  if (socket->state != ESTABLISHED) {
+    perror("Error : Connection not established");
+    return -1;
+  }
+  if (socket->duplex) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (send_pending(socket) < 0) {
+    return -1;
+  }
+  if (socket->buf_fill_level) {
+    return stream_leftover(socket, id, buffer, length, fin);
+  }
+
+  for (;;) {
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(microtcp_header_t);
+    iov[1].iov_base = socket->recvbuf;
+    iov[1].iov_len  = socket->mss;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+
+    bytes_recvd = recvmsg(socket->sd, &msg, 0);
+    if (bytes_recvd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;  /* just the ACK timeout, keep waiting */
+      }
+      if (errno != EINTR) {
+        socket->state = INVALID;
+        perror("Error receiving segment");
+      }
+      return -1;
+    }
+    socket->packets_received++;
+    socket->bytes_received += bytes_recvd;
+
+    if (bytes_recvd < (ssize_t)sizeof(microtcp_header_t) || (msg.msg_flags & MSG_TRUNC)) {
+      continue;
+    }
+    len = bytes_recvd - sizeof(microtcp_header_t);
+    if (!segment_verify(&header, socket->recvbuf, len)) {
+      continue;  /* corrupted, the sender will retransmit */
+    }
+
+    seq = ntohl(header.seq_number);
+    TRACE_EVENT(socket, TRACE_RX, seq, socket->ack_number, len);
+    if (ntohs(header.control) == FIN_ACK) {
+      passive_close(socket, seq);
+      return 0;
+    }
+    if (!len) {
+      continue;  /* a window probe or a stale ACK */
+    }
+
+    opt = ntohl(header.future_use0);
+    sid = ntohl(header.future_use1);
+    soff = ntohl(header.future_use2);
+
+    /* already here: ACK again in case our ACK got lost */
+    if (reasm_seq_before(seq, socket->ack_number)
+        || reasm_contains(&socket->reasm, seq, seq + len)) {
+      if (stream_ack(socket, sid) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    /* a new stream beyond MICROTCP_SO_MAX_STREAMS waits, the sender
+     * goes back for it once others have finished */
+    if (opt & OPT_STREAM) {
+      entry = stream_lookup(&socket->rx_streams, sid, socket->opt.max_streams);
+      if (!entry && errno == ENOBUFS) {
+        if (stream_ack(socket, sid) < 0) {
+          return -1;
+        }
+        continue;
+      }
+      if (!entry) {
+        return -1;
+      }
+    } else {
+      sid = 0;  /* plain data, only taken in connection order */
+    }
+
+    /* out of order within its stream, or beyond what we can track: the
+     * duplicate ACK makes the sender go back for it */
+    if ((entry ? soff != entry->off : seq != socket->ack_number)
+        || (seq != socket->ack_number && reasm_insert(&socket->reasm, seq, seq + len))) {
+      if (stream_ack(socket, sid) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    if (seq == socket->ack_number) {
+      socket->ack_number = reasm_deliver(&socket->reasm, seq + len);
+      rcvbuf_tune(socket);
+    }
 
+    socket->buf_fill_level = len;
+    socket->rx_stream = sid;
+    socket->rx_stream_fin = entry && (opt & OPT_STREAM_FIN);
+    if (entry) {
+      entry->off += len;
+      if (socket->rx_stream_fin) {
+        stream_forget(socket->rx_streams, sid);
+      }
+    }
+    if (stream_ack(socket, sid) < 0) {
+      return -1;
+    }
+    return stream_leftover(socket, id, buffer, length, fin);
+  }
+}
 
 
+ssize_t
+microtcp_recv_msgs (microtcp_sock_t *socket, microtcp_msg_t *msgs, size_t count)
+{
+  ssize_t ret;
+  size_t i;
 
+  if (socket->state == CLOSED) {
+    return 0;
+  }
   if (socket->state != ESTABLISHED) {
     perror("Error : Connection not established");
     return -1;
   }
+  if (!socket->message_mode) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (sndq_drain(socket) < 0) {
+    return -1;
+  }
 
+  for (i = 0; i < count; i++) {
+    ret = receive_msg(socket, msgs[i].buffer, msgs[i].length, !i);
+    if (ret <= 0) {
+      /* what we have so far is still handed over */
+      if (i || !ret) {
+        break;
+      }
+      return -1;
+    }
+    msgs[i].msg_len = ret;
+  }
+  return i;
+}
 
-  while (remaining_bytes > 0) {
-    memset(buff, 0, sizeof(microtcp_header_t) + MICROTCP_MSS);  /* clean the buffer first */
-    bytes_recvd = recvfrom(socket->sd,buff,sizeof(microtcp_header_t) + MICROTCP_MSS,0,(struct sockaddr *)&address,&address_len);
 
-    if (bytes_recvd < 0) {
-      socket->state = INVALID;
-      perror("Error receiving bytes from client");
-      return -1;
-    } else {
-      socket->packets_received++;
-      socket->bytes_received += bytes_recvd;
-      total_bytes += bytes_recvd;
+/* receives into a file that cannot be mapped, writing large batches */
+static ssize_t
+recvfile_batched (microtcp_sock_t *socket, int fd, size_t count)
+{
+  uint8_t *batch;
+  size_t done = 0, fill, want;
+  ssize_t ret = 0;
+
+  batch = slab_alloc(RECVFILE_BATCH_LEN);
+  if (!batch) {
+    perror("Allocate recvfile buffer");
+    return -1;
+  }
+
+  while (ret >= 0 && (!count || done < count)) {
+    want = RECVFILE_BATCH_LEN;
+    if (count && count - done < want) {
+      want = count - done;
     }
+    reasm_restore(socket, batch, want);
+    for (fill = 0; fill < want; fill += ret) {
+      ret = receive_into(socket, batch + fill, want - fill);
+      if (ret <= 0) {
+        break;
+      }
+    }
+    reasm_stash(socket, batch + fill);
+    if (fill && write(fd, batch, fill) != (ssize_t)fill) {
+      perror("Error writing received data");
+      ret = -1;
+    }
+    done += fill;
+    if (!ret) {
+      break;  /* peer closed the connection */
+    }
+  }
 
+  slab_free(batch, RECVFILE_BATCH_LEN);
+  return ret < 0 ? -1 : (ssize_t)done;
+}
 
-    /* check for a shutdown (after transmission has been completed) */
-    if(ntohs(((microtcp_header_t*)buff)->control) == FIN_ACK) {
-      /* we received a FIN_ACK, answer with ACK */
-      seq = ((microtcp_header_t*)buff)->seq_number;
-      sendToClient.ack_number = htonl(ntohl(seq));
-      sendToClient.control = htons(ACK);
-      bytes_sent = sendto(socket->sd,(const void *)&sendToClient,sizeof(microtcp_header_t),0,(struct sockaddr *)&address,address_len);
 
-      if (bytes_sent < 0) {
-        socket->state = INVALID;
-        perror("Error sending ACK to FIN_ACK");
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, size_t count)
+{
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t done = 0, win, lead, fill;
+  off_t start, pos, map_off, orig_size;
+  uint8_t *map;
+  ssize_t ret = 1;
+
+  if (socket->duplex && socket->state == CLOSING_BY_PEER) {
+    return 0;
+  }
+  if (socket->state != ESTABLISHED) {
+    perror("Error : Connection not established");
+    return -1;
+  }
+  if (!socket->duplex && send_pending(socket) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return recvfile_batched(socket, fd, count);
+  }
+  /* the data goes at the file position, like write(2) would put it */
+  start = lseek(fd, 0, SEEK_CUR);
+  if (start < 0) {
+    perror("Error in recvfile lseek");
+    return -1;
+  }
+  orig_size = st.st_size;
+
+  /* a segment that did not fit a previous microtcp_recv() goes first */
+  if (socket->buf_fill_level) {
+    fill = socket->buf_fill_level;
+    if (count && fill > count) {
+      fill = count;
+    }
+    if (pwrite(fd, socket->recvbuf, fill, start) != (ssize_t)fill) {
+      perror("Error writing received data");
+      return -1;
+    }
+    memmove(socket->recvbuf, socket->recvbuf + fill, socket->buf_fill_level - fill);
+    socket->buf_fill_level -= fill;
+    window_update(socket);
+    done = fill;
+  }
+
+  /* map the file one extent at a time (the whole of it if the size is
+   * known) and let the receive path place the payload in the mapping */
+  while (ret > 0 && (!count || done < count)) {
+    win = count ? count - done : RECVFILE_EXTENT;
+    pos = start + done;
+    map_off = pos - pos % page;
+    lead = pos - map_off;
+    /* only grows the file, what lies past the data is left alone */
+    if (pos + (off_t)win > st.st_size) {
+      if (ftruncate(fd, pos + win) < 0) {
+        perror("Error preallocating file");
         return -1;
-      } else {
-        socket->packets_send++;
-        socket->bytes_send += bytes_sent;
       }
-      socket->state = CLOSING_BY_PEER;  /* set to this after sending ACK to FIN_ACK */
+      st.st_size = pos + win;
+    }
+    map = mmap(NULL, lead + win, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_off);
+    if (map == MAP_FAILED) {
+      perror("Error mapping file");
+      return -1;
+    }
+    posix_madvise(map, lead + win, POSIX_MADV_SEQUENTIAL);
 
-      /* check for a shutdown from server side */
-      if (microtcp_shutdown(socket,0) == 0) {
-        socket->state = CLOSED;  /* all done, set it to closed */
+    reasm_restore(socket, map + lead, win);
+    for (fill = 0; fill < win; fill += ret) {
+      ret = receive_into(socket, map + lead + fill, win - fill);
+      if (ret <= 0) {
+        break;
       }
+    }
+    reasm_stash(socket, map + lead + fill);
+    munmap(map, lead + win);
+    done += fill;
+  }
+
+  /* drop the preallocated tail the peer never sent, the file keeps its
+   * own bytes past the data */
+  pos = start + done;
+  if (pos < st.st_size && ftruncate(fd, orig_size > pos ? orig_size : pos) < 0) {
+    perror("Error truncating file");
+    return -1;
+  }
+  if (lseek(fd, pos, SEEK_SET) < 0) {
+    perror("Error in recvfile lseek");
+    return -1;
+  }
+  return ret < 0 ? -1 : (ssize_t)done;
+}
 
+
+/* what the allocator handed out for the connection, by size class */
+static size_t
+connection_memory (const microtcp_sock_t *socket)
+{
+  const struct stream_table *tables[2] = { socket->tx_streams, socket->rx_streams };
+  const struct duplex *d = socket->duplex;
+  size_t bytes = 0;
+  int i;
+
+  if (socket->recvbuf) {
+    bytes += slab_size(recvbuf_len(socket));
+  }
+  if (socket->rtt_hist) {
+    bytes += slab_size(sizeof(histogram_t))
+        + socket->rtt_hist->buckets * sizeof(uint64_t);
+  }
+  if (socket->reasm_buf) {
+    bytes += slab_size(socket->reasm_buf_len);
+  }
+  if (socket->cork_buf) {
+    bytes += slab_size(socket->mss);
+  }
+  if (socket->sndq) {
+    bytes += slab_size(sizeof(struct send_queue));
+    bytes += socket->sndq->buf ? slab_size(socket->sndq->cap) : 0;
+  }
+  for (i = 0; i < 2; i++) {
+    if (tables[i]) {
+      bytes += slab_size(sizeof(struct stream_table));
+      bytes += tables[i]->entry ? slab_size(tables[i]->cap * sizeof(stream_entry_t)) : 0;
     }
   }
+  if (d) {
+    bytes += slab_size(sizeof(struct duplex))
+        + slab_size(d->q[DUPLEX_TX].cap * d->q[DUPLEX_TX].slot_len)
+        + slab_size(d->q[DUPLEX_RX].cap * d->q[DUPLEX_RX].slot_len)
+        + slab_size(d->q[DUPLEX_RX].slot_len);
+  }
+  return bytes;
+}
+
+
+int
+microtcp_get_info (const microtcp_sock_t *socket, microtcp_info_t *info)
+{
+  if (!socket || !info) {
+    return -1;
+  }
 
-  free(buff);
-  return total_bytes;
+  memset(info, 0, sizeof(microtcp_info_t));
+  info->state = socket->state;
+  info->cwnd = socket->cwnd;
+  info->ssthresh = socket->ssthresh;
+  info->peer_window = socket->curr_win_size;
+  info->bytes_in_flight = socket->bytes_in_flight;
+
+  info->srtt_us = socket->srtt_us;
+  info->rttvar_us = socket->rttvar_us;
+  info->min_rtt_us = socket->min_rtt_us;
+  info->rtt_samples = socket->rtt_samples;
+  if (socket->rtt_hist) {
+    info->rtt_p50_us = histogram_percentile(socket->rtt_hist, 50.0);
+    info->rtt_p90_us = histogram_percentile(socket->rtt_hist, 90.0);
+    info->rtt_p99_us = histogram_percentile(socket->rtt_hist, 99.0);
+    info->rtt_max_us = socket->rtt_hist->max;
+  }
+
+  info->packets_send = socket->packets_send;
+  info->packets_received = socket->packets_received;
+  info->bytes_send = socket->bytes_send;
+  info->bytes_received = socket->bytes_received;
+  info->bytes_acked = socket->bytes_acked;
+
+  info->retrans_timeout = socket->retrans_timeout;
+  info->retrans_fast = socket->retrans_fast;
+  info->retrans_packets = socket->packets_lost;
+  info->retrans_bytes = socket->bytes_lost;
+  info->dup_acks = socket->dup_acks;
+  info->zero_window_events = socket->zero_window_events;
+  info->window_probes = socket->window_probes;
+  info->window_updates = socket->window_updates;
+  info->syn_data = socket->syn_data;
+  info->mss = socket->mss;
+  info->snd_wscale = socket->snd_wscale;
+  info->rcv_wscale = socket->rcv_wscale;
+  info->rcvbuf = socket->rcvbuf_len;
+  info->rcv_rtt_us = socket->rcv_rtt_us;
+  info->sndbuf = socket->sndq ? socket->sndq->limit : socket->opt.sndbuf;
+  info->sndbuf_queued = socket->sndq ? socket->sndq->len - socket->sndq->tx.acked : 0;
+  info->mem_bytes = connection_memory(socket);
+  if (socket->send_active_us) {
+    info->delivery_rate = socket->bytes_acked * 1000000 / socket->send_active_us;
+  }
+  return 0;
+}
 
 
+int
+microtcp_trace_dump (const microtcp_sock_t *socket, int fd)
+{
+#if MICROTCP_TRACE
+  if (socket->trace) {
+    return trace_dump(socket->trace, fd);
+  }
+#endif
+  return -1;
 }
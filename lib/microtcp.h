@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -33,6 +34,9 @@
 #include <unistd.h>
 #include <time.h>
 
+#include "../utils/reasm.h"
+#include "../utils/histogram.h"
+
 
 
 /* -- defines some values for the control field in header --
@@ -52,7 +56,8 @@
 
 
 /*
- * Several useful constants
+ * Several useful constants. The first six are the defaults of the socket
+ * options, see microtcp_setsockopt()
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
 #define MICROTCP_MSS 1400
@@ -61,6 +66,31 @@
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
 #define DATA_LENGTH 32
+#define MICROTCP_CORK_TIMEOUT_US 40000  /* max time a corked runt may wait */
+#define MICROTCP_FIN_RETRIES 10         /* FIN retransmissions before giving up */
+#define MICROTCP_SYN_RETRIES 25         /* SYN retransmissions, 5s with the ACK timeout */
+#define MICROTCP_STREAM_WIN (4 * MICROTCP_MSS)  /* bytes in flight per stream */
+#define MICROTCP_RCVBUF_MAX (4 * 1024 * 1024)   /* receive buffer auto-tuning limit */
+#define MICROTCP_RCVBUF_IDLE_US 1000000         /* idle time that resets the receive buffer */
+#define MICROTCP_SNDBUF_LEN (64 * 1024)         /* default send buffer */
+#define MICROTCP_SNDBUF_MAX (4 * 1024 * 1024)   /* send buffer auto-tuning limit */
+#define MICROTCP_PERSIST_MAX_US 60000000        /* longest wait between zero window probes */
+#define MICROTCP_MAX_STREAMS 1024               /* streams the peer may have open at once */
+
+/* options of microtcp_setsockopt(), all values are uint32_t */
+#define MICROTCP_SO_MSS 1           /* payload bytes per segment, agreed on at the handshake */
+#define MICROTCP_SO_RCVBUF 2        /* receive buffer, the window we advertise */
+#define MICROTCP_SO_INIT_CWND 3     /* initial congestion window, in segments */
+#define MICROTCP_SO_INIT_SSTHRESH 4 /* initial slow start threshold, in bytes */
+#define MICROTCP_SO_ACK_TIMEOUT 5   /* retransmission timeout, in us */
+#define MICROTCP_SO_SNDBUF 6        /* send buffer, 0 makes microtcp_send() wait for the ACKs */
+#define MICROTCP_SO_MAX_STREAMS 7   /* receive streams open at once, see microtcp_stream_recv() */
+
+/* flags for microtcp_send() */
+#define MICROTCP_MSG_MORE 0x1   /* more data follows, hold back a partial segment */
+
+/* flags for microtcp_recv() */
+#define MICROTCP_MSG_TRUNC 0x2  /* message mode: return the real length of a truncated message */
 
 /**
  * Possible states of the microTCP socket
@@ -90,6 +120,21 @@ typedef enum
 
 
 
+/**
+ * The settings of a socket, see microtcp_setsockopt()
+ */
+typedef struct
+{
+  uint32_t mss;                 /**< MICROTCP_SO_MSS */
+  uint32_t rcvbuf;              /**< MICROTCP_SO_RCVBUF */
+  uint32_t init_cwnd;           /**< MICROTCP_SO_INIT_CWND, in segments */
+  uint32_t init_ssthresh;       /**< MICROTCP_SO_INIT_SSTHRESH */
+  uint32_t ack_timeout_us;      /**< MICROTCP_SO_ACK_TIMEOUT */
+  uint32_t sndbuf;              /**< MICROTCP_SO_SNDBUF */
+  uint32_t max_streams;         /**< MICROTCP_SO_MAX_STREAMS */
+} microtcp_sockopt_t;
+
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
@@ -110,9 +155,14 @@ typedef struct
                                      is freed at the shutdown of the connection. This buffer is used
                                      to retrieve the data from the network. */
   size_t buf_fill_level;        /**< Amount of data in the buffer */
+  reasm_t reasm;                /**< Out-of-order ranges placed ahead of ack_number */
+  uint8_t *reasm_buf;           /**< The bytes of those ranges between two calls, at
+                                     their offset from ack_number */
+  size_t reasm_buf_len;
 
   size_t cwnd;
   size_t ssthresh;
+  size_t bytes_in_flight;       /**< Sent but not yet ACKed */
 
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
@@ -122,13 +172,156 @@ typedef struct
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+  uint64_t bytes_acked;
+  uint64_t retrans_timeout;     /**< Retransmission rounds caused by a timeout */
+  uint64_t retrans_fast;        /**< Retransmission rounds caused by 3 dup ACKs */
+  uint64_t dup_acks;
+  uint64_t zero_window_events;
+  uint64_t window_probes;
+  uint64_t persist_us;          /**< Next zero window probe interval, 0 when not persisting */
+  uint64_t send_active_us;      /**< Time spent with data in flight */
+
+  uint64_t srtt_us;             /**< Smoothed RTT (RFC 6298) */
+  uint64_t rttvar_us;           /**< RTT variation (RFC 6298) */
+  uint64_t min_rtt_us;
+  uint64_t rtt_samples;
+  histogram_t *rtt_hist;        /**< RTT distribution, alive while connected */
+  struct trace_ring *trace;     /**< Event trace, only with MICROTCP_TRACE */
 
   struct sockaddr_in address;   /* Save address for when terminating */
   socklen_t address_len;
 
+  uint8_t *cork_buf;            /**< Holds small writes until a full MSS is gathered */
+  size_t cork_len;              /**< Amount of data waiting in cork_buf */
+  uint64_t cork_stamp;          /**< When (us, monotonic) the oldest corked byte was queued */
+  uint8_t cork_more;            /**< Held by cork or MICROTCP_MSG_MORE, not only by Nagle */
+  uint8_t cork;                 /**< Cork mode, see microtcp_set_cork() */
+  uint8_t nagle;                /**< Nagle algorithm, see microtcp_set_nagle() */
+  uint8_t fastopen;             /**< Fast open, see microtcp_set_fastopen() */
+  size_t syn_data;              /**< Payload the SYN carried and the server took */
+
+  struct stream_table *tx_streams;  /**< Offsets of the streams we send */
+  struct stream_table *rx_streams;  /**< Next expected offset of the streams we receive */
+  uint32_t rx_stream;           /**< Stream of the bytes left in recvbuf */
+  uint8_t rx_stream_fin;        /**< Those bytes end their stream */
+  uint32_t peer_max_streams;    /**< Streams the peer takes open at once */
+
+  uint8_t message_mode;         /**< Message mode, see microtcp_set_message_mode() */
+
+  microtcp_sockopt_t opt;       /**< Settings, see microtcp_setsockopt() */
+  uint32_t mss;                 /**< The MSS agreed on at the handshake */
+  size_t rcvbuf_len;            /**< The receive window we advertise */
+  uint8_t snd_wscale;           /**< Shift of the windows the peer advertises */
+  uint8_t rcv_wscale;           /**< Shift of the windows we advertise */
+
+  uint8_t rcvbuf_locked;        /**< Set with MICROTCP_SO_RCVBUF, no auto-tuning */
+  uint32_t rcv_edge;            /**< Right edge of the window we advertised */
+  uint64_t window_updates;
+  uint64_t rcv_rtt_us;          /**< RTT as seen by the receiver */
+  uint32_t rcv_rtt_seq;         /**< The RTT sample ends when data reaches here */
+  uint64_t rcv_rtt_stamp;       /**< When it started, 0 if none is running */
+  size_t rcv_space;             /**< Most in-order bytes received in one RTT */
+  uint32_t rcv_space_seq;       /**< ack_number when the current RTT began */
+  uint64_t rcv_space_stamp;
+  uint64_t last_rx_us;          /**< Last in-order data */
+
+  struct send_queue *sndq;      /**< Sent data not ACKed yet, see MICROTCP_SO_SNDBUF */
+  uint8_t sndbuf_locked;        /**< Set with MICROTCP_SO_SNDBUF, no auto-tuning */
+
+  struct duplex *duplex;        /**< Shared state of full duplex, see microtcp_set_duplex() */
+
 } microtcp_sock_t;
 
 
+/**
+ * Snapshot of the state and the statistics of a connection,
+ * see microtcp_get_info()
+ */
+typedef struct
+{
+  mircotcp_state_t state;
+  size_t cwnd;
+  size_t ssthresh;
+  size_t peer_window;           /**< Last window advertised by the peer */
+  size_t bytes_in_flight;
+
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t min_rtt_us;
+  uint64_t rtt_samples;
+  uint64_t rtt_p50_us;          /**< RTT percentiles, 0 once the connection is closed */
+  uint64_t rtt_p90_us;
+  uint64_t rtt_p99_us;
+  uint64_t rtt_max_us;
+
+  uint64_t packets_send;
+  uint64_t packets_received;
+  uint64_t bytes_send;          /**< Including headers and retransmissions */
+  uint64_t bytes_received;      /**< Including headers and duplicates */
+  uint64_t bytes_acked;         /**< Payload bytes ACKed by the peer */
+
+  uint64_t retrans_timeout;     /**< Retransmission rounds caused by a timeout */
+  uint64_t retrans_fast;        /**< Retransmission rounds caused by 3 dup ACKs */
+  uint64_t retrans_packets;
+  uint64_t retrans_bytes;
+  uint64_t dup_acks;
+  uint64_t zero_window_events;  /**< Times the peer advertised a zero window */
+  uint64_t window_probes;       /**< Zero window probes sent */
+  uint64_t window_updates;      /**< ACKs sent only because our window reopened */
+  uint64_t delivery_rate;       /**< ACKed bytes per second while data was in flight */
+  uint64_t syn_data;            /**< Fast open payload carried by the SYN */
+  uint32_t mss;                 /**< The MSS agreed on at the handshake */
+  uint8_t snd_wscale;
+  uint8_t rcv_wscale;
+  size_t rcvbuf;                /**< Current receive buffer, see MICROTCP_SO_RCVBUF */
+  uint64_t rcv_rtt_us;
+  size_t sndbuf;                /**< Current send buffer, see MICROTCP_SO_SNDBUF */
+  size_t sndbuf_queued;         /**< Bytes in it not ACKed yet */
+  size_t mem_bytes;             /**< Buffers and state the library holds for it */
+} microtcp_info_t;
+
+
+/**
+ * Counters of the allocator behind the segment buffers and connection
+ * state of the library, see microtcp_get_alloc_stats()
+ */
+typedef struct
+{
+  uint64_t system_allocs;       /**< Arenas mapped plus large blocks from malloc() */
+  uint64_t arenas;
+  uint64_t huge_arenas;         /**< Arenas backed by huge pages, see MICROTCP_HUGEPAGES */
+  uint64_t arena_bytes;
+  uint64_t large_allocs;        /**< Blocks above the largest size class */
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t cache_hits;          /**< Allocations served by the free list of the thread */
+  uint64_t in_use_bytes;
+} microtcp_alloc_stats_t;
+
+
+/**
+ * One stream of a multiplexed send, see microtcp_send_streams()
+ */
+typedef struct
+{
+  uint32_t id;                  /**< Stream id, picked by the sender */
+  const void *buffer;
+  size_t length;                /**< Continues the stream where the last send on this id ended */
+  int fin;                      /**< The stream ends with this data, length must not be 0 */
+} microtcp_stream_t;
+
+
+/**
+ * One message of microtcp_recv_msgs()
+ */
+typedef struct
+{
+  void *buffer;
+  size_t length;                /**< Size of buffer */
+  size_t msg_len;               /**< Set to the message length, above length if it was truncated */
+} microtcp_msg_t;
+
+
 /**
  * microTCP header structure
  * NOTE: DO NOT CHANGE!
@@ -154,10 +347,78 @@ int
 microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
                socklen_t address_len);
 
+/**
+ * Sets a socket option, one of MICROTCP_SO_*. A new socket starts with
+ * the process defaults: the MICROTCP_* constants, overridden by the
+ * environment variables MICROTCP_MSS, MICROTCP_RCVBUF,
+ * MICROTCP_INIT_CWND, MICROTCP_INIT_SSTHRESH, MICROTCP_ACK_TIMEOUT_US,
+ * MICROTCP_SNDBUF and MICROTCP_MAX_STREAMS when they are set and valid.
+ *
+ * The MSS, the receive buffer and the stream limit are announced at
+ * the handshake and can only be set before microtcp_connect() or
+ * microtcp_accept(). The peers use the smaller of their MSS, a receive
+ * buffer above 64 KB makes them scale the window field. The initial cwnd and ssthresh apply to the
+ * next connection, the ACK timeout right away.
+ *
+ * The receive buffer is auto-tuned: it starts at the default and grows
+ * toward twice the bandwidth-delay product, up to MICROTCP_RCVBUF_MAX,
+ * while the application keeps reading. Setting MICROTCP_SO_RCVBUF fixes
+ * it instead. The send buffer likewise grows to twice the usable
+ * window, up to MICROTCP_SNDBUF_MAX, unless MICROTCP_SO_SNDBUF is set.
+ *
+ * @param socket the socket structure
+ * @param optname the option
+ * @param optval points to the uint32_t value
+ * @param optlen sizeof(uint32_t)
+ * @return 0 on success or -1 with errno EINVAL if the value is out of
+ * range, ENOPROTOOPT for an unknown option or EISCONN if the option can
+ * no longer be changed
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int optname, const void *optval,
+                     socklen_t optlen);
+
+/**
+ * Reads a socket option, see microtcp_setsockopt(). Once connected,
+ * MICROTCP_SO_MSS reads the agreed MSS.
+ *
+ * @param optlen in: the size of optval, out: sizeof(uint32_t)
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_getsockopt (const microtcp_sock_t *socket, int optname, void *optval,
+                     socklen_t *optlen);
+
 int
 microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
                   socklen_t address_len);
 
+/**
+ * Connects like microtcp_connect() and sends length bytes of data. With a
+ * fast open cookie from an earlier connection to the same server, the
+ * first MSS of data rides on the SYN and is ACKed by the SYN_ACK, saving
+ * a round trip. Without one the SYN asks the server for a cookie and all
+ * the data is sent after the handshake. Enables fast open on the socket.
+ *
+ * @return length on success or -1 on failure
+ */
+ssize_t
+microtcp_connect_data (microtcp_sock_t *socket, const struct sockaddr *address,
+                       socklen_t address_len, const void *buffer, size_t length);
+
+/**
+ * Enables or disables fast open. On a client, microtcp_connect() then
+ * asks the server for a cookie. On a server, microtcp_accept() hands
+ * out cookies and takes data from SYNs with a valid one. That data is
+ * the first thing microtcp_recv() returns. A cookie is a SipHash of the
+ * client address under a random key that changes every hour, so it
+ * stays valid for one to two hours.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_fastopen (microtcp_sock_t *socket, int on);
+
 /**
  * Blocks waiting for a new connection from a remote peer.
  *
@@ -171,15 +432,278 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Closes the connection with the FIN handshake and frees what the
+ * library holds for it. The buffers are freed on failure as well, the
+ * socket is INVALID then. The UDP socket stays open.
+ *
+ * @return 0 on success or -1 on failure
+ */
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Frees what the library holds for the socket, whatever its state, and
+ * closes the UDP socket. Nothing is sent to the peer, call
+ * microtcp_shutdown() first for an orderly close. Closing a socket
+ * twice does nothing.
+ *
+ * @return 0 on success or -1 if close() failed
+ */
+int
+microtcp_close (microtcp_sock_t *socket);
+
+/**
+ * Sends data to the connected peer.
+ *
+ * The data is copied into the send buffer and goes out as the windows
+ * allow. The call returns once it all fits in the buffer, it does not
+ * wait for the ACKs: those are taken by the next calls on the socket.
+ * Any other call that sends or receives first waits until the buffer
+ * is empty, microtcp_flush() does it explicitly.
+ *
+ * The library has no timer of its own. Between calls nothing takes
+ * ACKs or retransmits, so a lost segment stays lost while the
+ * application does something else. Call microtcp_flush() (with full
+ * duplex, from the sending thread) before waiting on anything other
+ * than this socket, or before going idle with data still queued, see
+ * sndbuf_queued in microtcp_get_info().
+ *
+ * If MICROTCP_MSG_MORE is set in flags, or the socket is corked, a trailing
+ * partial segment is held back and coalesced with the next writes. It is
+ * sent once a full MSS is gathered, on uncork/flush, on a receive, or when
+ * it has waited for MICROTCP_CORK_TIMEOUT_US. The timeout is checked while
+ * the library waits for ACKs, and whenever the socket sends again.
+ *
+ * @return the number of bytes accepted (sent or held back) or -1 on
+ * failure, with errno set to EPIPE once either end has closed
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Sends several streams over the connection at once. Their segments are
+ * interleaved round robin under the one congestion window, and each
+ * stream has at most MICROTCP_STREAM_WIN bytes (or what the receiver
+ * grants it) in flight. A short stream is therefore done after a few
+ * round trips, however large the others are. The stream id and offset
+ * travel in the header's future_use fields. Blocks until every stream
+ * is ACKed. The peer reads with microtcp_stream_recv().
+ *
+ * The streams of the call, and those earlier calls left without a FIN,
+ * must not be more than the peer's MICROTCP_SO_MAX_STREAMS, which it
+ * announces at the handshake rounded down to a power of two.
+ *
+ * @return the number of bytes sent or -1 on failure, with errno EMFILE
+ * if the peer would have too many streams open
+ */
+ssize_t
+microtcp_send_streams (microtcp_sock_t *socket, const microtcp_stream_t *streams,
+                       size_t count);
+
+/**
+ * Sends data on a single stream, see microtcp_send_streams().
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_stream_send (microtcp_sock_t *socket, uint32_t id, const void *buffer,
+                      size_t length, int fin);
+
+/**
+ * Receives data of whichever stream has some ready. A segment is handed
+ * over as soon as it is in order within its own stream, a loss on
+ * another stream does not hold it back.
+ *
+ * @param socket the socket structure
+ * @param id set to the stream the data belongs to
+ * @param buffer where the data goes
+ * @param length the size of buffer
+ * @param fin set to 1 when the returned data ends the stream
+ * @return the number of bytes received, 0 if the peer closed the
+ * connection or -1 on failure
+ *
+ * At most MICROTCP_SO_MAX_STREAMS streams are open at once, a stream
+ * stays open until its FIN. The segments of a stream beyond that are
+ * ACKed and dropped until another stream ends.
+ */
+ssize_t
+microtcp_stream_recv (microtcp_sock_t *socket, uint32_t *id, void *buffer,
+                      size_t length, int *fin);
+
+/**
+ * Enables or disables message mode. Every microtcp_send() is then one
+ * message: its segments never carry bytes of another message and the
+ * last one is flagged in the header. microtcp_recv() returns exactly one
+ * message, the part that does not fit in the buffer is discarded. Cork,
+ * MICROTCP_MSG_MORE and Nagle do not apply. Both ends must enable it.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_message_mode (microtcp_sock_t *socket, int on);
+
+/**
+ * Enables or disables full duplex on an established connection. One
+ * thread may then call microtcp_send(), microtcp_sendfile() and
+ * microtcp_flush() while another calls microtcp_recv() and
+ * microtcp_recvfile(). The sending thread owns the sequence number,
+ * the congestion window and the send buffer, the receiving one owns the
+ * ACK number, the receive window and recvbuf. The UDP socket and the
+ * counters are shared behind a lock, and whichever thread is waiting
+ * for a segment hands the ones meant for the other thread over.
+ *
+ * A receive no longer waits for the send buffer to empty, and data
+ * segments carry the receiver's latest ACK and window. When the peer
+ * closes, microtcp_recv() returns 0 and microtcp_send() fails with
+ * EPIPE, but the connection stays open. Call microtcp_shutdown() once
+ * both threads are done with the socket. Message mode, streams and
+ * microtcp_keepalive() cannot be used with full duplex.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_duplex (microtcp_sock_t *socket, int on);
+
+/**
+ * Sends count messages in one go, message mode only. They share the
+ * window, so small messages do not wait a round trip each. Messages must
+ * not be empty.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_send_msgs (microtcp_sock_t *socket, const struct iovec *msgs, size_t count);
+
+/**
+ * Receives up to count messages, message mode only. Blocks for the first
+ * one, the others are taken only if they have already arrived.
+ *
+ * @return the number of messages received, 0 if the peer closed the
+ * connection or -1 on failure
+ */
+ssize_t
+microtcp_recv_msgs (microtcp_sock_t *socket, microtcp_msg_t *msgs, size_t count);
+
+/**
+ * Enables or disables cork mode. While corked, only full-MSS segments are
+ * sent. Uncorking sends any data held back.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_cork (microtcp_sock_t *socket, int on);
+
+/**
+ * Enables or disables the Nagle algorithm. With Nagle enabled a partial
+ * segment is held back while sent data is not ACKed yet, and coalesced
+ * with the next writes. It goes out with the last of those ACKs, on a
+ * receive or flush, or after MICROTCP_CORK_TIMEOUT_US at the latest.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_nagle (microtcp_sock_t *socket, int on);
+
+/**
+ * Sends any data held back by cork mode, MICROTCP_MSG_MORE or Nagle,
+ * and waits until everything in the send buffer is ACKed.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_flush (microtcp_sock_t *socket);
+
+/**
+ * Sends count bytes of the file fd starting at offset. The file is mapped
+ * in memory and the segments are sent straight out of the mapping, so the
+ * window stays full for the whole transfer.
+ *
+ * @param socket the socket structure
+ * @param fd the file to send, opened for reading
+ * @param offset the offset in the file to start from
+ * @param count the number of bytes to send, 0 sends up to the end of file.
+ * A regular file is sent up to its end at most
+ * @return the number of bytes sent, 0 if offset is at or past the end of
+ * the file, or -1 on failure
+ */
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count);
+
+/**
+ * Receives data from the connected peer. Blocks until at least one byte
+ * is available, in message mode until a whole message is. There,
+ * MICROTCP_MSG_TRUNC in flags returns the length of the message even if
+ * it was longer than the buffer.
+ *
+ * @return the number of bytes received, 0 if the peer closed the
+ * connection or -1 on failure
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Receives count bytes from the connected peer and writes them to the
+ * file fd. Regular files are preallocated and memory-mapped, so payload is
+ * received straight into the page cache at its final offset, out of order
+ * segments included. Other descriptors are written in large batches.
+ * The data is written at the current file position, which is advanced
+ * past it. The file grows as needed, bytes it held past the data stay.
+ *
+ * @param socket the socket structure
+ * @param fd the file to write to, opened for reading and writing
+ * @param count the number of bytes to receive, 0 receives until the peer
+ * closes the connection
+ * @return the number of bytes received or -1 on failure
+ */
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, size_t count);
+
+/**
+ * Checks that an idle connection is still usable. Segments already
+ * queued are read first, a FIN from the peer closes the connection.
+ * With probe set, a keep-alive segment is sent as well and the peer has
+ * MICROTCP_ACK_TIMEOUT_US to ACK it. The peer only answers while it is
+ * in microtcp_recv().
+ *
+ * A connection with data the application has not received is not idle:
+ * the check fails with EBUSY and leaves the data for microtcp_recv().
+ *
+ * @return 0 if the connection is alive or -1 if it is not
+ */
+int
+microtcp_keepalive (microtcp_sock_t *socket, int probe);
+
+/**
+ * Fills info with a snapshot of the connection state and statistics.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_get_info (const microtcp_sock_t *socket, microtcp_info_t *info);
+
+/**
+ * Writes the binary event trace of the connection to fd. The trace is
+ * only recorded when the library is built with -DENABLE_TRACE=ON. It is
+ * also dumped at shutdown in $MICROTCP_TRACE_DIR, if that is set.
+ * Use trace_decode to turn a dump into CSV.
+ *
+ * @return 0 on success or -1 on failure (or if tracing is compiled out)
+ */
+int
+microtcp_trace_dump (const microtcp_sock_t *socket, int fd);
+
+/**
+ * Fills stats with the counters of the library allocator, over all
+ * connections of the process. Receive, send and queue buffers come from
+ * per-thread free lists backed by arenas of 2 MB, so a connection that
+ * has warmed up sends and receives without any system allocation. Set
+ * MICROTCP_HUGEPAGES in the environment to back the arenas with huge
+ * pages, transparent ones if none are reserved.
+ */
+void
+microtcp_get_alloc_stats (microtcp_alloc_stats_t *stats);
+
 
 #endif /* LIB_MICROTCP_H_ */
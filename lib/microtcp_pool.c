@@ -0,0 +1,298 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "microtcp_pool.h"
+#include "microtcp_slab.h"
+
+#define POOL_PROBE_AFTER_US 1000000   /* default idle time before a probe */
+#define POOL_REAP_MIN_US 10000        /* the reaper never runs more often */
+
+/* an idle connection. the list is kept most recently used first */
+typedef struct pool_entry
+{
+  struct pool_entry *next;
+  microtcp_sock_t sock;
+  uint64_t idle_since;          /**< us, monotonic */
+} pool_entry_t;
+
+struct microtcp_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t reaper;
+  pool_entry_t *idle;
+  size_t nidle;
+  size_t max_idle;
+  uint64_t idle_timeout_us;
+  uint64_t probe_after_us;
+  int stop;
+  microtcp_pool_stats_t stats;
+};
+
+
+static uint64_t
+pool_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+close_connection (microtcp_sock_t *socket)
+{
+  if (socket->state == ESTABLISHED) {
+    microtcp_shutdown(socket, SHUT_RDWR);
+  }
+  microtcp_close(socket);
+}
+
+
+static int
+same_destination (const microtcp_sock_t *socket, const struct sockaddr_in *addr)
+{
+  return socket->address.sin_addr.s_addr == addr->sin_addr.s_addr
+      && socket->address.sin_port == addr->sin_port;
+}
+
+
+/* closes what has been idle for too long. the connections are taken off
+ * the list under the lock and shut down without it */
+static void *
+reaper (void *arg)
+{
+  microtcp_pool_t *pool = arg;
+  pool_entry_t **pp, *e, *expired;
+  struct timespec ts;
+  uint64_t period, now;
+
+  period = pool->idle_timeout_us / 2;
+  if (period < POOL_REAP_MIN_US) {
+    period = POOL_REAP_MIN_US;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += period / 1000000;
+    ts.tv_nsec += (period % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pool->wake, &pool->lock, &ts);
+    if (pool->stop) {
+      break;
+    }
+
+    now = pool_now_us();
+    expired = NULL;
+    pp = &pool->idle;
+    while ((e = *pp)) {
+      if (now - e->idle_since >= pool->idle_timeout_us) {
+        *pp = e->next;
+        e->next = expired;
+        expired = e;
+        pool->nidle--;
+        pool->stats.reaped++;
+      } else {
+        pp = &e->next;
+      }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    while ((e = expired)) {
+      expired = e->next;
+      close_connection(&e->sock);
+      slab_free(e, sizeof(pool_entry_t));
+    }
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+
+microtcp_pool_t *
+microtcp_pool_new (size_t max_idle, uint64_t idle_timeout_us)
+{
+  microtcp_pool_t *pool = calloc(1, sizeof(microtcp_pool_t));
+
+  if (!pool) {
+    perror("Allocate connection pool");
+    return NULL;
+  }
+  pool->max_idle = max_idle;
+  pool->idle_timeout_us = idle_timeout_us;
+  pool->probe_after_us = POOL_PROBE_AFTER_US;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  if (pthread_create(&pool->reaper, NULL, reaper, pool)) {
+    perror("Start the pool reaper");
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+
+void
+microtcp_pool_set_probe_after (microtcp_pool_t *pool, uint64_t idle_us)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->probe_after_us = idle_us;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+int
+microtcp_pool_get (microtcp_pool_t *pool, const struct sockaddr *address,
+                   socklen_t address_len, microtcp_sock_t *socket)
+{
+  const struct sockaddr_in *addr = (const struct sockaddr_in *)address;
+  pool_entry_t **pp, *e;
+  uint64_t probe_after;
+  int probe;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    for (pp = &pool->idle; (e = *pp) && !same_destination(&e->sock, addr); pp = &e->next)
+      ;
+    if (e) {
+      *pp = e->next;
+      pool->nidle--;
+    }
+    probe_after = pool->probe_after_us;
+    pthread_mutex_unlock(&pool->lock);
+    if (!e) {
+      break;
+    }
+
+    probe = pool_now_us() - e->idle_since >= probe_after;
+    *socket = e->sock;
+    slab_free(e, sizeof(pool_entry_t));
+    if (!microtcp_keepalive(socket, probe)) {
+      pthread_mutex_lock(&pool->lock);
+      pool->stats.hits++;
+      pool->stats.probes += probe;
+      pthread_mutex_unlock(&pool->lock);
+      return 0;
+    }
+
+    /* dead, try the next one */
+    close_connection(socket);
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.probes += probe;
+    pool->stats.stale++;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.misses++;
+  pthread_mutex_unlock(&pool->lock);
+
+  *socket = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+  if (socket->sd < 0) {
+    return -1;
+  }
+  if (microtcp_connect(socket, address, address_len) < 0) {
+    microtcp_close(socket);
+    return -1;
+  }
+  return 0;
+}
+
+
+void
+microtcp_pool_put (microtcp_pool_t *pool, microtcp_sock_t *socket)
+{
+  pool_entry_t *e;
+
+  /* nothing corked may stay behind in an idle connection */
+  if (socket->state != ESTABLISHED || microtcp_flush(socket) < 0) {
+    close_connection(socket);
+    return;
+  }
+
+  e = slab_alloc(sizeof(pool_entry_t));
+  pthread_mutex_lock(&pool->lock);
+  if (!e || pool->stop || pool->nidle >= pool->max_idle) {
+    pthread_mutex_unlock(&pool->lock);
+    slab_free(e, sizeof(pool_entry_t));
+    close_connection(socket);
+    return;
+  }
+  e->sock = *socket;
+  e->idle_since = pool_now_us();
+  e->next = pool->idle;
+  pool->idle = e;
+  pool->nidle++;
+  pthread_mutex_unlock(&pool->lock);
+
+  socket->sd = -1;
+  socket->state = CLOSED;
+}
+
+
+void
+microtcp_pool_discard (microtcp_pool_t *pool, microtcp_sock_t *socket)
+{
+  (void)pool;
+  close_connection(socket);
+}
+
+
+void
+microtcp_pool_get_stats (microtcp_pool_t *pool, microtcp_pool_stats_t *stats)
+{
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  stats->idle = pool->nidle;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+void
+microtcp_pool_free (microtcp_pool_t *pool)
+{
+  pool_entry_t *e;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->reaper, NULL);
+
+  while ((e = pool->idle)) {
+    pool->idle = e->next;
+    close_connection(&e->sock);
+    slab_free(e, sizeof(pool_entry_t));
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  free(pool);
+}
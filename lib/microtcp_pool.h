@@ -0,0 +1,103 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_POOL_H_
+#define LIB_MICROTCP_POOL_H_
+
+#include "microtcp.h"
+
+/**
+ * A client side pool of established connections. Connections handed
+ * back with microtcp_pool_put() are kept idle, keyed by destination, and
+ * microtcp_pool_get() reuses them instead of connecting again. A thread
+ * closes connections that stay idle for longer than the idle timeout.
+ * The pool may be shared between threads, a connection belongs to one
+ * caller between get and put.
+ */
+typedef struct microtcp_pool microtcp_pool_t;
+
+/**
+ * Counters of a pool, see microtcp_pool_get_stats()
+ */
+typedef struct
+{
+  uint64_t hits;                /**< Gets served by an idle connection */
+  uint64_t misses;              /**< Gets that had to connect */
+  uint64_t probes;              /**< Keep-alive probes sent */
+  uint64_t stale;               /**< Idle connections found dead at get */
+  uint64_t reaped;              /**< Idle connections closed on timeout */
+  uint64_t idle;                /**< Connections idle right now */
+} microtcp_pool_stats_t;
+
+/**
+ * Creates a pool.
+ *
+ * @param max_idle the most idle connections kept, over all destinations
+ * @param idle_timeout_us idle connections are closed after this long
+ * @return the pool or NULL on failure
+ */
+microtcp_pool_t *
+microtcp_pool_new (size_t max_idle, uint64_t idle_timeout_us);
+
+/**
+ * Sets how long a connection may sit idle before microtcp_pool_get()
+ * probes it with microtcp_keepalive(). Connections idle for less are
+ * only checked for a FIN that arrived meanwhile. The default is 1 s,
+ * 0 probes every time.
+ */
+void
+microtcp_pool_set_probe_after (microtcp_pool_t *pool, uint64_t idle_us);
+
+/**
+ * Gives out an established connection to address: the most recently
+ * used idle one that is still alive, or a new one.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_pool_get (microtcp_pool_t *pool, const struct sockaddr *address,
+                   socklen_t address_len, microtcp_sock_t *socket);
+
+/**
+ * Hands a connection back to the pool. It must have no reply left
+ * unread. A connection that is no longer established, or does not fit
+ * in the pool, is closed.
+ */
+void
+microtcp_pool_put (microtcp_pool_t *pool, microtcp_sock_t *socket);
+
+/**
+ * Closes a connection that came from the pool instead of handing it
+ * back, e.g. after an error.
+ */
+void
+microtcp_pool_discard (microtcp_pool_t *pool, microtcp_sock_t *socket);
+
+void
+microtcp_pool_get_stats (microtcp_pool_t *pool, microtcp_pool_stats_t *stats);
+
+/**
+ * Stops the reaper and closes every idle connection. Connections that
+ * are given out must be put back or discarded before.
+ */
+void
+microtcp_pool_free (microtcp_pool_t *pool);
+
+#endif /* LIB_MICROTCP_POOL_H_ */
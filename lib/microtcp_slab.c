@@ -0,0 +1,370 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each thread keeps a free list per size class. A thread that runs dry
+ * takes a batch from the depot, the lists shared by all threads, and one
+ * that holds too much gives half of it back. The depot carves new arenas
+ * when it is empty. Arenas are never unmapped, the memory of the library
+ * is bounded by the most it ever held at once.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "microtcp.h"
+#include "microtcp_slab.h"
+
+#define SLAB_CLASSES 17                         /* 64 B up to 4 MB */
+#define SLAB_CACHE_OBJS 64                      /* most blocks a thread keeps per class */
+#define SLAB_CACHE_BYTES (8 * 1024 * 1024)      /* but not more than this, two blocks at least */
+#define SLAB_BATCH_BYTES (256 * 1024)           /* moved between a thread and the depot at once */
+
+struct slab_block
+{
+  struct slab_block *next;
+};
+
+struct slab_cache
+{
+  struct slab_block *head[SLAB_CLASSES];
+  uint32_t count[SLAB_CLASSES];
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  struct slab_block *head[SLAB_CLASSES];
+} depot = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
+
+static __thread struct slab_cache *thread_cache;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static int use_hugepages;
+
+static _Atomic uint64_t stat_arenas;
+static _Atomic uint64_t stat_huge_arenas;
+static _Atomic uint64_t stat_arena_bytes;
+static _Atomic uint64_t stat_large_allocs;
+static _Atomic uint64_t stat_allocs;
+static _Atomic uint64_t stat_frees;
+static _Atomic uint64_t stat_cache_hits;
+static _Atomic int64_t stat_in_use;
+
+
+static inline int
+slab_class (size_t size)
+{
+  int c = 0;
+
+  while (((size_t)MICROTCP_SLAB_MIN << c) < size) {
+    c++;
+  }
+  return c;
+}
+
+
+static inline size_t
+class_size (int c)
+{
+  return (size_t)MICROTCP_SLAB_MIN << c;
+}
+
+
+static inline uint32_t
+cache_limit (int c)
+{
+  size_t objs = SLAB_CACHE_BYTES / class_size(c);
+
+  return objs < 2 ? 2 : objs > SLAB_CACHE_OBJS ? SLAB_CACHE_OBJS : objs;
+}
+
+
+static inline uint32_t
+batch_len (int c)
+{
+  size_t objs = SLAB_BATCH_BYTES / class_size(c);
+
+  return objs < 1 ? 1 : objs;
+}
+
+
+size_t
+slab_size (size_t size)
+{
+  return size > MICROTCP_SLAB_MAX ? size : class_size(slab_class(size ? size : 1));
+}
+
+
+/* the blocks of a thread that exits go back to the depot */
+static void
+cache_release (void *arg)
+{
+  struct slab_cache *cache = arg;
+  struct slab_block *b;
+  int c;
+
+  pthread_mutex_lock(&depot.lock);
+  for (c = 0; c < SLAB_CLASSES; c++) {
+    while ((b = cache->head[c])) {
+      cache->head[c] = b->next;
+      b->next = depot.head[c];
+      depot.head[c] = b;
+    }
+  }
+  pthread_mutex_unlock(&depot.lock);
+  free(cache);
+  thread_cache = NULL;
+}
+
+
+static void
+cache_key_create (void)
+{
+  pthread_key_create(&cache_key, cache_release);
+  use_hugepages = getenv("MICROTCP_HUGEPAGES") != NULL;
+}
+
+
+static struct slab_cache *
+cache_get (void)
+{
+  if (thread_cache) {
+    return thread_cache;
+  }
+  pthread_once(&cache_once, cache_key_create);
+  thread_cache = calloc(1, sizeof(struct slab_cache));
+  if (thread_cache) {
+    pthread_setspecific(cache_key, thread_cache);
+  }
+  return thread_cache;
+}
+
+
+/* maps a new arena and slices it into the depot, with the lock held */
+static int
+depot_grow (int c)
+{
+  size_t size = class_size(c);
+  size_t len = size > MICROTCP_SLAB_ARENA ? size : MICROTCP_SLAB_ARENA;
+  struct slab_block *b;
+  uint8_t *arena = MAP_FAILED;
+  size_t off;
+
+#ifdef MAP_HUGETLB
+  if (use_hugepages) {
+    arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena != MAP_FAILED) {
+      atomic_fetch_add(&stat_huge_arenas, 1);
+    }
+  }
+#endif
+  if (arena == MAP_FAILED) {
+    arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+      return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    /* no huge pages reserved, transparent ones are the next best thing */
+    if (use_hugepages) {
+      madvise(arena, len, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  atomic_fetch_add(&stat_arenas, 1);
+  atomic_fetch_add(&stat_arena_bytes, len);
+
+  for (off = len; off >= size; off -= size) {
+    b = (struct slab_block *)(arena + off - size);
+    b->next = depot.head[c];
+    depot.head[c] = b;
+  }
+  return 0;
+}
+
+
+/* moves a batch from the depot to the thread */
+static int
+cache_refill (struct slab_cache *cache, int c)
+{
+  uint32_t n = batch_len(c);
+  struct slab_block *b;
+
+  pthread_mutex_lock(&depot.lock);
+  if (!depot.head[c] && depot_grow(c) < 0) {
+    pthread_mutex_unlock(&depot.lock);
+    return -1;
+  }
+  while (n-- && (b = depot.head[c])) {
+    depot.head[c] = b->next;
+    b->next = cache->head[c];
+    cache->head[c] = b;
+    cache->count[c]++;
+  }
+  pthread_mutex_unlock(&depot.lock);
+  return 0;
+}
+
+
+/* gives half of the blocks of a class back to the depot */
+static void
+cache_trim (struct slab_cache *cache, int c)
+{
+  uint32_t n = cache->count[c] / 2;
+  struct slab_block *b;
+
+  pthread_mutex_lock(&depot.lock);
+  while (n--) {
+    b = cache->head[c];
+    cache->head[c] = b->next;
+    cache->count[c]--;
+    b->next = depot.head[c];
+    depot.head[c] = b;
+  }
+  pthread_mutex_unlock(&depot.lock);
+}
+
+
+void *
+slab_alloc (size_t size)
+{
+  struct slab_cache *cache;
+  struct slab_block *b;
+  int c;
+
+  if (size > MICROTCP_SLAB_MAX) {
+    b = malloc(size);
+    if (b) {
+      atomic_fetch_add(&stat_large_allocs, 1);
+      atomic_fetch_add(&stat_allocs, 1);
+      atomic_fetch_add(&stat_in_use, size);
+    }
+    return b;
+  }
+
+  c = slab_class(size ? size : 1);
+  cache = cache_get();
+  if (!cache) {
+    return NULL;
+  }
+  if (cache->head[c]) {
+    atomic_fetch_add_explicit(&stat_cache_hits, 1, memory_order_relaxed);
+  } else if (cache_refill(cache, c) < 0) {
+    return NULL;
+  }
+  b = cache->head[c];
+  cache->head[c] = b->next;
+  cache->count[c]--;
+
+  atomic_fetch_add_explicit(&stat_allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stat_in_use, class_size(c), memory_order_relaxed);
+  return b;
+}
+
+
+void *
+slab_zalloc (size_t size)
+{
+  void *p = slab_alloc(size);
+
+  if (p) {
+    memset(p, 0, size);
+  }
+  return p;
+}
+
+
+void
+slab_free (void *ptr, size_t size)
+{
+  struct slab_cache *cache;
+  struct slab_block *b = ptr;
+  int c;
+
+  if (!ptr) {
+    return;
+  }
+  atomic_fetch_add_explicit(&stat_frees, 1, memory_order_relaxed);
+  if (size > MICROTCP_SLAB_MAX) {
+    atomic_fetch_sub(&stat_in_use, size);
+    free(ptr);
+    return;
+  }
+
+  c = slab_class(size ? size : 1);
+  atomic_fetch_sub_explicit(&stat_in_use, class_size(c), memory_order_relaxed);
+  cache = cache_get();
+  if (!cache) {
+    /* no cache for this thread, straight to the depot */
+    pthread_mutex_lock(&depot.lock);
+    b->next = depot.head[c];
+    depot.head[c] = b;
+    pthread_mutex_unlock(&depot.lock);
+    return;
+  }
+  b->next = cache->head[c];
+  cache->head[c] = b;
+  if (++cache->count[c] > cache_limit(c)) {
+    cache_trim(cache, c);
+  }
+}
+
+
+void *
+slab_realloc (void *ptr, size_t old_size, size_t new_size, size_t keep)
+{
+  void *p;
+
+  if (ptr && slab_size(old_size) == slab_size(new_size)) {
+    return ptr;
+  }
+  p = slab_alloc(new_size);
+  if (!p) {
+    return NULL;
+  }
+  if (ptr) {
+    memcpy(p, ptr, keep);
+    slab_free(ptr, old_size);
+  }
+  return p;
+}
+
+
+void
+microtcp_get_alloc_stats (microtcp_alloc_stats_t *stats)
+{
+  int64_t in_use = atomic_load(&stat_in_use);
+
+  stats->arenas = atomic_load(&stat_arenas);
+  stats->huge_arenas = atomic_load(&stat_huge_arenas);
+  stats->arena_bytes = atomic_load(&stat_arena_bytes);
+  stats->large_allocs = atomic_load(&stat_large_allocs);
+  stats->system_allocs = stats->arenas + stats->large_allocs;
+  stats->allocs = atomic_load(&stat_allocs);
+  stats->frees = atomic_load(&stat_frees);
+  stats->cache_hits = atomic_load(&stat_cache_hits);
+  stats->in_use_bytes = in_use > 0 ? in_use : 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_SLAB_H_
+#define LIB_MICROTCP_SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * Internal allocator of the library for segment buffers and connection
+ * state. Blocks come in power of two size classes carved out of large
+ * mmap()ed arenas and go back to a per-thread free list, so once a
+ * connection has warmed up nothing reaches the system allocator. Sizes
+ * above MICROTCP_SLAB_MAX fall back to malloc().
+ *
+ * The free is sized: the caller passes the size it allocated with.
+ *
+ * Nothing here is part of the public API. The functions are hidden from
+ * the shared library's symbol table so their generic names cannot clash
+ * with an application's, and this header is not installed.
+ */
+
+#define MICROTCP_SLAB_INTERNAL __attribute__((visibility("hidden")))
+
+#define MICROTCP_SLAB_MIN 64
+#define MICROTCP_SLAB_MAX (4 * 1024 * 1024)
+#define MICROTCP_SLAB_ARENA (2 * 1024 * 1024)
+
+/* the bytes a request of size takes from the allocator */
+MICROTCP_SLAB_INTERNAL size_t
+slab_size (size_t size);
+
+MICROTCP_SLAB_INTERNAL void *
+slab_alloc (size_t size);
+
+/* zeroed, like calloc() */
+MICROTCP_SLAB_INTERNAL void *
+slab_zalloc (size_t size);
+
+MICROTCP_SLAB_INTERNAL void
+slab_free (void *ptr, size_t size);
+
+/* moves the first keep bytes to a block of new_size, like realloc() */
+MICROTCP_SLAB_INTERNAL void *
+slab_realloc (void *ptr, size_t old_size, size_t new_size, size_t keep);
+
+#endif /* LIB_MICROTCP_SLAB_H_ */
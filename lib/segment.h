@@ -0,0 +1,251 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-segment work of the protocol engine: building and checking headers
+ * and the congestion window arithmetic. Internal to the library; it is a
+ * header so the microbenchmarks time exactly the code microtcp.c runs.
+ */
+
+#ifndef LIB_SEGMENT_H_
+#define LIB_SEGMENT_H_
+
+#include "microtcp.h"
+#include "../utils/crc32.h"
+#include "../utils/trace.h"
+
+/* option flags carried in future_use0. future_use1 and future_use2 hold
+ * their values, e.g. the fast open cookie */
+#define OPT_TFO_REQ    0x1      /* SYN: client does fast open, send a cookie */
+#define OPT_TFO_COOKIE 0x2      /* SYN: cookie in future_use1, SYN_ACK: new cookie */
+#define OPT_STREAM     0x4      /* stream id in future_use1. data: stream offset in
+                                 * future_use2, ACK: the stream's credit */
+#define OPT_MSG_END    0x8      /* message mode: the segment ends a message */
+#define OPT_SETUP      0x10     /* SYN, SYN_ACK: MSS in the low 16 bits of
+                                 * future_use2, window scale in the next 8,
+                                 * then 1 + log2 of MICROTCP_SO_MAX_STREAMS */
+#define OPT_STREAM_FIN 0x20     /* data: the segment ends its stream */
+#define OPT_PROBE      0x40     /* empty: a zero window probe, answer with an ACK */
+
+/**
+ * Fills in a header in network byte order, including the option words
+ * and the CRC-32 over the header (with the checksum field zeroed) and
+ * the payload.
+ */
+static inline void
+segment_encode_opt (microtcp_header_t *header, uint32_t seq, uint32_t ack,
+                    uint16_t control, uint16_t window, uint32_t opt0,
+                    uint32_t opt1, uint32_t opt2, const uint8_t *payload,
+                    size_t len)
+{
+  uint32_t crc;
+
+  memset(header, 0, sizeof(microtcp_header_t));
+  header->seq_number  = htonl(seq);
+  header->ack_number  = htonl(ack);
+  header->control     = htons(control);
+  header->window      = htons(window);
+  header->data_len    = htonl(len);
+  header->future_use0 = htonl(opt0);
+  header->future_use1 = htonl(opt1);
+  header->future_use2 = htonl(opt2);
+
+  crc = update_crc32(0xffffffff, (const uint8_t *)header, sizeof(microtcp_header_t));
+  crc = update_crc32(crc, payload, len) ^ 0xffffffff;
+  header->checksum = htonl(crc);
+}
+
+/**
+ * Fills in a header without options, see segment_encode_opt().
+ */
+static inline void
+segment_encode (microtcp_header_t *header, uint32_t seq, uint32_t ack,
+                uint16_t control, uint16_t window, const uint8_t *payload,
+                size_t len)
+{
+  segment_encode_opt(header, seq, ack, control, window, 0, 0, 0, payload, len);
+}
+
+/**
+ * Checks the checksum and the payload length of a received segment.
+ * The checksum field is left zeroed.
+ * @return 1 if the segment is intact, 0 otherwise
+ */
+static inline int
+segment_verify (microtcp_header_t *header, const uint8_t *payload, size_t len)
+{
+  uint32_t checksum = ntohl(header->checksum), crc;
+
+  if (ntohl(header->data_len) != len) {
+    return 0;
+  }
+  header->checksum = 0;
+  crc = update_crc32(0xffffffff, (const uint8_t *)header, sizeof(microtcp_header_t));
+  crc = update_crc32(crc, payload, len) ^ 0xffffffff;
+  return crc == checksum;
+}
+
+/* cwnd growth for an ACK that moved the window: slow start, then
+ * congestion avoidance */
+static inline void
+cwnd_on_ack (microtcp_sock_t *socket)
+{
+  if (socket->cwnd < socket->ssthresh) {
+    socket->cwnd += socket->mss;
+  } else {
+    socket->cwnd += (size_t)socket->mss * socket->mss / socket->cwnd + 1;
+  }
+}
+
+/* new ssthresh after a loss, never below two segments */
+static inline size_t
+halve_cwnd (microtcp_sock_t *socket)
+{
+  return socket->cwnd / 2 > 2 * socket->mss ? socket->cwnd / 2 : 2 * socket->mss;
+}
+
+/* moves the right edge of the window we advertise. it never moves back,
+ * and only moves forward by at least an MSS or half the buffer, so the
+ * sender is not invited to send tiny segments into a window the
+ * application is draining a few bytes at a time (silly window syndrome
+ * avoidance, RFC 1122 4.2.3.3). returns 1 if the edge moved */
+static inline int
+window_advance (microtcp_sock_t *socket)
+{
+  size_t room = 0, step;
+  uint32_t edge;
+
+  if (socket->rcvbuf_len > socket->buf_fill_level) {
+    room = socket->rcvbuf_len - socket->buf_fill_level;
+  }
+  step = socket->rcvbuf_len / 2 < socket->mss ? socket->rcvbuf_len / 2 : socket->mss;
+  edge = socket->ack_number + room;
+  if (reasm_seq_before(socket->rcv_edge, socket->ack_number)
+      || (reasm_seq_before(socket->rcv_edge, edge) && edge - socket->rcv_edge >= step)) {
+    socket->rcv_edge = edge;
+    return 1;
+  }
+  return 0;
+}
+
+/* the window we advertise, in units of our window scale */
+static inline uint16_t
+window_encode (microtcp_sock_t *socket)
+{
+  size_t win;
+
+  window_advance(socket);
+  win = reasm_seq_before(socket->ack_number, socket->rcv_edge)
+      ? (uint32_t)(socket->rcv_edge - socket->ack_number) >> socket->rcv_wscale : 0;
+  return win > 0xffff ? 0xffff : win;
+}
+
+/* the window the peer advertised in header, in bytes */
+static inline size_t
+window_decode (const microtcp_sock_t *socket, const microtcp_header_t *header)
+{
+  return (size_t)ntohs(header->window) << socket->snd_wscale;
+}
+
+/* ACK bookkeeping of one transmit() or transmit_streams() call. offsets
+ * count from base, the sequence number of the first byte */
+typedef struct
+{
+  uint32_t base;
+  size_t acked;                 /* everything before is ACKed */
+  size_t sent;                  /* end of what went out in this round */
+  size_t sent_max;              /* end of what ever went out */
+  size_t rtt_end;               /* an ACK up to here ends the RTT sample, 0 if none */
+  uint64_t rtt_stamp;
+  uint64_t moved_us;            /* last time the window moved */
+  size_t recover;               /* no fast retransmit before the ACKs pass here */
+  int dup_acks;
+} tx_state_t;
+
+/* what ack_process() made of an ACK */
+#define ACK_OTHER 0             /* a window update, an old or an ignored duplicate */
+#define ACK_MOVED 1             /* new data ACKed, tx->acked moved */
+#define ACK_DUPLICATE 2         /* counted towards fast retransmit */
+#define ACK_FAST_RETRANSMIT 3   /* the third duplicate, go back to tx->acked */
+
+/* the work of tx_collect_acks() for one verified ACK: the peer's window,
+ * slow start or congestion avoidance, and duplicate counting for fast
+ * retransmit. carried is set if the ACK came with a data segment, which
+ * is never a duplicate. the RTT sample and the timers are left to the
+ * caller */
+static inline int
+ack_process (microtcp_sock_t *socket, tx_state_t *tx, const microtcp_header_t *header,
+             int carried)
+{
+  size_t ack_off;
+  int win_changed;
+
+  if (!ntohs(header->window) && socket->curr_win_size) {
+    socket->zero_window_events++;
+  }
+  win_changed = window_decode(socket, header) != socket->curr_win_size;
+  if (win_changed) {
+    socket->curr_win_size = window_decode(socket, header);
+    socket->persist_us = 0;
+    TRACE_EVENT(socket, TRACE_WND, 0, ntohl(header->ack_number), 0);
+  }
+  ack_off = (uint32_t)(ntohl(header->ack_number) - tx->base);
+  /* the peer may ACK data of an earlier round it kept out of order */
+  if (ack_off > tx->acked && ack_off <= tx->sent_max) {
+    if (ack_off > tx->sent) {
+      tx->sent = ack_off;
+    }
+    /* 3. Slow Start - Congestion Avoidance */
+    cwnd_on_ack(socket);
+    TRACE_EVENT(socket, TRACE_ACK, 0, ntohl(header->ack_number), ack_off - tx->acked);
+    TRACE_EVENT(socket, TRACE_CWND, 0, ntohl(header->ack_number), socket->ssthresh);
+    socket->bytes_acked += ack_off - tx->acked;
+    tx->acked = ack_off;
+    socket->bytes_in_flight = tx->sent - tx->acked;
+    tx->dup_acks = 0;
+    return ACK_MOVED;
+  }
+  if (ack_off != tx->acked || win_changed || carried) {
+    return ACK_OTHER;
+  }
+
+  /* neither a window update nor the ACK of data is a duplicate (RFC 5681) */
+  socket->dup_acks++;
+  TRACE_EVENT(socket, TRACE_DUPACK, 0, ntohl(header->ack_number), 0);
+  /* the duplicates the retransmission itself causes do not count
+   * (the recovery point of NewReno, RFC 6582) */
+  if (tx->acked < tx->recover) {
+    return ACK_OTHER;
+  }
+  if (++tx->dup_acks < 3) {
+    return ACK_DUPLICATE;
+  }
+  /* fast retransmit activated */
+  tx->recover = tx->sent_max;
+  socket->ssthresh = halve_cwnd(socket);
+  socket->cwnd = socket->ssthresh + 3 * socket->mss;
+  socket->retrans_fast++;
+  TRACE_EVENT(socket, TRACE_CWND, 0, ntohl(header->ack_number), socket->ssthresh);
+  tx->rtt_end = 0;
+  tx->dup_acks = 0;
+  return ACK_FAST_RETRANSMIT;
+}
+
+#endif /* LIB_SEGMENT_H_ */
@@ -38,24 +38,105 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "../lib/microtcp.h"
+#include "cpu_counters.h"
 
 #define CHUNK_SIZE 4096
 #define PORT 8080
 
+/* -r: print one "result key=value ..." line for bench_sweep instead of prose */
+static int machine_readable = 0;
+/* -c: count cycles, instructions, syscalls etc. over the transfer */
+static int count_cpu = 0;
+/* -C: the microTCP client writes CHUNK_SIZE pieces instead of sendfile */
+static int chunked = 0;
+/* -R: the microTCP server reads this many bytes per microtcp_recv() */
+static size_t read_size = 0;
+static cpu_counters_t counters;
+
+/* TCP segments in or out on the whole host from /proc/net/snmp, there is
+ * no per-socket count in the tcp_info of our libc. fine on an idle box */
+static uint64_t
+tcp_segments (int out)
+{
+  char line[1024], *tok, *save;
+  unsigned long long in_segs = 0, out_segs = 0;
+  int header = 1, col;
+  FILE *fp = fopen ("/proc/net/snmp", "r");
+
+  if (!fp) {
+    return 0;
+  }
+  while (fgets (line, sizeof(line), fp)) {
+    if (strncmp (line, "Tcp:", 4)) {
+      continue;
+    }
+    /* the first Tcp: line names the columns, the second holds them */
+    if (header) {
+      header = 0;
+      continue;
+    }
+    for (col = 0, tok = strtok_r (line + 4, " \n", &save); tok;
+         tok = strtok_r (NULL, " \n", &save), col++) {
+      if (col == 9) {
+        in_segs = strtoull (tok, NULL, 10);
+      } else if (col == 10) {
+        out_segs = strtoull (tok, NULL, 10);
+      }
+    }
+    break;
+  }
+  fclose (fp);
+  return out ? out_segs : in_segs;
+}
+
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
   double elapsed = end.tv_sec - start.tv_sec
       + (end.tv_nsec - start.tv_nsec) * 1e-9;
   double megabytes = received / (1024.0 * 1024.0);
+  if (machine_readable) {
+    printf ("result bytes=%zd seconds=%.6f\n", received, elapsed);
+    return;
+  }
   printf ("Data received: %f MB\n", megabytes);
   printf ("Transfer time: %f seconds\n", elapsed);
   printf ("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
+/* what the library allocated since before, the system allocations
+ * should stay at 0 once a connection has its buffers */
+static void
+print_alloc_stats (const microtcp_alloc_stats_t *before, uint64_t packets,
+                   size_t conn_bytes)
+{
+  microtcp_alloc_stats_t after;
+  uint64_t sys, allocs, hits;
+
+  microtcp_get_alloc_stats (&after);
+  sys = after.system_allocs - before->system_allocs;
+  allocs = after.allocs - before->allocs;
+  hits = after.cache_hits - before->cache_hits;
+  if (machine_readable) {
+    printf ("result sys_allocs=%llu allocs=%llu cache_hits=%llu conn_mem=%zu arena_bytes=%llu\n",
+            (unsigned long long) sys, (unsigned long long) allocs,
+            (unsigned long long) hits, conn_bytes,
+            (unsigned long long) after.arena_bytes);
+    return;
+  }
+  printf ("Allocator: %llu system allocations over %llu packets, %llu allocations "
+          "(%llu from the thread cache)\n", (unsigned long long) sys,
+          (unsigned long long) packets, (unsigned long long) allocs,
+          (unsigned long long) hits);
+  printf ("Connection memory: %zu bytes, arenas: %llu bytes (%llu on huge pages)\n",
+          conn_bytes, (unsigned long long) after.arena_bytes,
+          (unsigned long long) after.huge_arenas);
+}
+
 int
 server_tcp (uint16_t listen_port, const char *file)
 {
@@ -67,6 +148,7 @@ server_tcp (uint16_t listen_port, const char *file)
   ssize_t written;
   ssize_t total_bytes = 0;
   socklen_t client_addr_len;
+  uint64_t segments = 0;
 
   struct sockaddr_in sin;
   struct sockaddr client_addr;
@@ -135,6 +217,10 @@ server_tcp (uint16_t listen_port, const char *file)
    * right and careful way :-)
    */
 
+  if (count_cpu) {
+    segments = tcp_segments (0);
+    cpu_counters_start (&counters);
+  }
   clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
   while ((received = recv (accepted, buffer, CHUNK_SIZE, 0)) > 0) {
     written = fwrite (buffer, sizeof(uint8_t), received, fp);
@@ -153,6 +239,11 @@ server_tcp (uint16_t listen_port, const char *file)
   }
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (total_bytes, start_time, end_time);
+  if (count_cpu) {
+    cpu_counters_stop (&counters);
+    cpu_counters_report (&counters, total_bytes, tcp_segments (0) - segments,
+                         machine_readable);
+  }
 
   shutdown (accepted, SHUT_RDWR);
   shutdown (sock, SHUT_RDWR);
@@ -164,38 +255,49 @@ server_tcp (uint16_t listen_port, const char *file)
   return 0;
 }
 
+/* the payload in read_size reads, the way a slow consumer takes it */
+static ssize_t
+recv_chunks (microtcp_sock_t *sock, FILE *fp)
+{
+  uint8_t *buffer = malloc (read_size);
+  ssize_t total = 0, received;
+
+  if (!buffer) {
+    perror ("Allocate the read buffer");
+    return -1;
+  }
+  while ((received = microtcp_recv (sock, buffer, read_size, 0)) > 0) {
+    if (fwrite (buffer, sizeof(uint8_t), received, fp) != (size_t) received) {
+      perror ("Error writing received data");
+      received = -1;
+      break;
+    }
+    total += received;
+  }
+  free (buffer);
+  return received < 0 ? -1 : total;
+}
+
 int
 server_microtcp (uint16_t listen_port, const char *file)
 {
 
-  uint8_t *buffer;
   FILE *fp;
-  int sock;
   int accepted;
-  int received;
-  ssize_t written;
   ssize_t total_bytes = 0;
-  socklen_t client_addr_len;
   microtcp_sock_t server_sock;
-  struct sockaddr_in sin;
+  microtcp_info_t info;
+  microtcp_alloc_stats_t alloc_start;
 
   struct sockaddr_in server_address;
   struct sockaddr_in client_addr;
   struct timespec start_time;
   struct timespec end_time;
 
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
-  if (!buffer) {
-    perror ("Allocate application receive buffer");
-    return -EXIT_FAILURE;
-  }
-
   /* Open the file for writing the data from the network */
-  fp = fopen (file, "w");
+  fp = fopen (file, "w+");
   if (!fp) {
     perror ("Open file for writing");
-    free (buffer);
     return -EXIT_FAILURE;
   }
 
@@ -207,7 +309,7 @@ server_microtcp (uint16_t listen_port, const char *file)
   /* define the server address */
   memset(&server_address, 0, sizeof(struct sockaddr_in));
   server_address.sin_family = AF_INET;
-  server_address.sin_port = htons(PORT);
+  server_address.sin_port = htons(listen_port);
   server_address.sin_addr.s_addr = INADDR_ANY;  /* listen to any address */
 
   /* copy server address info into socket */
@@ -220,7 +322,7 @@ server_microtcp (uint16_t listen_port, const char *file)
 
   if (microtcp_bind(&server_sock, (struct sockaddr *)&server_address, sizeof(struct sockaddr_in))) {
   	perror("Error in binding");
-  	free (buffer);  /* always free :) */
+  	fclose (fp);
   	exit (EXIT_FAILURE);
   } else {
   	printf("Server binded successfully!\n");
@@ -229,49 +331,53 @@ server_microtcp (uint16_t listen_port, const char *file)
  
 
   /* Accept a connection from the client */
-  /* Maybe i keep this one or the one below this */
- 
- /* 1 */
-  client_addr_len = sizeof(struct sockaddr);
-  accepted = microtcp_accept(&server_sock, &client_addr, &client_addr_len);
+  accepted = microtcp_accept(&server_sock, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_in));
   if (accepted < 0) {
     perror ("TCP accept");
-    free (buffer);
     fclose (fp);
     return -EXIT_FAILURE;
   }
 
 
-/* 2 */
-#if 0
-  if (microtcp_accept(&server_sock, (struct sockaddr *)&server_address, sizeof(struct sockaddr_in))) {
-  	perror("Error in accept");
-  	free (buffer);  /* always free :) */
-  	exit (EXIT_FAILURE);
-  } else {
-  	printf("Server accepted successfully!\n");
-  }
-#endif
-
-
-  /* copy address info */
-  server_sock.address = sin;
-  server_sock.address_len = sizeof(struct sockaddr_in);
-
 /* start the timer */
+ if (count_cpu) {
+   cpu_counters_start (&counters);
+ }
+ microtcp_get_alloc_stats (&alloc_start);
  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
- memset(buffer, '\0', 3 * CHUNK_SIZE);
- while ((received = microtcp_recv (&server_sock, buffer, CHUNK_SIZE, 0)) > 0) {
-    fwrite(buffer, sizeof(uint8_t), received, fp);  /* write contents to file */
-    memset(buffer, '\0', 3 * CHUNK_SIZE);  /* reset buffer */
+ if (read_size) {
+   total_bytes = recv_chunks (&server_sock, fp);
+ } else {
+   /* the payload is received straight into the file until the client closes */
+   total_bytes = microtcp_recvfile (&server_sock, fileno (fp), 0);
  }
 
  /* stop the timer */
  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
- print_statistics (server_sock.bytes_received, start_time, end_time);
+ if (total_bytes < 0) {
+   printf ("Failed to receive the file.\n");
+   fclose (fp);
+   return -EXIT_FAILURE;
+ }
+ print_statistics (total_bytes, start_time, end_time);
+ if (count_cpu) {
+   cpu_counters_stop (&counters);
+   cpu_counters_report (&counters, total_bytes, server_sock.packets_received,
+                        machine_readable);
+ }
+ microtcp_get_info (&server_sock, &info);
+ if (machine_readable) {
+   printf ("result rcvbuf=%zu rcv_rtt_us=%llu window_updates=%llu\n", info.rcvbuf,
+           (unsigned long long) info.rcv_rtt_us, (unsigned long long) info.window_updates);
+ } else {
+   printf ("Receive buffer: %zu bytes, receiver RTT %llu us, %llu window updates\n",
+           info.rcvbuf, (unsigned long long) info.rcv_rtt_us,
+           (unsigned long long) info.window_updates);
+ }
+ print_alloc_stats (&alloc_start, server_sock.packets_received, info.mem_bytes);
 
 
- free(fp);
+ fclose(fp);
   return 0;
 }
 
@@ -284,6 +390,7 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   FILE *fp;
   size_t read_items = 0;
   ssize_t data_sent;
+  uint64_t total_sent = 0, segments = 0;
 
   struct sockaddr *client_addr;
 
@@ -324,9 +431,17 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   }
 
   printf ("Starting sending data...\n");
+  if (count_cpu) {
+    segments = tcp_segments (1);
+    cpu_counters_start (&counters);
+  }
   /* Start sending the data */
   while (!feof (fp)) {
     read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
+    /* a file of a multiple of CHUNK_SIZE hits EOF on an empty read */
+    if (read_items < 1 && feof (fp)) {
+      break;
+    }
     if (read_items < 1) {
       perror ("Failed read from file");
       shutdown (sock, SHUT_RDWR);
@@ -346,9 +461,22 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
       fclose (fp);
       return -EXIT_FAILURE;
     }
-
+    total_sent += data_sent;
+  }
+  if (count_cpu) {
+    cpu_counters_stop (&counters);
+    cpu_counters_report (&counters, total_sent, tcp_segments (1) - segments,
+                         machine_readable);
   }
 
+  if (machine_readable) {
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt (sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+      printf ("result retrans=%u srtt_us=%u\n", info.tcpi_total_retrans,
+              info.tcpi_rtt);
+    }
+  }
   printf ("Data sent. Terminating...\n");
   shutdown (sock, SHUT_RDWR);
   close (sock);
@@ -357,32 +485,40 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   return 0;
 }
 
+/* the file in CHUNK_SIZE writes, the way an application streams data */
+static ssize_t
+send_chunks (microtcp_sock_t *sock, FILE *fp)
+{
+  uint8_t buffer[CHUNK_SIZE];
+  ssize_t total = 0;
+  size_t read_items;
+
+  while ((read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp)) > 0) {
+    if (microtcp_send (sock, buffer, read_items, 0) != (ssize_t) read_items) {
+      return -1;
+    }
+    total += read_items;
+  }
+  return microtcp_flush (sock) < 0 ? -1 : total;
+}
+
 int
 client_microtcp (const char *serverip, uint16_t server_port, const char *file)
 {
   
-  uint8_t *buffer;
-  socklen_t client_addr_len;
   FILE *fp;
-  size_t read_items = 0;
   ssize_t data_sent;
   microtcp_sock_t client_sock;
+  microtcp_info_t info;
+  microtcp_alloc_stats_t alloc_start;
   struct sockaddr_in server_address;
 
 
 
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
-  if (!buffer) {
-    perror ("Allocate application receive buffer");
-    return -EXIT_FAILURE;
-  }
-
-  /* Open the file for writing the data from the network */
+  /* Open the file for reading the data to send */
   fp = fopen (file, "r");
   if (!fp) {
     perror ("Open file for reading");
-    free(buffer);
     return -EXIT_FAILURE;
   }
 
@@ -398,33 +534,58 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
 
   if (microtcp_connect(&client_sock, (struct sockaddr *)&server_address, sizeof(struct sockaddr_in))) {
     perror("Error in microtcp_connect");
-    free (buffer);
+    fclose (fp);
     exit (EXIT_FAILURE);
   }
 
 
 
   printf ("Starting sending data...\n");
-  while (!feof (fp)) {
-    read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1) {
-      perror ("Failed read from file");
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
-    }
-
-    data_sent = microtcp_send (&client_sock, buffer, read_items * sizeof(uint8_t), 0);
-    if ((long unsigned int)data_sent != read_items * sizeof(uint8_t)) {
-      printf ("Failed to send the"
-              " amount of data read from the file.\n");
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
-    }
-
+  microtcp_get_alloc_stats (&alloc_start);
+  if (count_cpu) {
+    cpu_counters_start (&counters);
+  }
+  if (chunked) {
+    data_sent = send_chunks (&client_sock, fp);
+  } else {
+    /* the whole file goes out of its mapping, no chunking needed */
+    data_sent = microtcp_sendfile (&client_sock, fileno (fp), 0, 0);
+  }
+  if (data_sent < 0) {
+    printf ("Failed to send the file.\n");
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (count_cpu) {
+    cpu_counters_stop (&counters);
+    cpu_counters_report (&counters, data_sent, client_sock.packets_send,
+                         machine_readable);
   }
 
+  microtcp_get_info (&client_sock, &info);
+  printf ("Data sent. Terminating...\n");
+  if (machine_readable) {
+    printf ("result retrans=%llu retrans_timeout=%llu retrans_fast=%llu srtt_us=%llu"
+            " zero_window=%llu window_probes=%llu\n",
+            (unsigned long long) (info.retrans_timeout + info.retrans_fast),
+            (unsigned long long) info.retrans_timeout,
+            (unsigned long long) info.retrans_fast,
+            (unsigned long long) info.srtt_us,
+            (unsigned long long) info.zero_window_events,
+            (unsigned long long) info.window_probes);
+  }
+  printf ("RTT srtt/min/p99: %llu/%llu/%llu us, retransmissions: %llu timeout, %llu fast\n",
+          (unsigned long long) info.srtt_us, (unsigned long long) info.min_rtt_us,
+          (unsigned long long) info.rtt_p99_us, (unsigned long long) info.retrans_timeout,
+          (unsigned long long) info.retrans_fast);
+  printf ("Send buffer: %zu bytes, cwnd %zu, ssthresh %zu\n", info.sndbuf, info.cwnd,
+          info.ssthresh);
+  printf ("Zero windows: %llu, probes sent: %llu\n",
+          (unsigned long long) info.zero_window_events,
+          (unsigned long long) info.window_probes);
+  print_alloc_stats (&alloc_start, client_sock.packets_send, info.mem_bytes);
+  microtcp_shutdown (&client_sock, SHUT_RDWR);
+  fclose (fp);
   return 0;
 }
 
@@ -432,7 +593,7 @@ int
 main (int argc, char **argv)
 {
   int opt;
-  int port;
+  int port = PORT;
   int exit_code = 0;
   char *filestr = NULL;
   char *ipstr = NULL;
@@ -440,7 +601,7 @@ main (int argc, char **argv)
   uint8_t use_microtcp = 0;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmrcCf:p:a:R:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -463,10 +624,22 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 'r':
+        machine_readable = 1;
+        break;
+      case 'c':
+        count_cpu = 1;
+        break;
+      case 'C':
+        chunked = 1;
+        break;
+      case 'R':
+        read_size = strtoul (optarg, NULL, 10);
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m] [-r] [-c] [-C] [-R bytes] -p port -f file\n"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
@@ -474,6 +647,13 @@ main (int argc, char **argv)
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -r                  Print the results as a \"result key=value ...\" line, for bench_sweep.\n"
+            "   -c                  Report the CPU cost: cycles/byte, instructions/packet, syscalls/MB\n"
+            "                       and CPU seconds per Gbit from perf_event_open and getrusage.\n"
+            "   -C                  microTCP client: send the file in 4 KB microtcp_send() calls\n"
+            "                       instead of microtcp_sendfile().\n"
+            "   -R <int>            microTCP server: read with microtcp_recv() calls of this many\n"
+            "                       bytes instead of microtcp_recvfile(), like a slow consumer.\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -483,6 +663,11 @@ main (int argc, char **argv)
    * TODO: Some error checking here???
    */
 
+  /* before the library starts any thread, so they are counted too */
+  if (count_cpu) {
+    cpu_counters_init (&counters);
+  }
+
   /*
    * Depending the use arguments execute the appropriate functions
    */
@@ -0,0 +1,735 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark driver: runs bandwidth_test (server and client) over the
+ * cartesian product of protocol x file size x impairment profile x
+ * environment settings, a few times per point, and writes one CSV row or
+ * JSON object per run. CPU time of both ends comes from wait4().
+ *
+ * Impairment profiles go through impair_proxy, which only relays UDP, so
+ * kernel TCP runs only on the "clean" profile. Library tunables such as
+ * the MSS or the window are swept with -e, through their environment
+ * variables.
+ *
+ *   bench_sweep -s 1M,16M -t microtcp,tcp -I lossy="-L 1 -d 5" -n 5 -o out.csv
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_SIZES 16
+#define MAX_PROFILES 16
+#define MAX_ENV_KEYS 8
+#define MAX_ENV_VALUES 16
+#define MAX_ARGS 64
+#define MAX_REPS 1024
+#define OUTPUT_CAP 4096
+
+typedef struct
+{
+  const char *name;
+  char *args;                   /* impair_proxy options, NULL for no proxy */
+} profile_t;
+
+typedef struct
+{
+  char *key;
+  char *values[MAX_ENV_VALUES];
+  int n;
+} env_sweep_t;
+
+typedef struct
+{
+  pid_t pid;
+  int out;                      /* read end of its stdout */
+  char buf[OUTPUT_CAP];
+  size_t len;
+  int done;
+  int status;
+  struct rusage usage;
+} child_t;
+
+typedef struct
+{
+  int ok;
+  int timed_out;
+  uint64_t bytes;
+  double completion_s;          /* client start until both ends exited */
+  double transfer_s;            /* as measured by the server */
+  uint64_t retrans;
+  uint64_t retrans_timeout;
+  uint64_t retrans_fast;
+  uint64_t srtt_us;
+  double server_cpu_s;
+  double client_cpu_s;
+} result_t;
+
+static const char *bindir = ".";
+static const char *workdir = "/tmp";
+static uint16_t next_port = 20000;
+static double run_timeout = 120.0;
+static int verbose = 0;
+
+static double
+now_s (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+parse_size (const char *s)
+{
+  char *end;
+  uint64_t v = strtoull (s, &end, 10);
+  switch (*end)
+    {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    default: return v;
+    }
+}
+
+/* splits a comma separated list in place */
+static int
+split_list (char *s, char **out, int max)
+{
+  int n = 0;
+  char *tok, *save;
+  for (tok = strtok_r (s, ",", &save); tok && n < max; tok = strtok_r (NULL, ",", &save)) {
+    out[n++] = tok;
+  }
+  return n;
+}
+
+static double
+tv_seconds (struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* the file the client sends, created once per size */
+static int
+make_input (const char *path, uint64_t size)
+{
+  struct stat st;
+  uint8_t chunk[65536];
+  uint64_t left = size, x = 0x9e3779b97f4a7c15ULL;
+  size_t i, n;
+  FILE *fp;
+
+  if (stat (path, &st) == 0 && (uint64_t) st.st_size == size) {
+    return 0;
+  }
+  fp = fopen (path, "w");
+  if (!fp) {
+    perror ("Create input file");
+    return -1;
+  }
+  while (left) {
+    n = left < sizeof(chunk) ? left : sizeof(chunk);
+    for (i = 0; i < n; i++) {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      chunk[i] = x;
+    }
+    if (fwrite (chunk, 1, n, fp) != n) {
+      perror ("Write input file");
+      fclose (fp);
+      return -1;
+    }
+    left -= n;
+  }
+  fclose (fp);
+  return 0;
+}
+
+static int
+spawn (child_t *c, char **argv, env_sweep_t *env, int *pick, int nenv)
+{
+  int fds[2], i, devnull;
+
+  memset (c, 0, sizeof(*c));
+  if (pipe (fds) < 0) {
+    perror ("pipe");
+    return -1;
+  }
+  c->pid = fork ();
+  if (c->pid < 0) {
+    perror ("fork");
+    close (fds[0]);
+    close (fds[1]);
+    return -1;
+  }
+  if (c->pid == 0) {
+    for (i = 0; i < nenv; i++) {
+      setenv (env[i].key, env[i].values[pick[i]], 1);
+    }
+    dup2 (fds[1], STDOUT_FILENO);
+    if (!verbose) {
+      devnull = open ("/dev/null", O_WRONLY);
+      dup2 (devnull, STDERR_FILENO);
+    }
+    close (fds[0]);
+    close (fds[1]);
+    execv (argv[0], argv);
+    perror (argv[0]);
+    _exit (127);
+  }
+  close (fds[1]);
+  c->out = fds[0];
+  fcntl (c->out, F_SETFL, O_NONBLOCK);
+  return 0;
+}
+
+static void
+drain (child_t *c)
+{
+  ssize_t n;
+  char sink[1024];
+  while (1) {
+    if (c->len < OUTPUT_CAP - 1) {
+      n = read (c->out, c->buf + c->len, OUTPUT_CAP - 1 - c->len);
+      if (n > 0) {
+        c->len += n;
+      }
+    } else {
+      n = read (c->out, sink, sizeof(sink));
+    }
+    if (n <= 0) {
+      break;
+    }
+  }
+  c->buf[c->len] = 0;
+}
+
+static void
+reap (child_t *c, int block)
+{
+  pid_t r;
+  if (c->done || c->pid <= 0) {
+    return;
+  }
+  r = wait4 (c->pid, &c->status, block ? 0 : WNOHANG, &c->usage);
+  if (r == c->pid) {
+    c->done = 1;
+    drain (c);
+    close (c->out);
+  }
+}
+
+static void
+stop (child_t *c, int sig)
+{
+  if (!c->done && c->pid > 0) {
+    kill (c->pid, sig);
+    reap (c, 1);
+  }
+}
+
+/*
+ * the server is up once its port shows in /proc/net; probing with bind()
+ * would race against the server's own bind
+ */
+static int
+wait_bound (uint16_t port, int type, double deadline)
+{
+  char line[256], local[32];
+  unsigned int lport;
+  FILE *fp;
+  int found;
+
+  while (now_s () < deadline) {
+    found = 0;
+    fp = fopen (type == SOCK_DGRAM ? "/proc/net/udp" : "/proc/net/tcp", "r");
+    if (!fp) {
+      usleep (200000);
+      return 0;
+    }
+    while (!found && fgets (line, sizeof(line), fp)) {
+      if (sscanf (line, "%*d: %31s", local) == 1
+          && sscanf (strchr (local, ':') ? strchr (local, ':') + 1 : "", "%x", &lport) == 1
+          && lport == port) {
+        found = 1;
+      }
+    }
+    fclose (fp);
+    if (found) {
+      return 0;
+    }
+    usleep (2000);
+  }
+  return -1;
+}
+
+/* picks "key=value" fields out of the "result ..." lines */
+static uint64_t
+field_u64 (const char *out, const char *key)
+{
+  char pattern[64];
+  const char *p = out;
+  snprintf (pattern, sizeof(pattern), " %s=", key);
+  while ((p = strstr (p, "result ")) != NULL) {
+    const char *eol = strchr (p, '\n');
+    const char *f = strstr (p, pattern);
+    if (f && (!eol || f < eol)) {
+      return strtoull (f + strlen (pattern), NULL, 10);
+    }
+    p++;
+  }
+  return 0;
+}
+
+static double
+field_double (const char *out, const char *key)
+{
+  char pattern[64];
+  const char *p = out;
+  snprintf (pattern, sizeof(pattern), " %s=", key);
+  while ((p = strstr (p, "result ")) != NULL) {
+    const char *eol = strchr (p, '\n');
+    const char *f = strstr (p, pattern);
+    if (f && (!eol || f < eol)) {
+      return strtod (f + strlen (pattern), NULL);
+    }
+    p++;
+  }
+  return 0;
+}
+
+static int
+run_one (int microtcp, uint64_t size, const profile_t *prof, int rep,
+         env_sweep_t *env, int *pick, int nenv, result_t *res)
+{
+  char bw[512], proxy[512], in[512], out[512];
+  char port_s[8], proxy_s[8], seed_s[16];
+  char *argv[MAX_ARGS], *args_copy = NULL, *tok, *save;
+  child_t server, client, relay;
+  uint16_t port = next_port, target;
+  int argc, type = microtcp ? SOCK_DGRAM : SOCK_STREAM;
+  double start, deadline;
+  struct stat st;
+
+  next_port += 2;
+  if (next_port > 60000) {
+    next_port = 20000;
+  }
+  memset (res, 0, sizeof(*res));
+  memset (&relay, 0, sizeof(relay));
+  snprintf (bw, sizeof(bw), "%s/bandwidth_test", bindir);
+  snprintf (proxy, sizeof(proxy), "%s/impair_proxy", bindir);
+  snprintf (in, sizeof(in), "%s/bench_sweep-%llu.in", workdir, (unsigned long long) size);
+  snprintf (out, sizeof(out), "%s/bench_sweep-%d.out", workdir, (int) getpid ());
+  snprintf (port_s, sizeof(port_s), "%u", port);
+  snprintf (proxy_s, sizeof(proxy_s), "%u", port + 1);
+  snprintf (seed_s, sizeof(seed_s), "%d", rep + 1);
+  if (make_input (in, size) < 0) {
+    return -1;
+  }
+  unlink (out);
+
+  argc = 0;
+  argv[argc++] = bw;
+  argv[argc++] = "-s";
+  if (microtcp) {
+    argv[argc++] = "-m";
+  }
+  argv[argc++] = "-r";
+  argv[argc++] = "-p";
+  argv[argc++] = port_s;
+  argv[argc++] = "-f";
+  argv[argc++] = out;
+  argv[argc] = NULL;
+  if (spawn (&server, argv, env, pick, nenv) < 0) {
+    return -1;
+  }
+  deadline = now_s () + run_timeout;
+  if (wait_bound (port, type, now_s () + 5.0) < 0) {
+    fprintf (stderr, "bench_sweep: server did not come up on port %u\n", port);
+    stop (&server, SIGKILL);
+    return -1;
+  }
+
+  target = port;
+  if (prof->args) {
+    /* the proxy seed follows the repetition, so every run of a point differs */
+    args_copy = strdup (prof->args);
+    argc = 0;
+    argv[argc++] = proxy;
+    argv[argc++] = "-l";
+    argv[argc++] = proxy_s;
+    argv[argc++] = "-a";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = port_s;
+    argv[argc++] = "-s";
+    argv[argc++] = seed_s;
+    for (tok = strtok_r (args_copy, " ", &save); tok && argc < MAX_ARGS - 1;
+         tok = strtok_r (NULL, " ", &save)) {
+      argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+    if (spawn (&relay, argv, env, pick, nenv) < 0
+        || wait_bound (port + 1, SOCK_DGRAM, now_s () + 5.0) < 0) {
+      fprintf (stderr, "bench_sweep: impair_proxy did not come up\n");
+      stop (&relay, SIGKILL);
+      stop (&server, SIGKILL);
+      free (args_copy);
+      return -1;
+    }
+    target = port + 1;
+  }
+
+  argc = 0;
+  argv[argc++] = bw;
+  if (microtcp) {
+    argv[argc++] = "-m";
+  }
+  argv[argc++] = "-r";
+  argv[argc++] = "-a";
+  argv[argc++] = "127.0.0.1";
+  argv[argc++] = "-p";
+  argv[argc++] = target == port ? port_s : proxy_s;
+  argv[argc++] = "-f";
+  argv[argc++] = in;
+  argv[argc] = NULL;
+  start = now_s ();
+  if (spawn (&client, argv, env, pick, nenv) < 0) {
+    stop (&relay, SIGKILL);
+    stop (&server, SIGKILL);
+    free (args_copy);
+    return -1;
+  }
+
+  while (!(client.done && server.done)) {
+    reap (&client, 0);
+    reap (&server, 0);
+    if (!client.done) {
+      drain (&client);
+    }
+    if (!server.done) {
+      drain (&server);
+    }
+    if (now_s () > deadline) {
+      res->timed_out = 1;
+      stop (&client, SIGKILL);
+      stop (&server, SIGKILL);
+      break;
+    }
+    usleep (1000);
+  }
+  res->completion_s = now_s () - start;
+  stop (&relay, SIGINT);
+  free (args_copy);
+
+  res->bytes = field_u64 (server.buf, "bytes");
+  res->transfer_s = field_double (server.buf, "seconds");
+  res->retrans = field_u64 (client.buf, "retrans");
+  res->retrans_timeout = field_u64 (client.buf, "retrans_timeout");
+  res->retrans_fast = field_u64 (client.buf, "retrans_fast");
+  res->srtt_us = field_u64 (client.buf, "srtt_us");
+  res->server_cpu_s = tv_seconds (server.usage.ru_utime) + tv_seconds (server.usage.ru_stime);
+  res->client_cpu_s = tv_seconds (client.usage.ru_utime) + tv_seconds (client.usage.ru_stime);
+  res->ok = !res->timed_out
+      && WIFEXITED (server.status) && WEXITSTATUS (server.status) == 0
+      && WIFEXITED (client.status) && WEXITSTATUS (client.status) == 0
+      && stat (out, &st) == 0 && (uint64_t) st.st_size == size
+      && res->bytes == size;
+  unlink (out);
+  return 0;
+}
+
+static void
+json_string (FILE *fp, const char *s)
+{
+  fputc ('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc ('\\', fp);
+    }
+    fputc (*s, fp);
+  }
+  fputc ('"', fp);
+}
+
+static void
+write_header (FILE *fp, int json)
+{
+  if (json) {
+    fprintf (fp, "[\n");
+    return;
+  }
+  fprintf (fp, "protocol,size,profile,env,rep,ok,bytes,completion_s,transfer_s,"
+           "throughput_MBps,retrans,retrans_timeout,retrans_fast,srtt_us,"
+           "server_cpu_s,client_cpu_s\n");
+}
+
+static void
+write_result (FILE *fp, int json, int first, const char *proto, uint64_t size,
+              const profile_t *prof, env_sweep_t *env, int *pick, int nenv,
+              int rep, const result_t *r)
+{
+  double mbps = r->transfer_s > 0 ? r->bytes / (1024.0 * 1024.0) / r->transfer_s : 0;
+  int i;
+
+  if (json) {
+    fprintf (fp, "%s  {\"protocol\": \"%s\", \"size\": %llu, \"profile\": ",
+             first ? "" : ",\n", proto, (unsigned long long) size);
+    json_string (fp, prof->name);
+    fprintf (fp, ", \"env\": {");
+    for (i = 0; i < nenv; i++) {
+      fprintf (fp, "%s", i ? ", " : "");
+      json_string (fp, env[i].key);
+      fprintf (fp, ": ");
+      json_string (fp, env[i].values[pick[i]]);
+    }
+    fprintf (fp, "}, \"rep\": %d, \"ok\": %s, \"timed_out\": %s, \"bytes\": %llu, "
+             "\"completion_s\": %.6f, \"transfer_s\": %.6f, \"throughput_MBps\": %.3f, "
+             "\"retrans\": %llu, \"retrans_timeout\": %llu, \"retrans_fast\": %llu, "
+             "\"srtt_us\": %llu, \"server_cpu_s\": %.6f, \"client_cpu_s\": %.6f}",
+             rep, r->ok ? "true" : "false", r->timed_out ? "true" : "false",
+             (unsigned long long) r->bytes, r->completion_s, r->transfer_s, mbps,
+             (unsigned long long) r->retrans, (unsigned long long) r->retrans_timeout,
+             (unsigned long long) r->retrans_fast, (unsigned long long) r->srtt_us,
+             r->server_cpu_s, r->client_cpu_s);
+  } else {
+    fprintf (fp, "%s,%llu,%s,", proto, (unsigned long long) size, prof->name);
+    for (i = 0; i < nenv; i++) {
+      fprintf (fp, "%s%s=%s", i ? ";" : "", env[i].key, env[i].values[pick[i]]);
+    }
+    fprintf (fp, ",%d,%d,%llu,%.6f,%.6f,%.3f,%llu,%llu,%llu,%llu,%.6f,%.6f\n",
+             rep, r->ok, (unsigned long long) r->bytes, r->completion_s,
+             r->transfer_s, mbps, (unsigned long long) r->retrans,
+             (unsigned long long) r->retrans_timeout,
+             (unsigned long long) r->retrans_fast, (unsigned long long) r->srtt_us,
+             r->server_cpu_s, r->client_cpu_s);
+  }
+  fflush (fp);
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, i, rep, reps = 3, json = 0, first = 1, failures = 0;
+  int nsizes = 0, nprotos = 0, nprofiles = 0, nenv = 0, p, s, f, ok;
+  int pick[MAX_ENV_KEYS], more;
+  char *sizes_str = NULL, *protos_str = NULL, *size_tok[MAX_SIZES], *proto_tok[4];
+  char *eq;
+  uint64_t sizes[MAX_SIZES];
+  profile_t profiles[MAX_PROFILES];
+  env_sweep_t env[MAX_ENV_KEYS];
+  double tput[MAX_REPS];
+  result_t res;
+  FILE *fp = stdout;
+  const char *outfile = NULL;
+
+  signal (SIGPIPE, SIG_IGN);
+  while ((opt = getopt (argc, argv, "hvB:w:s:t:I:e:n:o:jp:T:")) != -1) {
+    switch (opt)
+      {
+      case 'B':
+        bindir = optarg;
+        break;
+      case 'w':
+        workdir = optarg;
+        break;
+      case 's':
+        sizes_str = optarg;
+        break;
+      case 't':
+        protos_str = optarg;
+        break;
+      case 'I':
+        if (nprofiles == MAX_PROFILES) {
+          break;
+        }
+        eq = strchr (optarg, '=');
+        if (eq) {
+          *eq = 0;
+          profiles[nprofiles].args = eq + 1;
+        } else {
+          profiles[nprofiles].args = NULL;
+        }
+        profiles[nprofiles++].name = optarg;
+        break;
+      case 'e':
+        eq = strchr (optarg, '=');
+        if (!eq || nenv == MAX_ENV_KEYS) {
+          fprintf (stderr, "bench_sweep: -e expects KEY=v1,v2,...\n");
+          exit (EXIT_FAILURE);
+        }
+        *eq = 0;
+        env[nenv].key = optarg;
+        env[nenv].n = split_list (eq + 1, env[nenv].values, MAX_ENV_VALUES);
+        if (env[nenv].n) {
+          nenv++;
+        }
+        break;
+      case 'n':
+        reps = atoi (optarg);
+        break;
+      case 'o':
+        outfile = optarg;
+        break;
+      case 'j':
+        json = 1;
+        break;
+      case 'p':
+        next_port = atoi (optarg);
+        break;
+      case 'T':
+        run_timeout = atof (optarg);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        printf (
+            "Usage: bench_sweep [options]\n"
+            "Options:\n"
+            "   -B <dir>            Where bandwidth_test and impair_proxy live (default .)\n"
+            "   -w <dir>            Scratch directory for the transferred files (default /tmp)\n"
+            "   -s <list>           File sizes, with K/M/G suffixes (default 1M,16M)\n"
+            "   -t <list>           Protocols, microtcp and/or tcp (default microtcp,tcp)\n"
+            "   -I name[=args]      Impairment profile; args are passed to impair_proxy.\n"
+            "                       Repeatable. Without args no proxy is used (default clean)\n"
+            "   -e KEY=v1,v2,...    Sweep an environment variable, e.g. MICROTCP_MSS. Repeatable\n"
+            "   -n <int>            Repetitions per point (default 3)\n"
+            "   -o <file>           Write the results there instead of stdout\n"
+            "   -j                  JSON output instead of CSV\n"
+            "   -p <int>            First port to use (default 20000)\n"
+            "   -T <sec>            Kill a run that takes longer (default 120)\n"
+            "   -v                  Keep the stderr of the children\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (reps < 1 || reps > MAX_REPS) {
+    fprintf (stderr, "bench_sweep: repetitions must be in [1, %d]\n", MAX_REPS);
+    exit (EXIT_FAILURE);
+  }
+  sizes_str = strdup (sizes_str ? sizes_str : "1M,16M");
+  protos_str = strdup (protos_str ? protos_str : "microtcp,tcp");
+  nsizes = split_list (sizes_str, size_tok, MAX_SIZES);
+  for (i = 0; i < nsizes; i++) {
+    sizes[i] = parse_size (size_tok[i]);
+  }
+  nprotos = split_list (protos_str, proto_tok, 4);
+  if (!nprofiles) {
+    profiles[0].name = "clean";
+    profiles[0].args = NULL;
+    nprofiles = 1;
+  }
+  if (outfile) {
+    fp = fopen (outfile, "w");
+    if (!fp) {
+      perror ("Open output file");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  write_header (fp, json);
+  for (p = 0; p < nprotos; p++) {
+    int microtcp = strcmp (proto_tok[p], "tcp") != 0;
+    for (s = 0; s < nsizes; s++) {
+      for (f = 0; f < nprofiles; f++) {
+        if (!microtcp && profiles[f].args) {
+          fprintf (stderr, "bench_sweep: skipping tcp on profile %s, the proxy relays UDP only\n",
+                   profiles[f].name);
+          continue;
+        }
+        /* odometer over the environment sweeps */
+        memset (pick, 0, sizeof(pick));
+        do {
+          ok = 0;
+          for (rep = 0; rep < reps; rep++) {
+            if (run_one (microtcp, sizes[s], &profiles[f], rep, env, pick, nenv, &res) < 0) {
+              res.ok = 0;
+            }
+            write_result (fp, json, first, proto_tok[p], sizes[s], &profiles[f],
+                          env, pick, nenv, rep, &res);
+            first = 0;
+            if (res.ok) {
+              tput[ok++] = res.bytes / (1024.0 * 1024.0) / res.transfer_s;
+            } else {
+              failures++;
+            }
+          }
+          fprintf (stderr, "%-8s %10llu %-10s", proto_tok[p],
+                   (unsigned long long) sizes[s], profiles[f].name);
+          for (i = 0; i < nenv; i++) {
+            fprintf (stderr, " %s=%s", env[i].key, env[i].values[pick[i]]);
+          }
+          if (ok) {
+            qsort (tput, ok, sizeof(double), cmp_double);
+            fprintf (stderr, "  median %.2f MB/s (min %.2f, max %.2f), %d/%d ok\n",
+                     tput[ok / 2], tput[0], tput[ok - 1], ok, reps);
+          } else {
+            fprintf (stderr, "  all %d runs failed\n", reps);
+          }
+
+          more = 0;
+          for (i = 0; i < nenv; i++) {
+            if (++pick[i] < env[i].n) {
+              more = 1;
+              break;
+            }
+            pick[i] = 0;
+          }
+        } while (more);
+      }
+    }
+  }
+  if (json) {
+    fprintf (fp, "\n]\n");
+  }
+
+  if (fp != stdout) {
+    fclose (fp);
+  }
+  free (sizes_str);
+  free (protos_str);
+  return failures ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,525 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Connection setup rate. Client threads open and close connections back
+ * to back for a fixed time, recording how long microtcp_connect() and
+ * microtcp_shutdown() take, and the total gives connects per second.
+ *
+ * A microTCP socket serves one connection at a time and has no accept
+ * queue, so the server runs -w workers, worker i accepting on port p+i
+ * and going back to accept on the same socket once the client is gone.
+ * Client thread i uses port p + i % w, so both ends take the same -w.
+ * With more client threads than workers the extra SYNs wait for the
+ * worker and are repeated on the ACK timeout, which shows up in the
+ * handshake tail. Kernel TCP has one listening socket that all workers
+ * accept from.
+ *
+ * With -S the client sends a request of that size on every connection
+ * and the connect time runs until the request is ACKed. -F does that
+ * with microtcp_connect_data(), so after the first connection to a
+ * worker the request rides on the SYN (fast open). Give -F to the
+ * server too, it has to hand out the cookies.
+ *
+ * -P takes the connections from a microtcp_pool instead, the figures
+ * then show what reuse saves. Each pooled connection keeps its worker
+ * busy, so -P needs no more client threads than workers.
+ *
+ *   server:  connect_bench -s -m -p 8080 -w 4
+ *   client:  connect_bench -m -a 127.0.0.1 -p 8080 -w 4 -t 4 -d 10
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+#include "../lib/microtcp_pool.h"
+#include "../utils/histogram.h"
+
+#define PORT 8080
+#define HIST_SUB_BITS 7         /* ~1% relative error */
+
+typedef struct
+{
+  int microtcp;
+  int fastopen;
+  int id;
+  size_t size;                  /**< request sent on every connection */
+  struct sockaddr_in sin;
+  int listen_fd;                /**< kernel TCP server only */
+  uint64_t deadline_ns;         /**< client only */
+  uint64_t connects;
+  uint64_t failures;
+  histogram_t handshake;
+  histogram_t teardown;
+  microtcp_pool_t *pool;        /**< client only, with -P */
+} worker_t;
+
+static volatile int running = 1;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+server_microtcp (void *arg)
+{
+  worker_t *w = arg;
+  struct sockaddr_in client_addr;
+  microtcp_sock_t sock;
+  uint8_t buffer[MICROTCP_MSS];
+  ssize_t ret;
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0
+      || microtcp_bind (&sock, (struct sockaddr *) &w->sin, sizeof(w->sin)) < 0) {
+    return NULL;
+  }
+  microtcp_set_fastopen (&sock, w->fastopen);
+  while (running) {
+    if (microtcp_accept (&sock, (struct sockaddr *) &client_addr, sizeof(client_addr)) < 0) {
+      w->failures++;
+      continue;
+    }
+    /* the client closes after its request, recv returns 0 once its FIN
+     * is in and our side of the close is done */
+    do {
+      ret = microtcp_recv (&sock, buffer, sizeof(buffer), 0);
+    } while (ret > 0);
+    if (ret < 0 && sock.state != CLOSED) {
+      w->failures++;
+      microtcp_shutdown (&sock, SHUT_RDWR);
+    } else {
+      w->connects++;
+    }
+  }
+  microtcp_close (&sock);
+  return NULL;
+}
+
+static void *
+server_tcp (void *arg)
+{
+  worker_t *w = arg;
+  uint8_t buffer[64];
+  int fd;
+
+  while (running) {
+    fd = accept (w->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (running) {
+        w->failures++;
+      }
+      continue;
+    }
+    while (read (fd, buffer, sizeof(buffer)) > 0)
+      ;
+    close (fd);
+    w->connects++;
+  }
+  return NULL;
+}
+
+static void *
+client_microtcp (void *arg)
+{
+  worker_t *w = arg;
+  microtcp_sock_t sock;
+  uint8_t *request;
+  uint64_t t0, t1;
+  int ret;
+
+  request = calloc (1, w->size + 1);
+  if (!request) {
+    w->failures++;
+    return NULL;
+  }
+  while (now_ns () < w->deadline_ns) {
+    sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock.sd < 0) {
+      w->failures++;
+      break;
+    }
+    t0 = now_ns ();
+    if (w->pool) {
+      microtcp_close (&sock);
+      ret = microtcp_pool_get (w->pool, (struct sockaddr *) &w->sin, sizeof(w->sin), &sock) < 0
+          || (w->size && microtcp_send (&sock, request, w->size, 0) < 0);
+      if (ret && sock.sd >= 0) {
+        microtcp_pool_discard (w->pool, &sock);
+      }
+    } else if (w->fastopen) {
+      ret = microtcp_connect_data (&sock, (struct sockaddr *) &w->sin, sizeof(w->sin),
+                                   request, w->size) < 0;
+    } else {
+      ret = microtcp_connect (&sock, (struct sockaddr *) &w->sin, sizeof(w->sin)) < 0
+          || (w->size && microtcp_send (&sock, request, w->size, 0) < 0);
+    }
+    if (ret) {
+      w->failures++;
+      microtcp_close (&sock);
+      continue;
+    }
+    t1 = now_ns ();
+    histogram_record (&w->handshake, t1 - t0);
+    if (w->pool) {
+      microtcp_pool_put (w->pool, &sock);
+    } else {
+      microtcp_shutdown (&sock, SHUT_RDWR);
+      microtcp_close (&sock);
+    }
+    histogram_record (&w->teardown, now_ns () - t1);
+    w->connects++;
+  }
+  free (request);
+  return NULL;
+}
+
+static void *
+client_tcp (void *arg)
+{
+  worker_t *w = arg;
+  uint8_t byte, *request;
+  uint64_t t0, t1;
+  int fd;
+
+  request = calloc (1, w->size + 1);
+  if (!request) {
+    w->failures++;
+    return NULL;
+  }
+  while (now_ns () < w->deadline_ns) {
+    fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+      w->failures++;
+      break;
+    }
+    t0 = now_ns ();
+    if (connect (fd, (struct sockaddr *) &w->sin, sizeof(w->sin)) < 0
+        || (w->size && write (fd, request, w->size) != (ssize_t) w->size)) {
+      w->failures++;
+      close (fd);
+      continue;
+    }
+    t1 = now_ns ();
+    histogram_record (&w->handshake, t1 - t0);
+    /* like microtcp_shutdown(), wait for the peer's FIN */
+    shutdown (fd, SHUT_WR);
+    while (read (fd, &byte, 1) > 0)
+      ;
+    close (fd);
+    histogram_record (&w->teardown, now_ns () - t1);
+    w->connects++;
+  }
+  free (request);
+  return NULL;
+}
+
+static void
+print_histogram (const char *title, const histogram_t *h, int machine, const char *prefix)
+{
+  if (machine) {
+    printf ("result %sp50_us=%.3f %sp90_us=%.3f %sp99_us=%.3f %sp999_us=%.3f %smax_us=%.3f\n",
+            prefix, histogram_percentile (h, 50) / 1e3,
+            prefix, histogram_percentile (h, 90) / 1e3,
+            prefix, histogram_percentile (h, 99) / 1e3,
+            prefix, histogram_percentile (h, 99.9) / 1e3,
+            prefix, h->max / 1e3);
+    return;
+  }
+  printf ("%s (%llu samples, us)\n", title, (unsigned long long) h->total);
+  printf ("  min %10.3f  p50 %10.3f  p90 %10.3f  p99 %10.3f  p99.9 %10.3f  max %10.3f\n",
+          h->min / 1e3, histogram_percentile (h, 50) / 1e3,
+          histogram_percentile (h, 90) / 1e3, histogram_percentile (h, 99) / 1e3,
+          histogram_percentile (h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static int
+server (int microtcp, int fastopen, uint16_t port, int nworkers)
+{
+  sigset_t set;
+  worker_t *workers;
+  pthread_t *threads;
+  uint64_t connects = 0, failures = 0;
+  int i, sig, listen_fd = -1, one = 1;
+
+  /* the workers inherit the mask, only this thread takes the signal */
+  sigemptyset (&set);
+  sigaddset (&set, SIGINT);
+  sigaddset (&set, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  workers = calloc (nworkers, sizeof(worker_t));
+  threads = calloc (nworkers, sizeof(pthread_t));
+  if (!workers || !threads) {
+    perror ("Allocate workers");
+    return -EXIT_FAILURE;
+  }
+
+  if (!microtcp) {
+    struct sockaddr_in sin;
+
+    memset (&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (port);
+    sin.sin_addr.s_addr = INADDR_ANY;
+    listen_fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_fd >= 0) {
+      setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (listen_fd < 0 || bind (listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || listen (listen_fd, SOMAXCONN) < 0) {
+      perror ("TCP server");
+      return -EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    workers[i].microtcp = microtcp;
+    workers[i].fastopen = fastopen;
+    workers[i].id = i;
+    workers[i].listen_fd = listen_fd;
+    workers[i].sin.sin_family = AF_INET;
+    workers[i].sin.sin_port = htons (microtcp ? port + i : port);
+    workers[i].sin.sin_addr.s_addr = INADDR_ANY;
+    pthread_create (&threads[i], NULL, microtcp ? server_microtcp : server_tcp,
+                    &workers[i]);
+  }
+
+  sigwait (&set, &sig);
+  running = 0;
+
+  /* shutting the listening socket down wakes the kernel TCP workers.
+   * microtcp_accept() has no way to be interrupted, so those workers
+   * are left waiting and go away with the process */
+  if (listen_fd >= 0) {
+    shutdown (listen_fd, SHUT_RDWR);
+    for (i = 0; i < nworkers; i++) {
+      pthread_join (threads[i], NULL);
+    }
+    close (listen_fd);
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    connects += workers[i].connects;
+    failures += workers[i].failures;
+  }
+  printf ("Served %llu connections, %llu failed\n",
+          (unsigned long long) connects, (unsigned long long) failures);
+  return 0;
+}
+
+static int
+client (int microtcp, int fastopen, int pooled, const char *serverip, uint16_t port,
+        int nworkers, int nthreads, size_t size, double duration, int machine)
+{
+  microtcp_pool_t *pool = NULL;
+  microtcp_pool_stats_t stats;
+  worker_t *workers;
+  pthread_t *threads;
+  histogram_t handshake, teardown;
+  uint64_t connects = 0, failures = 0, start, elapsed;
+  int i, ret = 0;
+
+  workers = calloc (nthreads, sizeof(worker_t));
+  threads = calloc (nthreads, sizeof(pthread_t));
+  if (!workers || !threads || histogram_init (&handshake, HIST_SUB_BITS) < 0
+      || histogram_init (&teardown, HIST_SUB_BITS) < 0) {
+    perror ("Allocate workers");
+    return -EXIT_FAILURE;
+  }
+
+  if (pooled) {
+    pool = microtcp_pool_new (nthreads, 10 * 1000000);
+    if (!pool) {
+      return -EXIT_FAILURE;
+    }
+  }
+
+  start = now_ns ();
+  for (i = 0; i < nthreads; i++) {
+    workers[i].pool = pool;
+    workers[i].microtcp = microtcp;
+    workers[i].fastopen = fastopen;
+    workers[i].id = i;
+    workers[i].size = size;
+    workers[i].deadline_ns = start + (uint64_t) (duration * 1e9);
+    workers[i].sin.sin_family = AF_INET;
+    workers[i].sin.sin_port = htons (microtcp ? port + i % nworkers : port);
+    if (inet_pton (AF_INET, serverip, &workers[i].sin.sin_addr) != 1
+        || histogram_init (&workers[i].handshake, HIST_SUB_BITS) < 0
+        || histogram_init (&workers[i].teardown, HIST_SUB_BITS) < 0) {
+      printf ("Invalid server address or out of memory.\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_create (&threads[i], NULL, microtcp ? client_microtcp : client_tcp,
+                    &workers[i]);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join (threads[i], NULL);
+    connects += workers[i].connects;
+    failures += workers[i].failures;
+    histogram_add (&handshake, &workers[i].handshake);
+    histogram_add (&teardown, &workers[i].teardown);
+    histogram_free (&workers[i].handshake);
+    histogram_free (&workers[i].teardown);
+  }
+  elapsed = now_ns () - start;
+  if (pool) {
+    microtcp_pool_get_stats (pool, &stats);
+    microtcp_pool_free (pool);
+  }
+
+  if (machine) {
+    printf ("result connects=%llu failures=%llu seconds=%.6f connects_per_sec=%.1f\n",
+            (unsigned long long) connects, (unsigned long long) failures,
+            elapsed / 1e9, connects / (elapsed / 1e9));
+  } else {
+    printf ("%llu connections from %d threads in %.3f s, %llu failed\n",
+            (unsigned long long) connects, nthreads, elapsed / 1e9,
+            (unsigned long long) failures);
+    printf ("Connects/sec: %.1f\n", connects / (elapsed / 1e9));
+  }
+  print_histogram ("Handshake", &handshake, machine, "connect_");
+  print_histogram (pool ? "Release" : "Shutdown", &teardown, machine, "shutdown_");
+  if (pool) {
+    printf (machine ? "result pool_hits=%llu pool_misses=%llu pool_probes=%llu pool_stale=%llu\n"
+                    : "Pool: %llu hits, %llu misses, %llu probes, %llu stale\n",
+            (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+            (unsigned long long) stats.probes, (unsigned long long) stats.stale);
+  }
+  if (!connects) {
+    ret = -EXIT_FAILURE;
+  }
+
+  histogram_free (&handshake);
+  histogram_free (&teardown);
+  free (workers);
+  free (threads);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, is_server = 0, microtcp = 0, fastopen = 0, pooled = 0, machine = 0, exit_code;
+  int port = PORT, nworkers = 1, nthreads = 0;
+  size_t size = 0;
+  double duration = 5;
+  char *ipstr = NULL;
+
+  while ((opt = getopt (argc, argv, "hsmFPrp:a:w:t:d:S:")) != -1) {
+    switch (opt)
+      {
+      case 's':
+        is_server = 1;
+        break;
+      case 'm':
+        microtcp = 1;
+        break;
+      case 'F':
+        fastopen = 1;
+        break;
+      case 'P':
+        pooled = 1;
+        break;
+      case 'r':
+        machine = 1;
+        break;
+      case 'S':
+        size = strtoul (optarg, NULL, 10);
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'w':
+        nworkers = atoi (optarg);
+        break;
+      case 't':
+        nthreads = atoi (optarg);
+        break;
+      case 'd':
+        duration = atof (optarg);
+        break;
+      default:
+        printf (
+            "Usage: connect_bench [-s] [-m] [-F] [-P] -p port [-a ip] [-w workers] [-t threads] [-d seconds] [-S size]\n"
+            "Options:\n"
+            "   -s                  If set, the program runs as the server. Otherwise as client.\n"
+            "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -p <int>            The base port of the server (default 8080)\n"
+            "   -a <string>         The IP address of the server. Ignored in server mode.\n"
+            "   -w <int>            Server workers, microTCP uses ports p..p+w-1. The same on both ends (default 1)\n"
+            "   -t <int>            Client threads (default: the number of workers)\n"
+            "   -d <float>          Client run time in seconds (default 5)\n"
+            "   -S <int>            Request bytes sent on every connection (default 0)\n"
+            "   -F                  microTCP fast open, the request goes with the SYN. Both ends.\n"
+            "   -P                  Client reuses microTCP connections from a pool, at most one thread per worker\n"
+            "   -r                  Print the results as \"result key=value ...\" lines\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (nworkers < 1) {
+    printf ("At least one worker is needed.\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nthreads < 1) {
+    nthreads = nworkers;
+  }
+  if (pooled && (!microtcp || nthreads > nworkers)) {
+    printf ("-P works with microTCP (-m) and at most one client thread per worker.\n");
+    exit (EXIT_FAILURE);
+  }
+  if (is_server) {
+    exit_code = server (microtcp, fastopen, port, nworkers);
+  } else {
+    if (!ipstr) {
+      printf ("The client needs the server address (-a).\n");
+      exit (EXIT_FAILURE);
+    }
+    exit_code = client (microtcp, fastopen, pooled, ipstr, port, nworkers, nthreads, size,
+                        duration, machine);
+  }
+
+  free (ipstr);
+  return exit_code;
+}
@@ -0,0 +1,256 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CPU cost of a transfer: perf_event_open counters for this process and
+ * the threads it starts, plus getrusage. Counters the kernel refuses
+ * (no PMU in a VM, perf_event_paranoid, no tracefs for the syscall
+ * tracepoint) are reported as n/a. With perf_event_paranoid at 2 the
+ * hardware counters fall back to user space only.
+ */
+
+#ifndef TEST_CPU_COUNTERS_H_
+#define TEST_CPU_COUNTERS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+enum
+{
+  CPU_CYCLES,
+  CPU_INSTRUCTIONS,
+  CPU_CACHE_MISSES,
+  CPU_CTX_SWITCHES,
+  CPU_SYSCALLS,
+  CPU_NR_COUNTERS
+};
+
+typedef struct
+{
+  int fd[CPU_NR_COUNTERS];
+  int user_only[CPU_NR_COUNTERS];      /**< kernel time excluded */
+  int valid[CPU_NR_COUNTERS];          /**< opened and read back */
+  uint64_t value[CPU_NR_COUNTERS];     /**< scaled for multiplexing */
+  struct rusage ru_start;
+  struct rusage ru_end;
+  struct timespec start;
+  struct timespec end;
+} cpu_counters_t;
+
+static const char *cpu_counter_names[CPU_NR_COUNTERS] =
+  { "cycles", "instructions", "cache_misses", "ctx_switches", "syscalls" };
+
+/* the id of the raw_syscalls:sys_enter tracepoint, or -1 */
+static inline long long
+cpu_syscall_tracepoint (void)
+{
+  static const char *paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" };
+  long long id = -1;
+  unsigned i;
+  FILE *fp;
+
+  for (i = 0; i < sizeof(paths) / sizeof(paths[0]) && id < 0; i++) {
+    fp = fopen (paths[i], "r");
+    if (fp) {
+      if (fscanf (fp, "%lld", &id) != 1) {
+        id = -1;
+      }
+      fclose (fp);
+    }
+  }
+  return id;
+}
+
+static inline int
+cpu_counter_open (cpu_counters_t *c, int idx, uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  c->fd[idx] = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (c->fd[idx] < 0 && type == PERF_TYPE_HARDWARE) {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c->fd[idx] = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    c->user_only[idx] = c->fd[idx] >= 0;
+  }
+  return c->fd[idx];
+}
+
+/**
+ * Opens the counters. Call before starting any threads that should be
+ * counted, they inherit the counters from the thread that opened them.
+ */
+static inline void
+cpu_counters_init (cpu_counters_t *c)
+{
+  long long tp = cpu_syscall_tracepoint ();
+  int i;
+
+  memset (c, 0, sizeof(cpu_counters_t));
+  cpu_counter_open (c, CPU_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  cpu_counter_open (c, CPU_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  cpu_counter_open (c, CPU_CACHE_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  cpu_counter_open (c, CPU_CTX_SWITCHES, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+  c->fd[CPU_SYSCALLS] = -1;
+  if (tp >= 0) {
+    cpu_counter_open (c, CPU_SYSCALLS, PERF_TYPE_TRACEPOINT, tp);
+  }
+  for (i = 0; i < CPU_NR_COUNTERS; i++) {
+    if (c->fd[i] >= 0) {
+      ioctl (c->fd[i], PERF_EVENT_IOC_RESET, 0);
+    }
+  }
+}
+
+static inline void
+cpu_counters_start (cpu_counters_t *c)
+{
+  int i;
+
+  for (i = 0; i < CPU_NR_COUNTERS; i++) {
+    if (c->fd[i] >= 0) {
+      ioctl (c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  getrusage (RUSAGE_SELF, &c->ru_start);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &c->start);
+}
+
+static inline void
+cpu_counters_stop (cpu_counters_t *c)
+{
+  uint64_t buf[3];
+  int i;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &c->end);
+  getrusage (RUSAGE_SELF, &c->ru_end);
+  for (i = 0; i < CPU_NR_COUNTERS; i++) {
+    if (c->fd[i] < 0) {
+      continue;
+    }
+    ioctl (c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read (c->fd[i], buf, sizeof(buf)) != sizeof(buf) || !buf[2]) {
+      close (c->fd[i]);
+      c->fd[i] = -1;
+      continue;
+    }
+    /* the PMU was shared with other events for part of the run */
+    c->value[i] = buf[2] < buf[1] ? (uint64_t) ((double) buf[0] * buf[1] / buf[2]) : buf[0];
+    c->valid[i] = 1;
+    close (c->fd[i]);
+    c->fd[i] = -1;
+  }
+}
+
+static inline double
+cpu_tv_seconds (struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Prints the counters against the bytes and packets of the transfer.
+ * Packets may be 0 when unknown.
+ */
+static inline void
+cpu_counters_report (const cpu_counters_t *c, uint64_t bytes, uint64_t packets,
+                     int machine)
+{
+  double elapsed = c->end.tv_sec - c->start.tv_sec
+      + (c->end.tv_nsec - c->start.tv_nsec) * 1e-9;
+  double user = cpu_tv_seconds (c->ru_end.ru_utime) - cpu_tv_seconds (c->ru_start.ru_utime);
+  double sys = cpu_tv_seconds (c->ru_end.ru_stime) - cpu_tv_seconds (c->ru_start.ru_stime);
+  double gbit = bytes * 8 / 1e9, mb = bytes / (1024.0 * 1024.0);
+  long vcsw = c->ru_end.ru_nvcsw - c->ru_start.ru_nvcsw;
+  long ivcsw = c->ru_end.ru_nivcsw - c->ru_start.ru_nivcsw;
+  int i;
+
+  if (machine) {
+    printf ("result cpu_user_s=%.6f cpu_sys_s=%.6f vcsw=%ld ivcsw=%ld packets=%llu",
+            user, sys, vcsw, ivcsw, (unsigned long long) packets);
+    for (i = 0; i < CPU_NR_COUNTERS; i++) {
+      if (c->valid[i]) {
+        printf (" %s=%llu", cpu_counter_names[i], (unsigned long long) c->value[i]);
+      }
+    }
+    if (gbit > 0) {
+      printf (" cpu_s_per_gbit=%.6f", (user + sys) / gbit);
+    }
+    if (c->valid[CPU_CYCLES] && bytes) {
+      printf (" cycles_per_byte=%.3f", (double) c->value[CPU_CYCLES] / bytes);
+    }
+    if (c->valid[CPU_INSTRUCTIONS] && packets) {
+      printf (" instructions_per_packet=%.1f",
+              (double) c->value[CPU_INSTRUCTIONS] / packets);
+    }
+    if (c->valid[CPU_SYSCALLS] && mb > 0) {
+      printf (" syscalls_per_mb=%.1f", c->value[CPU_SYSCALLS] / mb);
+    }
+    printf ("\n");
+    return;
+  }
+
+  printf ("Transfer: %.3f MB in %.3f s, %.3f MB/s\n", mb, elapsed,
+          elapsed > 0 ? mb / elapsed : 0);
+  printf ("CPU: %.3f s user, %.3f s system over %.3f s (%.1f%% of a core), "
+          "%ld voluntary / %ld involuntary context switches\n",
+          user, sys, elapsed, elapsed > 0 ? 100 * (user + sys) / elapsed : 0,
+          vcsw, ivcsw);
+  for (i = 0; i < CPU_NR_COUNTERS; i++) {
+    if (c->valid[i]) {
+      printf ("  %-14s %15llu%s\n", cpu_counter_names[i],
+              (unsigned long long) c->value[i], c->user_only[i] ? " (user space only)" : "");
+    } else {
+      printf ("  %-14s %15s\n", cpu_counter_names[i], "n/a");
+    }
+  }
+  if (gbit > 0) {
+    printf ("  CPU per Gbit:      %.4f core-seconds\n", (user + sys) / gbit);
+  }
+  if (c->valid[CPU_CYCLES] && bytes) {
+    printf ("  cycles/byte:       %.3f\n", (double) c->value[CPU_CYCLES] / bytes);
+  }
+  if (c->valid[CPU_INSTRUCTIONS] && packets) {
+    printf ("  instructions/pkt:  %.1f (%llu packets)\n",
+            (double) c->value[CPU_INSTRUCTIONS] / packets, (unsigned long long) packets);
+  }
+  if (c->valid[CPU_SYSCALLS] && mb > 0) {
+    printf ("  syscalls/MB:       %.1f\n", c->value[CPU_SYSCALLS] / mb);
+  }
+}
+
+#endif /* TEST_CPU_COUNTERS_H_ */
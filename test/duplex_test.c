@@ -0,0 +1,301 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Both ends send -L bytes to each other over one microTCP connection,
+ * the way two replicas stream changes both ways. With full duplex a
+ * thread sends while another receives; with -q each end sends first and
+ * receives after (the client) or the other way round (the server). Every
+ * byte received is checked against the pattern the peer sends.
+ *
+ *   server:  duplex_test -s -p 8080
+ *   client:  duplex_test -a 127.0.0.1 -p 8080 -L 16777216
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define PORT 8080
+#define CHUNK_SIZE 16384
+
+typedef struct
+{
+  microtcp_sock_t *sock;
+  size_t length;
+  uint8_t seed;                 /**< first byte of the pattern */
+  ssize_t done;                 /**< bytes sent or received, -1 on failure */
+  double ms;
+} direction_t;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* byte i of the stream of the end that starts with seed */
+static inline uint8_t
+pattern (uint8_t seed, size_t i)
+{
+  return (uint8_t) (seed + i * 7 + (i >> 12));
+}
+
+static void *
+sender (void *arg)
+{
+  direction_t *d = arg;
+  uint8_t chunk[CHUNK_SIZE];
+  uint64_t start = now_ns ();
+  size_t off = 0, n, i;
+
+  while (off < d->length) {
+    n = d->length - off < CHUNK_SIZE ? d->length - off : CHUNK_SIZE;
+    for (i = 0; i < n; i++) {
+      chunk[i] = pattern (d->seed, off + i);
+    }
+    if (microtcp_send (d->sock, chunk, n, 0) != (ssize_t) n) {
+      d->done = -1;
+      return NULL;
+    }
+    off += n;
+  }
+  if (microtcp_flush (d->sock) < 0) {
+    d->done = -1;
+    return NULL;
+  }
+  d->done = off;
+  d->ms = (now_ns () - start) / 1e6;
+  return NULL;
+}
+
+static void *
+receiver (void *arg)
+{
+  direction_t *d = arg;
+  uint8_t chunk[CHUNK_SIZE];
+  uint64_t start = now_ns ();
+  size_t off = 0, i;
+  ssize_t ret;
+
+  while (off < d->length) {
+    ret = microtcp_recv (d->sock, chunk, CHUNK_SIZE, 0);
+    if (ret <= 0) {
+      break;
+    }
+    for (i = 0; i < (size_t) ret; i++) {
+      if (chunk[i] != pattern (d->seed, off + i)) {
+        fprintf (stderr, "Byte %zu differs from what the peer sent\n", off + i);
+        d->done = -1;
+        return NULL;
+      }
+    }
+    off += ret;
+  }
+  d->done = off == d->length ? (ssize_t) off : -1;
+  d->ms = (now_ns () - start) / 1e6;
+  return NULL;
+}
+
+static int
+exchange (microtcp_sock_t *sock, int is_server, size_t length, int sequential,
+          int machine)
+{
+  direction_t out = { sock, length, is_server ? 0x53 : 0x43, 0, 0 };
+  direction_t in = { sock, length, is_server ? 0x43 : 0x53, 0, 0 };
+  microtcp_info_t info;
+  pthread_t tid;
+  uint64_t start = now_ns ();
+  double total_ms;
+
+  if (sequential) {
+    /* the client talks first, the server answers */
+    if (is_server) {
+      receiver (&in);
+      sender (&out);
+    } else {
+      sender (&out);
+      receiver (&in);
+    }
+  } else {
+    if (microtcp_set_duplex (sock, 1) < 0) {
+      perror ("Enable full duplex");
+      return -EXIT_FAILURE;
+    }
+    if (pthread_create (&tid, NULL, sender, &out)) {
+      perror ("Start the sending thread");
+      return -EXIT_FAILURE;
+    }
+    receiver (&in);
+    pthread_join (tid, NULL);
+  }
+  total_ms = (now_ns () - start) / 1e6;
+
+  if (out.done < 0 || in.done < 0) {
+    printf ("The exchange failed: sent %zd, received %zd bytes\n", out.done, in.done);
+    return -EXIT_FAILURE;
+  }
+  microtcp_get_info (sock, &info);
+  if (machine) {
+    printf ("result bytes=%zu send_ms=%.3f recv_ms=%.3f total_ms=%.3f mbps=%.3f"
+            " retrans=%llu\n", length, out.ms, in.ms, total_ms,
+            2 * length / (total_ms * 1000.0),
+            (unsigned long long) (info.retrans_timeout + info.retrans_fast));
+  } else {
+    printf ("Sent %zu bytes in %.3f ms, received %zu bytes in %.3f ms\n",
+            length, out.ms, length, in.ms);
+    printf ("Both directions done in %.3f ms, %.3f MB/s together, %llu retransmissions\n",
+            total_ms, 2 * length / (total_ms * 1000.0),
+            (unsigned long long) (info.retrans_timeout + info.retrans_fast));
+  }
+  return EXIT_SUCCESS;
+}
+
+static int
+server (uint16_t port, size_t length, int sequential, int machine)
+{
+  microtcp_sock_t sock;
+  struct sockaddr_in sin, client_addr;
+  uint8_t byte;
+  int ret;
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    return -EXIT_FAILURE;
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (microtcp_bind (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0
+      || microtcp_accept (&sock, (struct sockaddr *) &client_addr,
+                          sizeof(struct sockaddr_in)) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  ret = exchange (&sock, 1, length, sequential, machine);
+  /* the client closes first, a full duplex connection stays open until
+   * we shut it down as well */
+  if (microtcp_recv (&sock, &byte, 1, 0) == 0 && sock.state != CLOSED) {
+    microtcp_shutdown (&sock, SHUT_RDWR);
+  }
+  microtcp_close (&sock);
+  return ret;
+}
+
+static int
+client (const char *ipstr, uint16_t port, size_t length, int sequential, int machine)
+{
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  int ret;
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    return -EXIT_FAILURE;
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = inet_addr (ipstr);
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0) {
+    microtcp_close (&sock);
+    return -EXIT_FAILURE;
+  }
+
+  ret = exchange (&sock, 0, length, sequential, machine);
+  microtcp_shutdown (&sock, SHUT_RDWR);
+  microtcp_close (&sock);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, is_server = 0, sequential = 0, machine = 0, exit_code;
+  uint16_t port = PORT;
+  size_t length = 16 * 1024 * 1024;
+  char *ipstr = NULL;
+
+  while ((opt = getopt (argc, argv, "hsqrp:a:L:")) != -1) {
+    switch (opt)
+      {
+      case 's':
+        is_server = 1;
+        break;
+      case 'q':
+        sequential = 1;
+        break;
+      case 'r':
+        machine = 1;
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'L':
+        length = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        printf (
+            "Usage: duplex_test [-s] -p port [-a ip] [-L bytes] [-q]\n"
+            "Options:\n"
+            "   -s                  If set, the program runs as the server. Otherwise as client.\n"
+            "   -p <int>            The listening port of the server (default 8080)\n"
+            "   -a <string>         The IP address of the server. Ignored in server mode.\n"
+            "   -L <int>            Bytes each end sends, the same on both ends (default 16 MB)\n"
+            "   -q                  Half duplex: the client sends first, then the server\n"
+            "   -r                  Print the results as \"result key=value ...\" lines\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (!length) {
+    printf ("-L must not be 0.\n");
+    exit (EXIT_FAILURE);
+  }
+  if (is_server) {
+    exit_code = server (port, length, sequential, machine);
+  } else {
+    if (!ipstr) {
+      printf ("The client needs the server address (-a).\n");
+      exit (EXIT_FAILURE);
+    }
+    exit_code = client (ipstr, port, length, sequential, machine);
+  }
+
+  free (ipstr);
+  return exit_code;
+}
@@ -0,0 +1,452 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UDP relay that sits between two microTCP peers and impairs the traffic
+ * in both directions: loss (Bernoulli or Gilbert-Elliott), fixed plus
+ * jittered delay, a bandwidth cap with a bounded queue, reordering and
+ * duplication. Everything is driven by a seeded PRNG, so a run is
+ * repeatable. No root and no netem needed.
+ *
+ *   server:  bandwidth_test -s -m -p 8080 -f out
+ *   proxy:   impair_proxy -l 9090 -a 127.0.0.1 -p 8080 -L 1 -d 10 -j 2
+ *   client:  bandwidth_test -m -a 127.0.0.1 -p 9090 -f in
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_DGRAM 65536
+
+/* directions of the traffic */
+#define TO_SERVER 0
+#define TO_CLIENT 1
+
+typedef struct
+{
+  double loss;                  /* Bernoulli loss probability */
+  int gilbert;                  /* use the Gilbert-Elliott model instead */
+  double ge_p;                  /* P(good -> bad) */
+  double ge_r;                  /* P(bad -> good) */
+  double ge_loss_good;          /* loss probability in the good state */
+  double ge_loss_bad;           /* loss probability in the bad state */
+  uint64_t delay_us;
+  uint64_t jitter_us;
+  uint64_t rate_bps;            /* 0 means no cap */
+  size_t queue_limit;           /* packets waiting for the link */
+  double reorder;               /* probability to skip the delay */
+  double duplicate;
+} impair_t;
+
+typedef struct
+{
+  uint64_t rng;
+  int ge_bad;
+  uint64_t link_free_us;        /* when the link finishes the queued packets */
+  uint64_t *departures;         /* ring of link departure times */
+  size_t q_head, q_len;
+
+  uint64_t received;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t forwarded;
+} direction_t;
+
+typedef struct
+{
+  uint64_t release_us;
+  uint64_t order;               /* keeps equal release times FIFO */
+  int dir;
+  size_t len;
+  uint8_t data[];
+} packet_t;
+
+static volatile sig_atomic_t running = 1;
+static packet_t **heap;
+static size_t heap_len, heap_cap;
+static uint64_t order;
+
+static void
+sig_handler (int signal)
+{
+  if (signal == SIGINT || signal == SIGTERM) {
+    running = 0;
+  }
+}
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, deterministic for a given seed */
+static double
+rand_uniform (direction_t *d)
+{
+  d->rng ^= d->rng >> 12;
+  d->rng ^= d->rng << 25;
+  d->rng ^= d->rng >> 27;
+  return ((d->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+heap_before (const packet_t *a, const packet_t *b)
+{
+  return a->release_us < b->release_us
+      || (a->release_us == b->release_us && a->order < b->order);
+}
+
+static int
+heap_push (packet_t *p)
+{
+  size_t i;
+  packet_t **grown;
+
+  if (heap_len == heap_cap) {
+    heap_cap = heap_cap ? 2 * heap_cap : 1024;
+    grown = realloc (heap, heap_cap * sizeof(packet_t *));
+    if (!grown) {
+      return -1;
+    }
+    heap = grown;
+  }
+  for (i = heap_len++; i && heap_before (p, heap[(i - 1) / 2]); i = (i - 1) / 2) {
+    heap[i] = heap[(i - 1) / 2];
+  }
+  heap[i] = p;
+  return 0;
+}
+
+static packet_t *
+heap_pop (void)
+{
+  packet_t *top = heap[0], *last = heap[--heap_len];
+  size_t i = 0, c;
+
+  while ((c = 2 * i + 1) < heap_len) {
+    if (c + 1 < heap_len && heap_before (heap[c + 1], heap[c])) {
+      c++;
+    }
+    if (!heap_before (heap[c], last)) {
+      break;
+    }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+static int
+is_lost (const impair_t *im, direction_t *d)
+{
+  double p = im->loss;
+
+  if (im->gilbert) {
+    if (d->ge_bad) {
+      d->ge_bad = rand_uniform (d) >= im->ge_r;
+    } else {
+      d->ge_bad = rand_uniform (d) < im->ge_p;
+    }
+    p = d->ge_bad ? im->ge_loss_bad : im->ge_loss_good;
+  }
+  return p > 0 && rand_uniform (d) < p;
+}
+
+/* passes one packet through the link and the delay line */
+static void
+schedule (const impair_t *im, direction_t *d, int dir, const uint8_t *data,
+          size_t len, uint64_t now)
+{
+  packet_t *p;
+  uint64_t depart = now;
+  double jitter;
+
+  /* bandwidth cap: serialize behind the queued packets, tail drop */
+  if (im->rate_bps) {
+    while (d->q_len && d->departures[d->q_head] <= now) {
+      d->q_head = (d->q_head + 1) % im->queue_limit;
+      d->q_len--;
+    }
+    if (d->q_len == im->queue_limit) {
+      d->queue_drops++;
+      return;
+    }
+    if (d->link_free_us < now) {
+      d->link_free_us = now;
+    }
+    d->link_free_us += len * 8 * 1000000 / im->rate_bps;
+    depart = d->link_free_us;
+    d->departures[(d->q_head + d->q_len++) % im->queue_limit] = depart;
+  }
+
+  p = malloc (sizeof(packet_t) + len);
+  if (!p) {
+    return;
+  }
+  p->dir = dir;
+  p->len = len;
+  p->order = order++;
+  memcpy (p->data, data, len);
+
+  /* reordered packets overtake the ones sitting in the delay line */
+  if (im->reorder > 0 && rand_uniform (d) < im->reorder) {
+    d->reordered++;
+    p->release_us = depart;
+  } else {
+    jitter = im->jitter_us ? (2.0 * rand_uniform (d) - 1.0) * im->jitter_us : 0;
+    p->release_us = depart + im->delay_us;
+    if (jitter < 0 && (uint64_t) -jitter > p->release_us - depart) {
+      p->release_us = depart;
+    } else {
+      p->release_us += (int64_t) jitter;
+    }
+  }
+  if (heap_push (p) < 0) {
+    free (p);
+  }
+}
+
+static int
+parse_gilbert (const char *arg, impair_t *im)
+{
+  if (sscanf (arg, "%lf:%lf:%lf:%lf", &im->ge_p, &im->ge_r, &im->ge_loss_good,
+              &im->ge_loss_bad) != 4) {
+    return -1;
+  }
+  im->ge_p /= 100.0;
+  im->ge_r /= 100.0;
+  im->ge_loss_good /= 100.0;
+  im->ge_loss_bad /= 100.0;
+  im->gilbert = 1;
+  return 0;
+}
+
+static void
+print_direction (const char *name, const direction_t *d)
+{
+  printf ("%s: received %llu, lost %llu, queue drops %llu, duplicated %llu, "
+          "reordered %llu, forwarded %llu\n", name,
+          (unsigned long long) d->received, (unsigned long long) d->lost,
+          (unsigned long long) d->queue_drops, (unsigned long long) d->duplicated,
+          (unsigned long long) d->reordered, (unsigned long long) d->forwarded);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, i, timeout;
+  int listen_port = 0, server_port = 0;
+  uint64_t seed = 1, now;
+  char *ipstr = NULL;
+  int fds[2];
+  uint8_t *buffer;
+  ssize_t len;
+  impair_t im;
+  direction_t dirs[2];
+  struct pollfd pfd[2];
+  struct sockaddr_in sin, server, client;
+  socklen_t client_len = 0;
+  packet_t *p;
+
+  memset (&im, 0, sizeof(impair_t));
+  im.queue_limit = 1000;
+
+  while ((opt = getopt (argc, argv, "hl:a:p:s:L:G:d:j:b:q:r:D:")) != -1) {
+    switch (opt)
+      {
+      case 'l':
+        listen_port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'p':
+        server_port = atoi (optarg);
+        break;
+      case 's':
+        seed = strtoull (optarg, NULL, 10);
+        break;
+      case 'L':
+        im.loss = atof (optarg) / 100.0;
+        break;
+      case 'G':
+        if (parse_gilbert (optarg, &im) < 0) {
+          printf ("Bad Gilbert-Elliott parameters: %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'd':
+        im.delay_us = atof (optarg) * 1000;
+        break;
+      case 'j':
+        im.jitter_us = atof (optarg) * 1000;
+        break;
+      case 'b':
+        im.rate_bps = atof (optarg) * 1000;
+        break;
+      case 'q':
+        im.queue_limit = atoi (optarg);
+        break;
+      case 'r':
+        im.reorder = atof (optarg) / 100.0;
+        break;
+      case 'D':
+        im.duplicate = atof (optarg) / 100.0;
+        break;
+      default:
+        printf (
+            "Usage: impair_proxy -l port -a server_ip -p server_port [options]\n"
+            "Options:\n"
+            "   -l <int>            the port the clients send to\n"
+            "   -a <string>         the IP address of the server\n"
+            "   -p <int>            the port of the server\n"
+            "   -s <int>            PRNG seed, same seed same impairments (default 1)\n"
+            "   -L <float>          Bernoulli loss in percent\n"
+            "   -G <p:r:g:b>        Gilbert-Elliott loss: P(good->bad), P(bad->good),\n"
+            "                       loss in good and loss in bad state, all in percent\n"
+            "   -d <float>          one-way delay in ms\n"
+            "   -j <float>          uniform jitter in ms added to the delay (+/-)\n"
+            "   -b <float>          bandwidth cap in kbit/s\n"
+            "   -q <int>            queue limit of the bandwidth cap in packets (default 1000)\n"
+            "   -r <float>          percent of packets that skip the delay line\n"
+            "   -D <float>          percent of packets that are duplicated\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+  if (!listen_port || !server_port || !ipstr || !im.queue_limit) {
+    printf ("Listening port, server address and server port are required, see -h\n");
+    exit (EXIT_FAILURE);
+  }
+
+  memset (dirs, 0, sizeof(dirs));
+  for (i = 0; i < 2; i++) {
+    /* each direction gets its own stream so one does not perturb the other */
+    dirs[i].rng = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+    dirs[i].departures = calloc (im.queue_limit, sizeof(uint64_t));
+  }
+  buffer = malloc (MAX_DGRAM);
+  if (!buffer || !dirs[0].departures || !dirs[1].departures) {
+    perror ("Allocate proxy buffers");
+    exit (EXIT_FAILURE);
+  }
+
+  fds[TO_SERVER] = socket (AF_INET, SOCK_DGRAM, 0);  /* receives from the client */
+  fds[TO_CLIENT] = socket (AF_INET, SOCK_DGRAM, 0);  /* talks to the server */
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (bind (fds[TO_SERVER], (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+    perror ("Proxy bind");
+    exit (EXIT_FAILURE);
+  }
+  memset (&server, 0, sizeof(struct sockaddr_in));
+  server.sin_family = AF_INET;
+  server.sin_port = htons (server_port);
+  server.sin_addr.s_addr = inet_addr (ipstr);
+
+  signal (SIGINT, sig_handler);
+  signal (SIGTERM, sig_handler);
+  printf ("Relaying port %d <-> %s:%d\n", listen_port, ipstr, server_port);
+
+  pfd[0].fd = fds[TO_SERVER];
+  pfd[1].fd = fds[TO_CLIENT];
+  pfd[0].events = pfd[1].events = POLLIN;
+  while (running) {
+    now = now_us ();
+    timeout = -1;
+    if (heap_len) {
+      timeout = heap[0]->release_us > now ? (heap[0]->release_us - now + 999) / 1000 : 0;
+    }
+    if (poll (pfd, 2, timeout) < 0 && errno != EINTR) {
+      perror ("Proxy poll");
+      break;
+    }
+
+    now = now_us ();
+    for (i = 0; i < 2; i++) {
+      if (!(pfd[i].revents & POLLIN)) {
+        continue;
+      }
+      if (i == TO_SERVER) {
+        client_len = sizeof(client);
+        len = recvfrom (fds[i], buffer, MAX_DGRAM, MSG_DONTWAIT, (struct sockaddr *) &client, &client_len);
+      } else {
+        len = recvfrom (fds[i], buffer, MAX_DGRAM, MSG_DONTWAIT, NULL, NULL);
+      }
+      if (len < 0) {
+        continue;
+      }
+      dirs[i].received++;
+      if (is_lost (&im, &dirs[i])) {
+        dirs[i].lost++;
+        continue;
+      }
+      schedule (&im, &dirs[i], i, buffer, len, now);
+      if (im.duplicate > 0 && rand_uniform (&dirs[i]) < im.duplicate) {
+        dirs[i].duplicated++;
+        schedule (&im, &dirs[i], i, buffer, len, now);
+      }
+    }
+
+    /* release whatever is due */
+    while (heap_len && heap[0]->release_us <= now) {
+      p = heap_pop ();
+      if (p->dir == TO_SERVER) {
+        sendto (fds[TO_CLIENT], p->data, p->len, 0, (struct sockaddr *) &server, sizeof(server));
+      } else if (client_len) {
+        sendto (fds[TO_SERVER], p->data, p->len, 0, (struct sockaddr *) &client, client_len);
+      }
+      dirs[p->dir].forwarded++;
+      free (p);
+    }
+  }
+
+  print_direction ("client -> server", &dirs[TO_SERVER]);
+  print_direction ("server -> client", &dirs[TO_CLIENT]);
+  while (heap_len) {
+    free (heap_pop ());
+  }
+  free (heap);
+  free (buffer);
+  free (dirs[0].departures);
+  free (dirs[1].departures);
+  free (ipstr);
+  close (fds[0]);
+  close (fds[1]);
+  return 0;
+}
@@ -0,0 +1,411 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request/response latency over microTCP or kernel TCP. The client sends
+ * a request, waits for the whole reply and records the round trip in an
+ * HDR histogram. The server reads each complete request before echoing
+ * it, as microTCP cannot yet send and receive at the same time, so both
+ * ends take the same -S.
+ *
+ * Closed loop (default) sends the next request as soon as the reply is
+ * in. The corrected figures then back-fill the requests a slow reply held
+ * back, taking the median round trip of the warm-up as the expected
+ * interval.
+ *
+ * With -R the requests follow a fixed schedule. The corrected round trip
+ * is measured from when a request was due, not from when it went out, so
+ * a stall shows up in every request it delayed.
+ *
+ * -M puts microTCP in message mode on both ends, each request and reply
+ * is then a single message taken with a single microtcp_recv().
+ *
+ *   server:  latency_test -s -m -p 8080 -S 64
+ *   client:  latency_test -m -a 127.0.0.1 -p 8080 -S 64 -n 100000 -R 5000
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+#include "../utils/histogram.h"
+
+#define PORT 8080
+#define HIST_SUB_BITS 7         /* ~1% relative error */
+#define SPIN_NS 200000          /* the last stretch before a scheduled send */
+
+typedef struct
+{
+  int microtcp;
+  int message;                  /**< microTCP message mode */
+  int fd;
+  microtcp_sock_t sock;
+} conn_t;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* sleeps most of the way and spins the rest, timer slack alone is tens
+ * of microseconds and would show up in the corrected figures */
+static void
+sleep_until (uint64_t deadline_ns)
+{
+  struct timespec ts;
+  uint64_t wake;
+
+  if (deadline_ns > now_ns () + SPIN_NS) {
+    wake = deadline_ns - SPIN_NS;
+    ts.tv_sec = wake / 1000000000ULL;
+    ts.tv_nsec = wake % 1000000000ULL;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+  }
+  while (now_ns () < deadline_ns) {
+  }
+}
+
+static ssize_t
+conn_send (conn_t *c, const uint8_t *buf, size_t len)
+{
+  if (c->microtcp) {
+    return microtcp_send (&c->sock, buf, len, 0);
+  }
+  return send (c->fd, buf, len, 0);
+}
+
+static ssize_t
+conn_recv (conn_t *c, uint8_t *buf, size_t len)
+{
+  if (c->microtcp) {
+    return microtcp_recv (&c->sock, buf, len, 0);
+  }
+  return recv (c->fd, buf, len, 0);
+}
+
+static int
+conn_recv_all (conn_t *c, uint8_t *buf, size_t len)
+{
+  size_t got = 0;
+  ssize_t ret;
+
+  while (got < len) {
+    ret = conn_recv (c, buf + got, len - got);
+    if (ret <= 0) {
+      return -1;
+    }
+    got += ret;
+  }
+  return 0;
+}
+
+static void
+conn_close (conn_t *c)
+{
+  if (c->microtcp) {
+    microtcp_shutdown (&c->sock, SHUT_RDWR);
+  } else {
+    shutdown (c->fd, SHUT_RDWR);
+    close (c->fd);
+  }
+}
+
+static int
+server (conn_t *c, uint16_t port, size_t size)
+{
+  struct sockaddr_in sin, client_addr;
+  socklen_t client_len = sizeof(client_addr);
+  uint8_t *buffer;
+  int sock, one = 1;
+
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  if (c->microtcp) {
+    c->sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (c->sock.sd < 0
+        || microtcp_bind (&c->sock, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || microtcp_accept (&c->sock, (struct sockaddr *) &client_addr, sizeof(client_addr)) < 0
+        || microtcp_set_message_mode (&c->sock, c->message) < 0) {
+      return -EXIT_FAILURE;
+    }
+  } else {
+    sock = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock >= 0) {
+      setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (sock < 0 || bind (sock, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || listen (sock, 1) < 0) {
+      perror ("TCP server");
+      return -EXIT_FAILURE;
+    }
+    c->fd = accept (sock, (struct sockaddr *) &client_addr, &client_len);
+    close (sock);
+    if (c->fd < 0) {
+      perror ("TCP accept");
+      return -EXIT_FAILURE;
+    }
+    setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  buffer = malloc (size);
+  if (!buffer) {
+    perror ("Allocate echo buffer");
+    return -EXIT_FAILURE;
+  }
+  /* echo until the client closes */
+  while (conn_recv_all (c, buffer, size) == 0) {
+    if (conn_send (c, buffer, size) != (ssize_t) size) {
+      printf ("Failed to echo the request.\n");
+      break;
+    }
+  }
+  if (!c->microtcp) {
+    close (c->fd);
+  }
+  free (buffer);
+  return 0;
+}
+
+static void
+print_histogram (const char *title, const histogram_t *h, int machine, const char *prefix)
+{
+  if (machine) {
+    printf ("result %sp50_us=%.3f %sp90_us=%.3f %sp99_us=%.3f %sp999_us=%.3f %smax_us=%.3f\n",
+            prefix, histogram_percentile (h, 50) / 1e3,
+            prefix, histogram_percentile (h, 90) / 1e3,
+            prefix, histogram_percentile (h, 99) / 1e3,
+            prefix, histogram_percentile (h, 99.9) / 1e3,
+            prefix, h->max / 1e3);
+    return;
+  }
+  printf ("%s (%llu samples, us)\n", title, (unsigned long long) h->total);
+  printf ("  min %10.3f  p50 %10.3f  p90 %10.3f  p99 %10.3f  p99.9 %10.3f  max %10.3f\n",
+          h->min / 1e3, histogram_percentile (h, 50) / 1e3,
+          histogram_percentile (h, 90) / 1e3, histogram_percentile (h, 99) / 1e3,
+          histogram_percentile (h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static int
+client (conn_t *c, const char *serverip, uint16_t port, size_t size,
+        uint64_t count, uint64_t warmup, double rate, int machine)
+{
+  struct sockaddr_in sin;
+  histogram_t raw, corrected, warm;
+  uint8_t *request, *reply;
+  uint64_t i, start, due = 0, sent, done, interval = 0, total_ns = 0, t0;
+  int one = 1, ret = -EXIT_FAILURE;
+
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = inet_addr (serverip);
+
+  if (c->microtcp) {
+    c->sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (c->sock.sd < 0
+        || microtcp_connect (&c->sock, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || microtcp_set_message_mode (&c->sock, c->message) < 0) {
+      return -EXIT_FAILURE;
+    }
+  } else {
+    c->fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c->fd < 0 || connect (c->fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+      perror ("TCP connect");
+      return -EXIT_FAILURE;
+    }
+    setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  request = malloc (size);
+  reply = malloc (size);
+  if (!request || !reply || histogram_init (&raw, HIST_SUB_BITS) < 0
+      || histogram_init (&corrected, HIST_SUB_BITS) < 0
+      || histogram_init (&warm, HIST_SUB_BITS) < 0) {
+    perror ("Allocate client state");
+    exit (EXIT_FAILURE);
+  }
+  memset (request, 0xa5, size);
+
+  /* warm-up, also gives the expected interval of the closed loop */
+  for (i = 0; i < warmup; i++) {
+    t0 = now_ns ();
+    if (conn_send (c, request, size) != (ssize_t) size || conn_recv_all (c, reply, size) < 0) {
+      printf ("Connection failed during the warm-up.\n");
+      goto out;
+    }
+    histogram_record (&warm, now_ns () - t0);
+  }
+  if (rate > 0) {
+    interval = (uint64_t) (1e9 / rate);
+  } else if (warmup) {
+    interval = histogram_percentile (&warm, 50);
+  }
+
+  start = now_ns ();
+  for (i = 0; i < count; i++) {
+    if (rate > 0) {
+      due = start + i * interval;
+      if (now_ns () < due) {
+        sleep_until (due);
+      }
+    }
+    sent = now_ns ();
+    if (conn_send (c, request, size) != (ssize_t) size || conn_recv_all (c, reply, size) < 0) {
+      printf ("Connection failed after %llu requests.\n", (unsigned long long) i);
+      goto out;
+    }
+    done = now_ns ();
+    histogram_record (&raw, done - sent);
+    if (rate > 0) {
+      histogram_record (&corrected, done - due);
+    } else {
+      histogram_record_corrected (&corrected, done - sent, interval);
+    }
+    total_ns += done - sent;
+  }
+
+  if (machine) {
+    printf ("result count=%llu size=%zu mean_us=%.3f achieved_rate=%.1f\n",
+            (unsigned long long) count, size, count ? total_ns / 1e3 / count : 0.0,
+            count / ((now_ns () - start) / 1e9));
+  } else {
+    printf ("%llu requests of %zu bytes, %s, mean %.3f us, %.1f req/s\n",
+            (unsigned long long) count, size, rate > 0 ? "fixed rate" : "closed loop",
+            count ? total_ns / 1e3 / count : 0.0, count / ((now_ns () - start) / 1e9));
+  }
+  print_histogram ("Round trip", &raw, machine, "");
+  if (interval) {
+    print_histogram (rate > 0 ? "Round trip from the scheduled send (corrected)"
+                     : "Round trip, coordinated omission corrected", &corrected, machine, "corr_");
+  }
+  ret = 0;
+
+out:
+  conn_close (c);
+  histogram_free (&raw);
+  histogram_free (&corrected);
+  histogram_free (&warm);
+  free (request);
+  free (reply);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, is_server = 0, machine = 0, exit_code;
+  int port = PORT;
+  char *ipstr = NULL;
+  size_t size = 64;
+  uint64_t count = 10000, warmup = 1000;
+  double rate = 0;
+  conn_t conn;
+
+  memset (&conn, 0, sizeof(conn));
+  while ((opt = getopt (argc, argv, "hsmMrp:a:S:n:w:R:")) != -1) {
+    switch (opt)
+      {
+      case 's':
+        is_server = 1;
+        break;
+      case 'm':
+        conn.microtcp = 1;
+        break;
+      case 'M':
+        conn.message = 1;
+        break;
+      case 'r':
+        machine = 1;
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'S':
+        size = strtoul (optarg, NULL, 10);
+        break;
+      case 'n':
+        count = strtoull (optarg, NULL, 10);
+        break;
+      case 'w':
+        warmup = strtoull (optarg, NULL, 10);
+        break;
+      case 'R':
+        rate = atof (optarg);
+        break;
+      default:
+        printf (
+            "Usage: latency_test [-s] [-m] [-M] -p port [-a ip] [-S size] [-n count] [-R rate]\n"
+            "Options:\n"
+            "   -s                  If set, the program runs as the echo server. Otherwise as client.\n"
+            "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -M                  microTCP message mode, one microtcp_recv() per request. Both ends.\n"
+            "   -p <int>            The listening port of the server (default 8080)\n"
+            "   -a <string>         The IP address of the server. Ignored in server mode.\n"
+            "   -S <int>            Request and reply size in bytes, the same on both ends (default 64)\n"
+            "   -n <int>            Number of measured requests (default 10000)\n"
+            "   -w <int>            Warm-up requests, not measured (default 1000)\n"
+            "   -R <float>          Requests per second on a fixed schedule. Closed loop if not set.\n"
+            "   -r                  Print the results as \"result key=value ...\" lines\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (!size) {
+    printf ("The message size must not be 0.\n");
+    exit (EXIT_FAILURE);
+  }
+  if (conn.message && !conn.microtcp) {
+    printf ("-M works with microTCP (-m).\n");
+    exit (EXIT_FAILURE);
+  }
+  if (is_server) {
+    exit_code = server (&conn, port, size);
+  } else {
+    if (!ipstr) {
+      printf ("The client needs the server address (-a).\n");
+      exit (EXIT_FAILURE);
+    }
+    exit_code = client (&conn, ipstr, port, size, count, warmup, rate, machine);
+  }
+
+  free (ipstr);
+  return exit_code;
+}
@@ -0,0 +1,509 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the per-segment work of the protocol engine, without
+ * any syscall: checksums, header encode/decode, segmentation, ACK
+ * processing and reassembly. They call the same inline code as the
+ * library (lib/segment.h, utils/reasm.h).
+ *
+ * Every case is warmed up and sized so one repetition takes about
+ * -t ms, then repeated -r times. Reported are the median and the minimum
+ * ns/op, the spread (median absolute deviation, in % of the median) and
+ * bytes/cycle. Cycles are TSC reference cycles on x86; elsewhere they are
+ * left out. Pin the process (taskset) and fix the CPU frequency for
+ * numbers worth comparing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "../lib/segment.h"
+#include "../utils/reasm.h"
+
+#define SEGMENT_BUF_LEN (1024 * 1024)
+#define ACK_BATCH 1024
+#define REASM_BATCH 8
+#define MAX_REPS 101
+#define MAX_ITERS (1UL << 28)   /* a case that never fills the target stops here */
+
+typedef struct
+{
+  const char *name;
+  size_t bytes;                 /* payload bytes handled per op, 0 if none */
+  void (*run) (size_t iters);
+} bench_t;
+
+static volatile uint64_t sink;  /* keeps the results alive */
+static uint8_t *data;
+static size_t crc_len;
+static double tsc_per_ns;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+cycles (void)
+{
+#if HAVE_TSC
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+/* ------------------------------ cases ------------------------------ */
+
+static void
+run_crc32 (size_t iters)
+{
+  uint64_t acc = 0;
+  size_t i;
+  for (i = 0; i < iters; i++) {
+    acc += crc32 (data + (i & 63), crc_len);
+  }
+  sink = acc;
+}
+
+/* header and payload as two progressive steps, like a segment */
+static void
+run_update_crc32 (size_t iters)
+{
+  microtcp_header_t header;
+  uint64_t acc = 0;
+  uint32_t crc;
+  size_t i;
+
+  memset (&header, 0, sizeof(header));
+  for (i = 0; i < iters; i++) {
+    header.seq_number = i;
+    crc = update_crc32 (0xffffffff, (const uint8_t *) &header, sizeof(header));
+    acc += update_crc32 (crc, data, MICROTCP_MSS) ^ 0xffffffff;
+  }
+  sink = acc;
+}
+
+/* the byte swaps alone, no checksum */
+static void
+run_header_pack (size_t iters)
+{
+  microtcp_header_t header;
+  uint64_t acc = 0;
+  size_t i;
+
+  for (i = 0; i < iters; i++) {
+    header.seq_number = htonl (i);
+    header.ack_number = htonl (i * 7);
+    header.control    = htons (ACK);
+    header.window     = htons (MICROTCP_WIN_SIZE);
+    header.data_len   = htonl (MICROTCP_MSS);
+    header.checksum   = htonl (i * 13);
+    __asm__ __volatile__ ("" : : "r" (&header) : "memory");
+    acc += header.seq_number;
+  }
+  sink = acc;
+}
+
+static void
+run_header_unpack (size_t iters)
+{
+  microtcp_header_t header;
+  uint64_t acc = 0;
+  size_t i;
+
+  memset (&header, 0, sizeof(header));
+  for (i = 0; i < iters; i++) {
+    header.seq_number = i;
+    __asm__ __volatile__ ("" : : "r" (&header) : "memory");
+    acc += ntohl (header.seq_number) + ntohl (header.ack_number)
+        + ntohs (header.control) + ntohs (header.window)
+        + ntohl (header.data_len) + ntohl (header.checksum);
+  }
+  sink = acc;
+}
+
+static void
+run_encode_ack (size_t iters)
+{
+  microtcp_header_t header;
+  uint64_t acc = 0;
+  size_t i;
+  for (i = 0; i < iters; i++) {
+    segment_encode (&header, 1000, i, ACK, MICROTCP_WIN_SIZE, NULL, 0);
+    acc += header.checksum;
+  }
+  sink = acc;
+}
+
+static void
+run_verify_ack (size_t iters)
+{
+  microtcp_header_t proto, header;
+  uint64_t acc = 0;
+  size_t i;
+
+  segment_encode (&proto, 1000, 2000, ACK, MICROTCP_WIN_SIZE, NULL, 0);
+  for (i = 0; i < iters; i++) {
+    header = proto;
+    acc += segment_verify (&header, NULL, 0);
+  }
+  sink = acc;
+}
+
+static void
+run_encode_data (size_t iters)
+{
+  microtcp_header_t header;
+  uint64_t acc = 0;
+  size_t i;
+  for (i = 0; i < iters; i++) {
+    segment_encode (&header, i, 0, ACK, MICROTCP_WIN_SIZE, data, MICROTCP_MSS);
+    acc += header.checksum;
+  }
+  sink = acc;
+}
+
+/* what transmit() does per segment of a large buffer, minus sendmsg() */
+static void
+run_segmentation (size_t iters)
+{
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint64_t acc = 0;
+  size_t i, off, len;
+
+  for (i = 0; i < iters; i++) {
+    for (off = 0; off < SEGMENT_BUF_LEN; off += len) {
+      len = SEGMENT_BUF_LEN - off < MICROTCP_MSS ? SEGMENT_BUF_LEN - off : MICROTCP_MSS;
+      segment_encode (&header, off, 0, ACK, MICROTCP_WIN_SIZE, data + off, len);
+      iov[0].iov_base = &header;
+      iov[0].iov_len  = sizeof(header);
+      iov[1].iov_base = data + off;
+      iov[1].iov_len  = len;
+      memset (&msg, 0, sizeof(msg));
+      msg.msg_iov    = iov;
+      msg.msg_iovlen = 2;
+      __asm__ __volatile__ ("" : : "r" (&msg) : "memory");
+      acc += header.checksum;
+    }
+  }
+  sink = acc;
+}
+
+/*
+ * verify a run of ACKs and hand them to ack_process(), the code
+ * tx_collect_acks() runs for every ACK: seven of eight advance by an
+ * MSS, the eighth is a duplicate
+ */
+static microtcp_header_t acks[ACK_BATCH];
+
+static void
+setup_acks (void)
+{
+  uint32_t ack = 0;
+  size_t i;
+  for (i = 0; i < ACK_BATCH; i++) {
+    if (i % 8 != 7) {
+      ack += MICROTCP_MSS;
+    }
+    segment_encode (&acks[i], 1, ack, ACK, MICROTCP_WIN_SIZE, NULL, 0);
+  }
+}
+
+static void
+run_ack_processing (size_t iters)
+{
+  microtcp_sock_t sock;
+  microtcp_header_t header;
+  tx_state_t tx;
+  size_t i;
+
+  memset (&sock, 0, sizeof(sock));
+  sock.mss = MICROTCP_MSS;
+  sock.ssthresh = 64 * MICROTCP_MSS;
+  for (i = 0; i < iters; i++) {
+    if (!(i % ACK_BATCH)) {
+      memset (&tx, 0, sizeof(tx));
+      tx.sent = tx.sent_max = ACK_BATCH * MICROTCP_MSS;
+      sock.cwnd = MICROTCP_INIT_CWND;
+    }
+    header = acks[i % ACK_BATCH];
+    if (!segment_verify (&header, NULL, 0) || !(ntohs (header.control) & ACK)) {
+      continue;
+    }
+    ack_process (&sock, &tx, &header, 0);
+  }
+  sink = sock.cwnd + sock.bytes_acked + sock.dup_acks;
+}
+
+/* a window of segments arrives in reverse order behind a hole, then the
+ * hole is filled and everything is delivered */
+static void
+run_reasm_reverse (size_t iters)
+{
+  reasm_t r;
+  uint32_t next = 0, seq;
+  uint64_t acc = 0;
+  size_t i;
+  int k;
+
+  reasm_clear (&r);
+  for (i = 0; i < iters; i++) {
+    for (k = REASM_BATCH - 1; k >= 1; k--) {
+      seq = next + k * MICROTCP_MSS;
+      reasm_insert (&r, seq, seq + MICROTCP_MSS);
+    }
+    next = reasm_deliver (&r, next + MICROTCP_MSS);
+    acc += next;
+  }
+  sink = acc;
+}
+
+/* every other segment is late: ranges pile up, then all merge */
+static void
+run_reasm_interleaved (size_t iters)
+{
+  reasm_t r;
+  uint32_t next = 0, seq;
+  uint64_t acc = 0;
+  size_t i;
+  int k;
+
+  reasm_clear (&r);
+  for (i = 0; i < iters; i++) {
+    for (k = 1; k < 2 * REASM_BATCH; k += 2) {
+      seq = next + k * MICROTCP_MSS;
+      reasm_insert (&r, seq, seq + MICROTCP_MSS);
+    }
+    for (k = 2; k < 2 * REASM_BATCH; k += 2) {
+      seq = next + k * MICROTCP_MSS;
+      reasm_insert (&r, seq, seq + MICROTCP_MSS);
+    }
+    next = reasm_deliver (&r, next + MICROTCP_MSS);
+    acc += next;
+  }
+  sink = acc;
+}
+
+/* the common case: every segment arrives in order and leaves at once */
+static void
+run_reasm_in_order (size_t iters)
+{
+  reasm_t r;
+  uint32_t next = 0;
+  uint64_t acc = 0;
+  size_t i;
+
+  reasm_clear (&r);
+  for (i = 0; i < iters; i++) {
+    reasm_insert (&r, next, next + MICROTCP_MSS);
+    next = reasm_deliver (&r, next);
+    acc += next;
+  }
+  sink = acc;
+}
+
+/* ----------------------------- harness ----------------------------- */
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void
+calibrate_tsc (void)
+{
+#if HAVE_TSC
+  uint64_t t0 = now_ns (), c0 = cycles (), t1, c1;
+  do {
+    t1 = now_ns ();
+  } while (t1 - t0 < 50000000ULL);
+  c1 = cycles ();
+  tsc_per_ns = (double) (c1 - c0) / (t1 - t0);
+#endif
+}
+
+static void
+measure (const bench_t *b, int reps, double target_ns)
+{
+  double ns[MAX_REPS], cyc[MAX_REPS], dev[MAX_REPS];
+  double median, mad, cycles_op;
+  uint64_t t0, c0, elapsed;
+  size_t iters = 1, next;
+  int i;
+
+  /* warm up and find an iteration count that fills the target time */
+  while (1) {
+    t0 = now_ns ();
+    b->run (iters);
+    elapsed = now_ns () - t0;
+    if (elapsed >= target_ns || iters >= MAX_ITERS) {
+      break;
+    }
+    /* extrapolate, but never by more than 100x off a tiny sample */
+    next = elapsed ? (size_t) (iters * target_ns / elapsed * 1.1) : iters * 100;
+    iters = next > iters * 100 ? iters * 100 : next > iters ? next : iters + 1;
+    if (iters > MAX_ITERS) {
+      iters = MAX_ITERS;
+    }
+  }
+  b->run (iters);
+
+  for (i = 0; i < reps; i++) {
+    t0 = now_ns ();
+    c0 = cycles ();
+    b->run (iters);
+    cyc[i] = (double) (cycles () - c0) / iters;
+    ns[i] = (double) (now_ns () - t0) / iters;
+  }
+  qsort (ns, reps, sizeof(double), cmp_double);
+  qsort (cyc, reps, sizeof(double), cmp_double);
+  median = ns[reps / 2];
+  for (i = 0; i < reps; i++) {
+    dev[i] = ns[i] > median ? ns[i] - median : median - ns[i];
+  }
+  qsort (dev, reps, sizeof(double), cmp_double);
+  mad = dev[reps / 2];
+  cycles_op = cyc[reps / 2];
+
+  printf ("%-28s %12.2f %12.2f %7.2f%%", b->name, median, ns[0], 100.0 * mad / median);
+  if (HAVE_TSC) {
+    printf (" %12.1f", cycles_op);
+  } else {
+    printf (" %12s", "-");
+  }
+  if (b->bytes && HAVE_TSC) {
+    printf (" %10.3f", b->bytes / cycles_op);
+  } else if (b->bytes) {
+    printf (" %10s", "-");
+  }
+  if (b->bytes) {
+    printf (" %10.1f", b->bytes / median * 1e9 / (1024.0 * 1024.0));
+  }
+  printf ("\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  static const size_t crc_sizes[] = { 16, 64, 256, MICROTCP_MSS, 4096, 65536 };
+  static char crc_names[sizeof(crc_sizes) / sizeof(crc_sizes[0])][32];
+  bench_t cases[] = {
+    { "update_crc32 hdr+MSS", sizeof(microtcp_header_t) + MICROTCP_MSS, run_update_crc32 },
+    { "header pack (swaps)", 0, run_header_pack },
+    { "header unpack (swaps)", 0, run_header_unpack },
+    { "segment_encode ACK", 0, run_encode_ack },
+    { "segment_verify ACK", 0, run_verify_ack },
+    { "segment_encode MSS", MICROTCP_MSS, run_encode_data },
+    { "segmentation 1MiB", SEGMENT_BUF_LEN, run_segmentation },
+    { "ack processing", 0, run_ack_processing },
+    { "reasm in order", 0, run_reasm_in_order },
+    { "reasm reverse x8", 0, run_reasm_reverse },
+    { "reasm interleaved x16", 0, run_reasm_interleaved },
+  };
+  const char *filter = NULL;
+  double target_ms = 20;
+  int opt, reps = 15;
+  size_t i;
+  bench_t crc;
+
+  while ((opt = getopt (argc, argv, "hr:t:f:")) != -1) {
+    switch (opt)
+      {
+      case 'r':
+        reps = atoi (optarg);
+        break;
+      case 't':
+        target_ms = atof (optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      default:
+        printf (
+            "Usage: microbench [-r reps] [-t ms] [-f filter]\n"
+            "Options:\n"
+            "   -r <int>            Repetitions per case (default 15, at most %d)\n"
+            "   -t <ms>             Length of one repetition (default 20)\n"
+            "   -f <string>         Only run the cases whose name contains it\n"
+            "   -h                  prints this help\n", MAX_REPS);
+        exit (EXIT_FAILURE);
+      }
+  }
+  if (reps < 1 || reps > MAX_REPS) {
+    fprintf (stderr, "microbench: repetitions must be in [1, %d]\n", MAX_REPS);
+    exit (EXIT_FAILURE);
+  }
+
+  data = malloc (SEGMENT_BUF_LEN + 64);
+  if (!data) {
+    perror ("Allocate benchmark buffer");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < SEGMENT_BUF_LEN + 64; i++) {
+    data[i] = i * 131 + 7;
+  }
+  setup_acks ();
+  calibrate_tsc ();
+
+  if (HAVE_TSC) {
+    printf ("TSC at %.3f GHz\n", tsc_per_ns);
+  }
+  printf ("%-28s %12s %12s %8s %12s %10s %10s\n", "case", "median ns/op",
+          "min ns/op", "spread", "cycles/op", "bytes/cyc", "MiB/s");
+  for (i = 0; i < sizeof(crc_sizes) / sizeof(crc_sizes[0]); i++) {
+    snprintf (crc_names[i], sizeof(crc_names[i]), "crc32 %zu B", crc_sizes[i]);
+    crc.name = crc_names[i];
+    crc.bytes = crc_sizes[i];
+    crc.run = run_crc32;
+    crc_len = crc_sizes[i];
+    if (!filter || strstr (crc.name, filter)) {
+      measure (&crc, reps, target_ms * 1e6);
+    }
+  }
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (!filter || strstr (cases[i].name, filter)) {
+      measure (&cases[i], reps, target_ms * 1e6);
+    }
+  }
+
+  free (data);
+  return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput scaling with the number of concurrent flows. Every flow is
+ * a sender and a receiver on loopback, flow i on port p+i. The senders
+ * push data for -d seconds and the receivers count it. For each N in the
+ * -N list the benchmark reports the aggregate goodput, the slowest,
+ * median and fastest flow, Jain's fairness index and the CPU seconds
+ * both ends spent per GB delivered.
+ *
+ * The flows of a point run as threads of this process, or with -P as
+ * one process per flow, which keeps them off each other's locks and
+ * allocator. -C n pins flow i to CPU i % n.
+ *
+ *   scale_bench -m -N 1,2,4,8,16,64,256 -d 3
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define PORT 8080
+#define MAX_FLOWS 1024
+
+typedef struct
+{
+  int microtcp;
+  int id;
+  int cpu;                      /**< -1 when not pinned */
+  uint16_t port;
+  size_t chunk;
+  uint64_t deadline_ns;
+  uint64_t bytes;               /**< delivered to the receiver */
+  uint64_t start_ns;            /**< receiver side: connection up */
+  uint64_t end_ns;              /**< receiver side: FIN seen */
+  int failed;
+} flow_t;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double
+tv_seconds (struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+pin (int cpu)
+{
+  cpu_set_t set;
+
+  if (cpu < 0) {
+    return;
+  }
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  pthread_setaffinity_np (pthread_self (), sizeof(set), &set);
+}
+
+static void *
+receiver (void *arg)
+{
+  flow_t *f = arg;
+  struct sockaddr_in sin, peer;
+  socklen_t peer_len = sizeof(peer);
+  microtcp_sock_t sock;
+  uint8_t *buffer;
+  ssize_t ret;
+  int lfd, fd = -1, one = 1;
+
+  pin (f->cpu);
+  buffer = malloc (f->chunk);
+  if (!buffer) {
+    f->failed = 1;
+    return NULL;
+  }
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (f->port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (f->microtcp) {
+    sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock.sd < 0
+        || microtcp_bind (&sock, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || microtcp_accept (&sock, (struct sockaddr *) &peer, sizeof(peer)) < 0) {
+      f->failed = 1;
+      free (buffer);
+      return NULL;
+    }
+  } else {
+    lfd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (lfd >= 0) {
+      setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (lfd < 0 || bind (lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+        || listen (lfd, 1) < 0 || (fd = accept (lfd, (struct sockaddr *) &peer, &peer_len)) < 0) {
+      perror ("TCP receiver");
+      f->failed = 1;
+      free (buffer);
+      return NULL;
+    }
+    close (lfd);
+  }
+
+  f->start_ns = now_ns ();
+  for (;;) {
+    if (f->microtcp) {
+      ret = microtcp_recv (&sock, buffer, f->chunk, 0);
+    } else {
+      ret = read (fd, buffer, f->chunk);
+    }
+    if (ret <= 0) {
+      break;
+    }
+    f->bytes += ret;
+  }
+  f->end_ns = now_ns ();
+
+  if (ret < 0) {
+    f->failed = 1;
+  }
+  if (f->microtcp) {
+    microtcp_close (&sock);
+  } else {
+    close (fd);
+  }
+  free (buffer);
+  return NULL;
+}
+
+static void
+sender (flow_t *f)
+{
+  struct sockaddr_in sin;
+  microtcp_sock_t sock;
+  uint8_t *buffer;
+  ssize_t ret;
+  int fd = -1;
+
+  pin (f->cpu);
+  buffer = malloc (f->chunk);
+  if (!buffer) {
+    f->failed = 1;
+    return;
+  }
+  memset (buffer, 0x5a, f->chunk);
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (f->port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (f->microtcp) {
+    sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock.sd < 0
+        || microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+      f->failed = 1;
+      free (buffer);
+      return;
+    }
+  } else {
+    /* the receiver may not be listening yet */
+    for (;;) {
+      fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (fd < 0) {
+        f->failed = 1;
+        free (buffer);
+        return;
+      }
+      if (connect (fd, (struct sockaddr *) &sin, sizeof(sin)) == 0) {
+        break;
+      }
+      close (fd);
+      if (errno != ECONNREFUSED || now_ns () > f->deadline_ns) {
+        perror ("TCP sender");
+        f->failed = 1;
+        free (buffer);
+        return;
+      }
+      usleep (1000);
+    }
+  }
+
+  while (now_ns () < f->deadline_ns) {
+    if (f->microtcp) {
+      ret = microtcp_send (&sock, buffer, f->chunk, 0);
+    } else {
+      ret = write (fd, buffer, f->chunk);
+    }
+    if (ret <= 0) {
+      f->failed = 1;
+      break;
+    }
+  }
+
+  if (f->microtcp) {
+    microtcp_shutdown (&sock, SHUT_RDWR);
+    microtcp_close (&sock);
+  } else {
+    shutdown (fd, SHUT_WR);
+    close (fd);
+  }
+  free (buffer);
+}
+
+static void *
+sender_thread (void *arg)
+{
+  sender ((flow_t *) arg);
+  return NULL;
+}
+
+/* runs every flow as a pair of threads of this process */
+static void
+run_threads (flow_t *flows, int n)
+{
+  pthread_t *threads = calloc (2 * n, sizeof(pthread_t));
+  int i;
+
+  if (!threads) {
+    perror ("Allocate threads");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++) {
+    pthread_create (&threads[2 * i], NULL, receiver, &flows[i]);
+  }
+  for (i = 0; i < n; i++) {
+    pthread_create (&threads[2 * i + 1], NULL, sender_thread, &flows[i]);
+  }
+  for (i = 0; i < 2 * n; i++) {
+    pthread_join (threads[i], NULL);
+  }
+  free (threads);
+}
+
+/* runs every flow in a child process, which sends its flow_t back over
+ * a pipe. the CPU time of the children is added to ours */
+static void
+run_processes (flow_t *flows, int n, struct rusage *children)
+{
+  struct rusage ru;
+  pthread_t rx;
+  pid_t pid;
+  int i, fds[2];
+
+  memset (children, 0, sizeof(struct rusage));
+  if (pipe (fds) < 0) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++) {
+    pid = fork ();
+    if (pid < 0) {
+      perror ("fork");
+      flows[i].failed = 1;
+      continue;
+    }
+    if (pid == 0) {
+      close (fds[0]);
+      pthread_create (&rx, NULL, receiver, &flows[i]);
+      sender (&flows[i]);
+      pthread_join (rx, NULL);
+      if (write (fds[1], &flows[i], sizeof(flow_t)) != sizeof(flow_t)) {
+        _exit (EXIT_FAILURE);
+      }
+      _exit (EXIT_SUCCESS);
+    }
+  }
+  close (fds[1]);
+
+  {
+    flow_t f;
+    while (read (fds[0], &f, sizeof(f)) == sizeof(f)) {
+      if (f.id >= 0 && f.id < n) {
+        flows[f.id] = f;
+      }
+    }
+  }
+  close (fds[0]);
+  while ((pid = wait4 (-1, NULL, 0, &ru)) > 0) {
+    timeradd (&children->ru_utime, &ru.ru_utime, &children->ru_utime);
+    timeradd (&children->ru_stime, &ru.ru_stime, &children->ru_stime);
+  }
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static int
+run_point (int microtcp, int n, uint16_t port, size_t chunk, double duration,
+           int processes, int ncpus, int machine, int verbose)
+{
+  struct rusage before, after, children;
+  flow_t *flows;
+  double *rate, sum = 0, sum_sq = 0, jain, cpu, aggregate, span;
+  uint64_t bytes = 0, first = UINT64_MAX, last = 0, deadline;
+  int i, failed = 0;
+
+  flows = calloc (n, sizeof(flow_t));
+  rate = calloc (n, sizeof(double));
+  if (!flows || !rate) {
+    perror ("Allocate flows");
+    return -1;
+  }
+  deadline = now_ns () + (uint64_t) (duration * 1e9);
+  for (i = 0; i < n; i++) {
+    flows[i].microtcp = microtcp;
+    flows[i].id = i;
+    flows[i].cpu = ncpus > 0 ? i % ncpus : -1;
+    flows[i].port = port + i;
+    flows[i].chunk = chunk;
+    flows[i].deadline_ns = deadline;
+  }
+
+  getrusage (RUSAGE_SELF, &before);
+  if (processes) {
+    run_processes (flows, n, &children);
+  } else {
+    memset (&children, 0, sizeof(children));
+    run_threads (flows, n);
+  }
+  getrusage (RUSAGE_SELF, &after);
+  cpu = tv_seconds (after.ru_utime) - tv_seconds (before.ru_utime)
+      + tv_seconds (after.ru_stime) - tv_seconds (before.ru_stime)
+      + tv_seconds (children.ru_utime) + tv_seconds (children.ru_stime);
+
+  for (i = 0; i < n; i++) {
+    span = flows[i].end_ns > flows[i].start_ns
+        ? (flows[i].end_ns - flows[i].start_ns) / 1e9 : 0;
+    rate[i] = span > 0 ? flows[i].bytes / span / 1e6 : 0;
+    sum += rate[i];
+    sum_sq += rate[i] * rate[i];
+    bytes += flows[i].bytes;
+    failed += flows[i].failed;
+    if (flows[i].start_ns && flows[i].start_ns < first) {
+      first = flows[i].start_ns;
+    }
+    if (flows[i].end_ns > last) {
+      last = flows[i].end_ns;
+    }
+    if (verbose) {
+      fprintf (stderr, "  flow %d: %llu bytes, %.2f MB/s%s\n", i,
+               (unsigned long long) flows[i].bytes, rate[i],
+               flows[i].failed ? " (failed)" : "");
+    }
+  }
+  /* Jain's index: 1 when all flows get the same, 1/n when one gets it all */
+  jain = sum_sq > 0 ? sum * sum / (n * sum_sq) : 0;
+  aggregate = last > first ? bytes / ((last - first) / 1e9) / 1e6 : 0;
+  qsort (rate, n, sizeof(double), cmp_double);
+
+  if (machine) {
+    printf ("result flows=%d bytes=%llu aggregate_mbps=%.2f flow_min_mbps=%.2f "
+            "flow_median_mbps=%.2f flow_max_mbps=%.2f jain=%.4f cpu_s=%.3f "
+            "cpu_s_per_gb=%.3f failed=%d\n",
+            n, (unsigned long long) bytes, aggregate, rate[0], rate[n / 2],
+            rate[n - 1], jain, cpu, bytes ? cpu / (bytes / 1e9) : 0, failed);
+  } else {
+    printf ("%6d %12.2f %10.2f %10.2f %10.2f %8.4f %10.3f %7d\n", n, aggregate,
+            rate[0], rate[n / 2], rate[n - 1], jain,
+            bytes ? cpu / (bytes / 1e9) : 0, failed);
+  }
+  fflush (stdout);
+  free (flows);
+  free (rate);
+  return failed ? -1 : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, microtcp = 0, machine = 0, verbose = 0, processes = 0, ncpus = 0;
+  int port = PORT, n, ret = 0;
+  size_t chunk = 64 * 1024;
+  double duration = 3;
+  char *list = strdup ("1,2,4,8,16,32,64,128,256"), *tok, *save;
+
+  while ((opt = getopt (argc, argv, "hmrvPp:N:d:S:C:")) != -1) {
+    switch (opt)
+      {
+      case 'm':
+        microtcp = 1;
+        break;
+      case 'r':
+        machine = 1;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 'P':
+        processes = 1;
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'N':
+        free (list);
+        list = strdup (optarg);
+        break;
+      case 'd':
+        duration = atof (optarg);
+        break;
+      case 'S':
+        chunk = strtoul (optarg, NULL, 10);
+        break;
+      case 'C':
+        ncpus = atoi (optarg);
+        break;
+      default:
+        printf (
+            "Usage: scale_bench [-m] [-N flows,...] [-d seconds] [-S chunk] [-P] [-C cpus] [-p port]\n"
+            "Options:\n"
+            "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -N <list>           Comma separated flow counts to run (default 1,2,4,...,256)\n"
+            "   -d <float>          Seconds every point sends for (default 3)\n"
+            "   -S <int>            Bytes per send and receive call (default 65536)\n"
+            "   -P                  One process per flow instead of one thread per end\n"
+            "   -C <int>            Pin flow i to CPU i %% n\n"
+            "   -p <int>            Base port, flow i uses port+i (default 8080)\n"
+            "   -r                  Print the results as \"result key=value ...\" lines\n"
+            "   -v                  Print every flow to stderr\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (!chunk) {
+    printf ("The chunk size must not be 0.\n");
+    exit (EXIT_FAILURE);
+  }
+  if (!machine) {
+    printf ("%6s %12s %10s %10s %10s %8s %10s %7s\n", "flows", "aggr MB/s",
+            "min MB/s", "med MB/s", "max MB/s", "jain", "cpu s/GB", "failed");
+  }
+  for (tok = strtok_r (list, ",", &save); tok; tok = strtok_r (NULL, ",", &save)) {
+    n = atoi (tok);
+    if (n < 1 || n > MAX_FLOWS || port + n > 65535) {
+      printf ("Skipping %s flows, 1 to %d are supported.\n", tok, MAX_FLOWS);
+      continue;
+    }
+    if (run_point (microtcp, n, port, chunk, duration, processes, ncpus,
+                   machine, verbose) < 0) {
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  free (list);
+  return ret;
+}
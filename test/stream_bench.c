@@ -0,0 +1,284 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Head-of-line blocking between transfers that share a connection. The
+ * client sends one large stream (id 0) and -k short ones (ids 1..k) over
+ * a single microTCP connection, all at once with microtcp_send_streams().
+ * With -q it sends them one after the other instead, the large one
+ * first, which is what a plain byte stream has to do. The server reports
+ * when each stream completed, counted from its first byte.
+ *
+ *   server:  stream_bench -s -p 8080
+ *   client:  stream_bench -a 127.0.0.1 -p 8080 -L 8388608 -k 8 -S 4096
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define PORT 8080
+#define MAX_STREAMS 1024
+
+typedef struct
+{
+  uint64_t bytes;
+  double done_ms;               /**< -1 while the stream is open */
+} stream_stat_t;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static int
+server (uint16_t port, int machine)
+{
+  microtcp_sock_t sock;
+  struct sockaddr_in sin, client_addr;
+  stream_stat_t stats[MAX_STREAMS];
+  uint8_t buffer[MICROTCP_MSS];
+  double small[MAX_STREAMS];
+  uint64_t start = 0, total = 0;
+  uint32_t id, nstreams = 0, nsmall = 0, i;
+  ssize_t ret;
+  int fin;
+
+  for (i = 0; i < MAX_STREAMS; i++) {
+    stats[i].bytes = 0;
+    stats[i].done_ms = -1;
+  }
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    return -EXIT_FAILURE;
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (microtcp_bind (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0
+      || microtcp_accept (&sock, (struct sockaddr *) &client_addr,
+                          sizeof(struct sockaddr_in)) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  while ((ret = microtcp_stream_recv (&sock, &id, buffer, sizeof(buffer), &fin)) > 0) {
+    if (!start) {
+      start = now_ns ();
+    }
+    total += ret;
+    if (id >= MAX_STREAMS) {
+      continue;
+    }
+    stats[id].bytes += ret;
+    if (fin) {
+      stats[id].done_ms = (now_ns () - start) / 1e6;
+    }
+    if (id + 1 > nstreams) {
+      nstreams = id + 1;
+    }
+  }
+  if (ret < 0) {
+    microtcp_shutdown (&sock, SHUT_RDWR);
+    microtcp_close (&sock);
+    return -EXIT_FAILURE;
+  }
+  microtcp_close (&sock);
+
+  for (i = 0; i < nstreams; i++) {
+    if (!machine) {
+      printf ("stream %4u: %10llu bytes, done at %9.3f ms\n", i,
+              (unsigned long long) stats[i].bytes, stats[i].done_ms);
+    }
+    if (i && stats[i].done_ms >= 0) {
+      small[nsmall++] = stats[i].done_ms;
+    }
+  }
+  qsort (small, nsmall, sizeof(double), cmp_double);
+
+  if (machine) {
+    printf ("result streams=%u bytes=%llu large_ms=%.3f", nstreams,
+            (unsigned long long) total, stats[0].done_ms);
+    if (nsmall) {
+      printf (" small_median_ms=%.3f small_max_ms=%.3f", small[nsmall / 2], small[nsmall - 1]);
+    }
+    printf ("\n");
+  } else {
+    printf ("Large stream done at %.3f ms", stats[0].done_ms);
+    if (nsmall) {
+      printf (", short streams: median %.3f ms, last %.3f ms",
+              small[nsmall / 2], small[nsmall - 1]);
+    }
+    printf ("\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+static int
+client (const char *ipstr, uint16_t port, size_t large, int nsmall, size_t small,
+        int sequential, int machine)
+{
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  microtcp_stream_t streams[MAX_STREAMS];
+  uint8_t *data;
+  uint64_t start;
+  int i, ret = EXIT_SUCCESS;
+
+  data = malloc (large > small ? large : small);
+  if (!data) {
+    perror ("Allocate the data");
+    return -EXIT_FAILURE;
+  }
+  memset (data, 'x', large > small ? large : small);
+
+  for (i = 0; i <= nsmall; i++) {
+    streams[i].id = i;
+    streams[i].buffer = data;
+    streams[i].length = i ? small : large;
+    streams[i].fin = 1;
+  }
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    free (data);
+    return -EXIT_FAILURE;
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = inet_addr (ipstr);
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0) {
+    microtcp_close (&sock);
+    free (data);
+    return -EXIT_FAILURE;
+  }
+
+  start = now_ns ();
+  if (sequential) {
+    for (i = 0; i <= nsmall; i++) {
+      if (microtcp_send_streams (&sock, &streams[i], 1) < 0) {
+        ret = -EXIT_FAILURE;
+        break;
+      }
+    }
+  } else if (microtcp_send_streams (&sock, streams, nsmall + 1) < 0) {
+    ret = -EXIT_FAILURE;
+  }
+  if (ret == EXIT_SUCCESS) {
+    printf (machine ? "result send_ms=%.3f\n" : "Sent everything in %.3f ms\n",
+            (now_ns () - start) / 1e6);
+  }
+
+  microtcp_shutdown (&sock, SHUT_RDWR);
+  microtcp_close (&sock);
+  free (data);
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, is_server = 0, sequential = 0, machine = 0, nsmall = 8, exit_code;
+  uint16_t port = PORT;
+  size_t large = 8 * 1024 * 1024, small = 4096;
+  char *ipstr = NULL;
+
+  while ((opt = getopt (argc, argv, "hsqrp:a:L:k:S:")) != -1) {
+    switch (opt)
+      {
+      case 's':
+        is_server = 1;
+        break;
+      case 'q':
+        sequential = 1;
+        break;
+      case 'r':
+        machine = 1;
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'L':
+        large = strtoul (optarg, NULL, 10);
+        break;
+      case 'k':
+        nsmall = atoi (optarg);
+        break;
+      case 'S':
+        small = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        printf (
+            "Usage: stream_bench [-s] -p port [-a ip] [-L bytes] [-k streams] [-S bytes] [-q]\n"
+            "Options:\n"
+            "   -s                  If set, the program runs as the server. Otherwise as client.\n"
+            "   -p <int>            The listening port of the server (default 8080)\n"
+            "   -a <string>         The IP address of the server. Ignored in server mode.\n"
+            "   -L <int>            Bytes of the large stream (default 8 MB)\n"
+            "   -k <int>            Number of short streams (default 8)\n"
+            "   -S <int>            Bytes of each short stream (default 4096)\n"
+            "   -q                  Send the streams one after the other, the large one first\n"
+            "   -r                  Print the results as \"result key=value ...\" lines\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (is_server) {
+    exit_code = server (port, machine);
+  } else {
+    if (!ipstr) {
+      printf ("The client needs the server address (-a).\n");
+      exit (EXIT_FAILURE);
+    }
+    if (nsmall < 0 || nsmall >= MAX_STREAMS || !large || (nsmall && !small)) {
+      printf ("Streams must not be empty and -k must be below %d.\n", MAX_STREAMS);
+      exit (EXIT_FAILURE);
+    }
+    exit_code = client (ipstr, port, large, nsmall, small, sequential, machine);
+  }
+
+  free (ipstr);
+  return exit_code;
+}
@@ -0,0 +1,100 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Turns a binary microTCP event trace (see microtcp_trace_dump()) into CSV,
+ * one event per line, ready for plotting cwnd and seq over time.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../utils/trace.h"
+
+static const char *
+event_name (uint8_t type)
+{
+  switch (type)
+    {
+    case TRACE_TX:
+      return "tx";
+    case TRACE_RETX:
+      return "retx";
+    case TRACE_RX:
+      return "rx";
+    case TRACE_ACK:
+      return "ack";
+    case TRACE_DUPACK:
+      return "dupack";
+    case TRACE_TIMEOUT:
+      return "timeout";
+    case TRACE_CWND:
+      return "cwnd";
+    case TRACE_WND:
+      return "wnd";
+    default:
+      return "unknown";
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *fp;
+  trace_file_header_t hdr;
+  trace_event_t e;
+  uint64_t i, t0 = 0;
+
+  if (argc != 2) {
+    printf ("Usage: trace_decode <trace file>\n"
+            "Prints the events of a microTCP trace dump as CSV.\n");
+    exit (EXIT_FAILURE);
+  }
+
+  fp = fopen (argv[1], "r");
+  if (!fp) {
+    perror ("Open trace file");
+    return -EXIT_FAILURE;
+  }
+
+  if (fread (&hdr, sizeof(hdr), 1, fp) != 1
+      || memcmp (hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))
+      || hdr.event_size != sizeof(trace_event_t)) {
+    fprintf (stderr, "%s: not a microTCP trace\n", argv[1]);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (hdr.dropped) {
+    fprintf (stderr, "%u older events were overwritten\n", hdr.dropped);
+  }
+
+  printf ("time_us,event,seq,ack,len,cwnd,window\n");
+  for (i = 0; i < hdr.count && fread (&e, sizeof(e), 1, fp) == 1; i++) {
+    if (!i) {
+      t0 = e.ts_ns;
+    }
+    printf ("%.3f,%s,%u,%u,%u,%u,%u\n", (e.ts_ns - t0) / 1000.0,
+            event_name (e.type), e.seq, e.ack, e.len, e.cwnd, e.window);
+  }
+
+  fclose (fp);
+  return 0;
+}
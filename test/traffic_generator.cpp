@@ -18,6 +18,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Application traffic source. Waits for traffic_generator_client on one
+ * or more ports and sends it messages. Arrival processes:
+ *
+ *   poisson   exponential inter-arrivals with mean -i ms
+ *   cbr       one message every -i ms
+ *   onoff     Pareto distributed ON and OFF periods (-O, -F ms, shape -k);
+ *             cbr at -i ms while ON. Heavy tailed for shapes below 2.
+ *   trace     replays -T file, lines of "time_ms,size"; -L loops it
+ *
+ * Message sizes (-s) are fixed:N, uniform:MIN:MAX, exp:MEAN,
+ * pareto:MEAN:SHAPE or lognormal:MEDIAN:SIGMA, bounded by -M. Every
+ * message starts with a traffic_msg_hdr_t. With -c N, N connections run
+ * in parallel on ports p..p+N-1, each from its own thread and seed.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +41,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <time.h>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <random>
 #include <chrono>
 #include <thread>
@@ -33,11 +56,46 @@ extern "C" {
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
 }
+#include "traffic_generator.h"
+
+#define MAX_MSG_LEN (1024 * 1024)
+#define SLEEP_SLICE_MS 100      /* how often a long sleep checks for Ctrl+C */
 
-#define BUF_LEN 2048
+typedef std::chrono::steady_clock clk;
 
-static bool stop_traffic = false;
+static std::atomic<bool> stop_traffic(false);
 
+enum arrival_t { ARRIVAL_POISSON, ARRIVAL_CBR, ARRIVAL_ONOFF, ARRIVAL_TRACE };
+enum size_dist_t { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP, SIZE_PARETO, SIZE_LOGNORMAL };
+
+struct trace_entry
+{
+  double time_ms;
+  size_t size;
+};
+
+struct workload
+{
+  arrival_t arrival = ARRIVAL_POISSON;
+  double inter_ms = 10;
+  double on_ms = 1000;          /* mean ON period */
+  double off_ms = 1000;         /* mean OFF period */
+  double shape = 1.5;           /* Pareto shape of the ON/OFF periods */
+  std::vector<trace_entry> trace;
+  bool loop_trace = false;
+
+  size_dist_t size_dist = SIZE_FIXED;
+  double size_a = TRAFFIC_MSG_LEN;
+  double size_b = 0;
+  size_t max_size = MAX_MSG_LEN;
+};
+
+struct conn_stats
+{
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  double seconds = 0;
+};
 
 void
 sig_handler(int signal)
@@ -48,63 +106,81 @@ sig_handler(int signal)
   }
 }
 
-int
-main (int argc, char **argv)
+/* Pareto with the given mean, the scale follows from mean and shape */
+static double
+pareto(std::mt19937_64 &gen, double mean, double shape)
+{
+  std::uniform_real_distribution<double> u(0.0, 1.0);
+  double xm = shape > 1 ? mean * (shape - 1) / shape : mean;
+  return xm / std::pow(1.0 - u(gen), 1.0 / shape);
+}
+
+static size_t
+next_size(const workload &w, std::mt19937_64 &gen)
+{
+  double v;
+
+  switch (w.size_dist) {
+  case SIZE_UNIFORM:
+    v = std::uniform_real_distribution<double>(w.size_a, w.size_b)(gen);
+    break;
+  case SIZE_EXP:
+    v = std::exponential_distribution<double>(1.0 / w.size_a)(gen);
+    break;
+  case SIZE_PARETO:
+    v = pareto(gen, w.size_a, w.size_b);
+    break;
+  case SIZE_LOGNORMAL:
+    v = std::lognormal_distribution<double>(std::log(w.size_a), w.size_b)(gen);
+    break;
+  default:
+    v = w.size_a;
+  }
+  if (v < sizeof(traffic_msg_hdr_t)) {
+    v = sizeof(traffic_msg_hdr_t);
+  }
+  return v > w.max_size ? w.max_size : (size_t) v;
+}
+
+/* sleeps in slices so Ctrl+C is noticed during long OFF periods */
+static bool
+sleep_until(clk::time_point t)
+{
+  while (!stop_traffic) {
+    clk::time_point slice = clk::now() + std::chrono::milliseconds(SLEEP_SLICE_MS);
+    if (t <= slice) {
+      std::this_thread::sleep_until(t);
+      return !stop_traffic;
+    }
+    std::this_thread::sleep_until(slice);
+  }
+  return false;
+}
+
+static void
+generate(int id, uint16_t port, const workload &w, uint64_t seed, conn_stats *stats)
 {
-  int                   opt;
-  int                   ret;
-  int                   port;
-  int                   mean_inter;
   microtcp_sock_t       sock;
   struct sockaddr_in    sin;
   struct sockaddr       client_addr;
   socklen_t             client_addr_len;
-  struct sockaddr_in    *addr_in;
   char                  ip_addr[INET_ADDRSTRLEN];
-  char                  buffer[BUF_LEN];
-
-  /* Create the random generator */
-  std::random_device rd;
-  std::mt19937 gen(rd());
-
-  /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hp:i:")) != -1) {
-    switch (opt)
-      {
-      case 'p':
-        port = atoi (optarg);
-        /* To check or not to check? */
-        break;
-      case 'i':
-        /*
-         * Set the mean of the poisson distribution for the interarrivals
-         * in milliseconds (ms)
-         */
-        mean_inter = atoi (optarg);
-        break;
-      default:
-        printf (
-            "Usage: bandwidth_test -p port -i packet inter-arrival ms"
-            "Options:\n"
-            "   -p <int>            the port to wait for a peer"
-            "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution"
-            "   -h                  prints this help\n");
-        exit (EXIT_FAILURE);
-      }
-  }
-  std::poisson_distribution<int> dpoisson(mean_inter);
-  LOG_INFO("Creating traffic generator on port %d", port);
-  LOG_INFO("Poisson distribution inter-arrivals with mean %u ms", mean_inter);
-
-  /*
-   * Register a signal handler so we can terminate the generator with
-   * Ctrl+C
-   */
-  signal(SIGINT, sig_handler);
+  std::vector<uint8_t>  buffer(w.max_size);
+  traffic_msg_hdr_t     hdr;
+  uint64_t              seq = 0;
+  size_t                size, trace_pos = 0;
+  struct timespec       ts;
+  std::mt19937_64       gen(seed);
+  std::exponential_distribution<double> dexp(1.0 / w.inter_ms);
+  clk::time_point       next, on_end, start, trace_base;
+  double                gap_ms;
 
   /* Create a microtcp socket */
-  sock = microtcp_socket (AF_INET, 0, 0);
- /* TODO: some error checking here ??? */
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    LOG_ERROR("Connection %d: failed to create a socket", id);
+    return;
+  }
 
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
@@ -114,8 +190,8 @@ main (int argc, char **argv)
 
   if (microtcp_bind (&sock, (struct sockaddr *) &sin,
                      sizeof(struct sockaddr_in)) == -1) {
-    LOG_ERROR("Failed to bind");
-    return -EXIT_FAILURE;
+    LOG_ERROR("Connection %d: failed to bind port %d", id, port);
+    return;
   }
 
   /*
@@ -126,26 +202,262 @@ main (int argc, char **argv)
 
   /* Block waiting for a connection */
   client_addr_len = sizeof(struct sockaddr);
-  ret = microtcp_accept(&sock, &client_addr, client_addr_len);
-  if(ret != 0) {
-    LOG_ERROR("Failed to accept connection");
-    return -EXIT_FAILURE;
+  if (microtcp_accept(&sock, &client_addr, client_addr_len) != 0) {
+    LOG_ERROR("Connection %d: failed to accept", id);
+    return;
   }
 
-  addr_in = (struct sockaddr_in *) &client_addr;
-  inet_ntop(AF_INET, &(addr_in->sin_addr), ip_addr, INET_ADDRSTRLEN);
-  LOG_INFO("Peer %s connected.", ip_addr);
+  inet_ntop(AF_INET, &(((struct sockaddr_in *) &client_addr)->sin_addr), ip_addr, INET_ADDRSTRLEN);
+  LOG_INFO("Connection %d: peer %s connected on port %d.", id, ip_addr, port);
   std::this_thread::sleep_for (std::chrono::seconds(1));
-  LOG_INFO("Start generating traffic...");
+
+  start = clk::now();
+  next = start;
+  trace_base = start;
+  on_end = start + std::chrono::duration_cast<clk::duration>(
+      std::chrono::duration<double, std::milli>(pareto(gen, w.on_ms, w.shape)));
 
   while(stop_traffic == false) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
-    microtcp_send(&sock, buffer, BUF_LEN, 0);
+    /* when does the next message go out */
+    switch (w.arrival) {
+    case ARRIVAL_CBR:
+      gap_ms = w.inter_ms;
+      break;
+    case ARRIVAL_ONOFF:
+      gap_ms = w.inter_ms;
+      break;
+    case ARRIVAL_TRACE:
+      if (trace_pos == w.trace.size()) {
+        if (!w.loop_trace || w.trace.empty()) {
+          goto done;
+        }
+        trace_pos = 0;
+        trace_base = next;
+      }
+      gap_ms = 0;
+      next = trace_base + std::chrono::duration_cast<clk::duration>(
+          std::chrono::duration<double, std::milli>(w.trace[trace_pos].time_ms));
+      break;
+    default:
+      gap_ms = dexp(gen);
+    }
+    next += std::chrono::duration_cast<clk::duration>(
+        std::chrono::duration<double, std::milli>(gap_ms));
+    if (w.arrival == ARRIVAL_ONOFF && next >= on_end) {
+      /* the ON period is over, stay silent for an OFF period */
+      next = on_end + std::chrono::duration_cast<clk::duration>(
+          std::chrono::duration<double, std::milli>(pareto(gen, w.off_ms, w.shape)));
+      on_end = next + std::chrono::duration_cast<clk::duration>(
+          std::chrono::duration<double, std::milli>(pareto(gen, w.on_ms, w.shape)));
+    }
+    if (!sleep_until(next)) {
+      break;
+    }
+
+    size = w.arrival == ARRIVAL_TRACE ? w.trace[trace_pos++].size : next_size(w, gen);
+    if (size < sizeof(hdr)) {
+      size = sizeof(hdr);
+    }
+    if (size > w.max_size) {
+      size = w.max_size;
+    }
+
+    /* stamp the message for the jitter measurement of the client */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.seq = htobe64(seq++);
+    hdr.sent_ns = htobe64((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    hdr.len = htonl(size);
+    memcpy(buffer.data(), &hdr, sizeof(hdr));
+    if (microtcp_send(&sock, buffer.data(), size, 0) < 0) {
+      LOG_INFO("Connection %d: the peer closed the connection", id);
+      break;
+    }
+    stats->messages++;
+    stats->bytes += size;
   }
 
-  LOG_INFO("Going to terminate microtcp connection...");
+done:
+  stats->seconds = std::chrono::duration<double>(clk::now() - start).count();
+  LOG_INFO("Connection %d: going to terminate microtcp connection...", id);
 
   /* SHUT_RDWR can be omitted internally */
-  microtcp_shutdown(&sock, SHUT_RDWR);
+  if (sock.state == ESTABLISHED) {
+    microtcp_shutdown(&sock, SHUT_RDWR);
+  }
+}
 
+static bool
+parse_size_dist(const char *spec, workload &w)
+{
+  std::string s(spec), kind = s.substr(0, s.find(':'));
+  double a = 0, b = 0;
+  int n = sscanf(spec + (s.find(':') == std::string::npos ? s.size() : s.find(':') + 1),
+                 "%lf:%lf", &a, &b);
+
+  if (kind == "fixed" && n >= 1) {
+    w.size_dist = SIZE_FIXED;
+  } else if (kind == "uniform" && n == 2 && b >= a) {
+    w.size_dist = SIZE_UNIFORM;
+  } else if (kind == "exp" && n >= 1) {
+    w.size_dist = SIZE_EXP;
+  } else if (kind == "pareto" && n == 2 && b > 0) {
+    w.size_dist = SIZE_PARETO;
+  } else if (kind == "lognormal" && n == 2) {
+    w.size_dist = SIZE_LOGNORMAL;
+  } else {
+    return false;
+  }
+  w.size_a = a;
+  w.size_b = b;
+  return a > 0;
+}
+
+static bool
+load_trace(const char *path, workload &w)
+{
+  std::ifstream in(path);
+  std::string line;
+  trace_entry e;
+
+  if (!in) {
+    return false;
+  }
+  while (std::getline(in, line)) {
+    if (sscanf(line.c_str(), "%lf,%zu", &e.time_ms, &e.size) == 2) {
+      w.trace.push_back(e);
+    }
+  }
+  /* the first entry starts the replay */
+  for (size_t i = 1; i < w.trace.size(); i++) {
+    w.trace[i].time_ms -= w.trace[0].time_ms;
+  }
+  if (!w.trace.empty()) {
+    w.trace[0].time_ms = 0;
+  }
+  return !w.trace.empty();
+}
+
+int
+main (int argc, char **argv)
+{
+  int                   opt;
+  int                   port = 8080;
+  int                   connections = 1;
+  uint64_t              seed = std::random_device()();
+  workload              w;
+  std::string           arrival = "poisson";
+
+  /* A very easy way to parse command line arguments */
+  while ((opt = getopt (argc, argv, "hp:i:c:A:O:F:k:T:Ls:M:z:")) != -1) {
+    switch (opt)
+      {
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'i':
+        /* mean inter-arrival time of the messages in milliseconds (ms) */
+        w.inter_ms = atof (optarg);
+        break;
+      case 'c':
+        connections = atoi (optarg);
+        break;
+      case 'A':
+        arrival = optarg;
+        break;
+      case 'O':
+        w.on_ms = atof (optarg);
+        break;
+      case 'F':
+        w.off_ms = atof (optarg);
+        break;
+      case 'k':
+        w.shape = atof (optarg);
+        break;
+      case 'T':
+        if (!load_trace (optarg, w)) {
+          LOG_ERROR("Cannot read a \"time_ms,size\" trace from %s", optarg);
+          exit (EXIT_FAILURE);
+        }
+        arrival = "trace";
+        break;
+      case 'L':
+        w.loop_trace = true;
+        break;
+      case 's':
+        if (!parse_size_dist (optarg, w)) {
+          LOG_ERROR("Bad size distribution %s", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'M':
+        w.max_size = strtoul (optarg, NULL, 10);
+        break;
+      case 'z':
+        seed = strtoull (optarg, NULL, 10);
+        break;
+      default:
+        printf (
+            "Usage: traffic_generator -p port [-c connections] [-A arrival] [-i ms] [-s sizes]\n"
+            "Options:\n"
+            "   -p <int>            the (first) port to wait for a peer (default 8080)\n"
+            "   -c <int>            parallel connections, on ports p..p+c-1 (default 1)\n"
+            "   -A <string>         arrival process: poisson, cbr, onoff or trace (default poisson)\n"
+            "   -i <float>          mean inter-arrival time in milliseconds (default 10)\n"
+            "   -O <float>          onoff: mean ON period in milliseconds (default 1000)\n"
+            "   -F <float>          onoff: mean OFF period in milliseconds (default 1000)\n"
+            "   -k <float>          onoff: Pareto shape of the periods (default 1.5)\n"
+            "   -T <file>           trace: replay \"time_ms,size\" lines from the file\n"
+            "   -L                  trace: start over at the end of the file\n"
+            "   -s <spec>           message sizes: fixed:N, uniform:MIN:MAX, exp:MEAN,\n"
+            "                       pareto:MEAN:SHAPE or lognormal:MEDIAN:SIGMA (default fixed:%d)\n"
+            "   -M <int>            largest message in bytes (default %d)\n"
+            "   -z <int>            random seed, connection i uses seed + i\n"
+            "   -h                  prints this help\n", TRAFFIC_MSG_LEN, MAX_MSG_LEN);
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (arrival == "poisson") {
+    w.arrival = ARRIVAL_POISSON;
+  } else if (arrival == "cbr") {
+    w.arrival = ARRIVAL_CBR;
+  } else if (arrival == "onoff") {
+    w.arrival = ARRIVAL_ONOFF;
+  } else if (arrival == "trace" && !w.trace.empty()) {
+    w.arrival = ARRIVAL_TRACE;
+  } else {
+    LOG_ERROR("Unknown arrival process %s (trace needs -T)", arrival.c_str());
+    exit (EXIT_FAILURE);
+  }
+  if (connections < 1 || w.inter_ms <= 0 || w.shape <= 0
+      || w.max_size < sizeof(traffic_msg_hdr_t)) {
+    LOG_ERROR("Invalid workload parameters");
+    exit (EXIT_FAILURE);
+  }
+
+  LOG_INFO("Creating traffic generator on ports %d-%d", port, port + connections - 1);
+  LOG_INFO("%s arrivals, mean inter-arrival %f ms", arrival.c_str(), w.inter_ms);
+
+  /*
+   * Register a signal handler so we can terminate the generator with
+   * Ctrl+C
+   */
+  signal(SIGINT, sig_handler);
+
+  std::vector<std::thread> threads;
+  std::vector<conn_stats> stats(connections);
+  for (int i = 0; i < connections; i++) {
+    threads.emplace_back(generate, i, port + i, std::cref(w), seed + i, &stats[i]);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (int i = 0; i < connections; i++) {
+    printf("Connection %d: %llu messages, %llu bytes in %.3f s\n", i,
+           (unsigned long long) stats[i].messages, (unsigned long long) stats[i].bytes,
+           stats[i].seconds);
+  }
+  return 0;
 }
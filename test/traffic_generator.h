@@ -0,0 +1,42 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_TRAFFIC_GENERATOR_H_
+#define TEST_TRAFFIC_GENERATOR_H_
+
+#include <stdint.h>
+#include <endian.h>
+
+/* default size of a generated message */
+#define TRAFFIC_MSG_LEN 2048
+
+/**
+ * Starts every message of traffic_generator, big endian, so the client
+ * can tell the one-way delivery time of each message
+ */
+typedef struct
+{
+  uint64_t seq;                 /**< Message number, from 0 */
+  uint64_t sent_ns;             /**< CLOCK_MONOTONIC when it was handed to microtcp_send() */
+  uint32_t len;                 /**< Length of the whole message, this header included */
+  uint32_t reserved;
+} traffic_msg_hdr_t;
+
+#endif /* TEST_TRAFFIC_GENERATOR_H_ */
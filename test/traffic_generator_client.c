@@ -18,9 +18,25 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Receiving end of traffic_generator. Every microtcp_recv() completion is
+ * timestamped with the monotonic clock. The client keeps histograms of the
+ * inter-arrival times and of the delivery jitter, and the goodput over a
+ * sliding window. On Ctrl+C or when the generator closes, it prints a
+ * summary and writes the raw series as CSV for plotting.
+ *
+ * Each message of the generator starts with a traffic_msg_hdr_t that holds
+ * its sequence number, send time and length. The delivery jitter follows
+ * RFC 3550: the change of the one-way transit time from one message to the
+ * next. A constant clock offset between the two hosts cancels out.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -28,37 +44,395 @@
 
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
+#include "../utils/histogram.h"
+#include "traffic_generator.h"
+
+#define RECV_BUF_LEN 65536
+#define GOODPUT_STEP_MS 10      /* resolution of the goodput series */
+#define HIST_SUB_BITS 5         /* ~3% relative error */
+
+static volatile sig_atomic_t running = 1;
 
-static char running = 1;
+/* one microtcp_recv() completion */
+typedef struct
+{
+  uint64_t t_ns;
+  uint32_t bytes;
+} recv_sample_t;
+
+/* one message of the generator, once its last byte is in */
+typedef struct
+{
+  uint64_t seq;
+  uint64_t sent_ns;
+  uint64_t delivered_ns;
+  uint64_t jitter_ns;           /* |D(i-1, i)| of RFC 3550 */
+} msg_sample_t;
+
+typedef struct
+{
+  recv_sample_t *recvs;
+  size_t nrecvs, recvs_cap;
+  msg_sample_t *msgs;
+  size_t nmsgs, msgs_cap;
+  uint64_t *steps;              /* bytes per GOODPUT_STEP_MS since the start */
+  size_t nsteps, steps_cap;
+
+  histogram_t inter_arrival;
+  histogram_t jitter;
+  double rfc3550_jitter_ns;     /* smoothed J of RFC 3550 */
+
+  /* message framing across recv boundaries */
+  int framed;                   /* the stream carries traffic_msg_hdr_t */
+  size_t msg_len;               /* length of the current message, once its header is in */
+  size_t msg_off;
+  traffic_msg_hdr_t hdr;
+  int64_t last_transit;
+  int have_transit;
+
+  uint64_t start_ns;
+  uint64_t last_ns;
+  uint64_t bytes;
+} stats_t;
 
 static void
 sig_handler(int signal)
 {
   if(signal == SIGINT) {
-    LOG_INFO("Stopping traffic generator client...");
     running = 0;
   }
 }
 
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* grows an array of elements of the given size, doubling the capacity */
+static void *
+grow (void *array, size_t *cap, size_t need, size_t size)
+{
+  void *p;
+  size_t cap_new = *cap ? *cap : 1024;
+
+  if (need <= *cap) {
+    return array;
+  }
+  while (cap_new < need) {
+    cap_new *= 2;
+  }
+  p = realloc (array, cap_new * size);
+  if (!p) {
+    LOG_ERROR("Out of memory for the measurements");
+    exit (EXIT_FAILURE);
+  }
+  memset ((uint8_t *) p + *cap * size, 0, (cap_new - *cap) * size);
+  *cap = cap_new;
+  return p;
+}
+
+/* walks the received bytes along the message boundaries */
+static void
+account_messages (stats_t *s, const uint8_t *data, size_t len, uint64_t t)
+{
+  size_t take;
+  int64_t transit, d;
+  msg_sample_t *m;
+
+  while (len) {
+    if (s->msg_off < sizeof(traffic_msg_hdr_t)) {
+      take = sizeof(traffic_msg_hdr_t) - s->msg_off;
+      take = take < len ? take : len;
+      memcpy ((uint8_t *) &s->hdr + s->msg_off, data, take);
+      s->msg_len = sizeof(traffic_msg_hdr_t);
+      if (s->msg_off + take == sizeof(traffic_msg_hdr_t)
+          && ntohl (s->hdr.len) > sizeof(traffic_msg_hdr_t)) {
+        s->msg_len = ntohl (s->hdr.len);
+      }
+    } else {
+      take = s->msg_len - s->msg_off;
+      take = take < len ? take : len;
+    }
+    s->msg_off += take;
+    data += take;
+    len -= take;
+    if (s->msg_off < s->msg_len) {
+      continue;
+    }
+
+    /* the last byte of a message is in */
+    s->msgs = grow (s->msgs, &s->msgs_cap, s->nmsgs + 1, sizeof(msg_sample_t));
+    m = &s->msgs[s->nmsgs++];
+    m->seq = be64toh (s->hdr.seq);
+    m->sent_ns = be64toh (s->hdr.sent_ns);
+    m->delivered_ns = t;
+    transit = (int64_t) (t - m->sent_ns);
+    if (s->have_transit) {
+      d = transit - s->last_transit;
+      m->jitter_ns = d < 0 ? -d : d;
+      histogram_record (&s->jitter, m->jitter_ns);
+      s->rfc3550_jitter_ns += (m->jitter_ns - s->rfc3550_jitter_ns) / 16.0;
+    }
+    s->last_transit = transit;
+    s->have_transit = 1;
+    s->msg_off = 0;
+  }
+}
+
+static void
+record (stats_t *s, const uint8_t *data, size_t len, uint64_t t)
+{
+  size_t step;
+
+  if (s->nrecvs) {
+    histogram_record (&s->inter_arrival, t - s->last_ns);
+  }
+  s->recvs = grow (s->recvs, &s->recvs_cap, s->nrecvs + 1, sizeof(recv_sample_t));
+  s->recvs[s->nrecvs].t_ns = t;
+  s->recvs[s->nrecvs].bytes = len;
+  s->nrecvs++;
+
+  step = (t - s->start_ns) / (GOODPUT_STEP_MS * 1000000ULL);
+  s->steps = grow (s->steps, &s->steps_cap, step + 1, sizeof(uint64_t));
+  s->steps[step] += len;
+  if (step + 1 > s->nsteps) {
+    s->nsteps = step + 1;
+  }
+
+  s->last_ns = t;
+  s->bytes += len;
+  if (s->framed) {
+    account_messages (s, data, len, t);
+  }
+}
+
+static FILE *
+open_csv (const char *prefix, const char *name, const char *header)
+{
+  char path[512];
+  FILE *fp;
+
+  snprintf (path, sizeof(path), "%s-%s.csv", prefix, name);
+  fp = fopen (path, "w");
+  if (!fp) {
+    LOG_ERROR("Cannot write %s", path);
+    return NULL;
+  }
+  fprintf (fp, "%s\n", header);
+  return fp;
+}
+
+static void
+dump_histogram (FILE *fp, const char *metric, const histogram_t *h)
+{
+  uint32_t i;
+  for (i = 0; i < h->buckets; i++) {
+    if (h->counts[i]) {
+      fprintf (fp, "%s,%.3f,%llu\n", metric, histogram_value (h, i) / 1e3,
+               (unsigned long long) h->counts[i]);
+    }
+  }
+}
+
+/* goodput of the window_ms ending at every step */
+static double
+window_goodput (const stats_t *s, size_t step, size_t window_steps)
+{
+  uint64_t bytes = 0;
+  size_t i, first = step + 1 >= window_steps ? step + 1 - window_steps : 0;
+
+  for (i = first; i <= step; i++) {
+    bytes += s->steps[i];
+  }
+  return bytes * 8.0 / ((step + 1 - first) * GOODPUT_STEP_MS * 1e3);
+}
+
+static void
+dump (const stats_t *s, const char *prefix, unsigned window_ms)
+{
+  size_t i, window_steps = window_ms / GOODPUT_STEP_MS ? window_ms / GOODPUT_STEP_MS : 1;
+  double elapsed = (s->last_ns - s->start_ns) / 1e9, g, gmin = 0, gmax = 0;
+  FILE *fp;
+
+  printf ("Received %llu bytes in %zu recv calls over %.3f s, %.3f Mbit/s\n",
+          (unsigned long long) s->bytes, s->nrecvs, elapsed,
+          elapsed > 0 ? s->bytes * 8 / elapsed / 1e6 : 0.0);
+  if (s->inter_arrival.total) {
+    printf ("Inter-arrival (us): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+            histogram_percentile (&s->inter_arrival, 50) / 1e3,
+            histogram_percentile (&s->inter_arrival, 90) / 1e3,
+            histogram_percentile (&s->inter_arrival, 99) / 1e3,
+            s->inter_arrival.max / 1e3);
+  }
+  if (s->jitter.total) {
+    printf ("Delivery jitter of %zu messages (us): p50 %.1f p90 %.1f p99 %.1f max %.1f, "
+            "RFC 3550 J %.1f\n", s->nmsgs,
+            histogram_percentile (&s->jitter, 50) / 1e3,
+            histogram_percentile (&s->jitter, 90) / 1e3,
+            histogram_percentile (&s->jitter, 99) / 1e3,
+            s->jitter.max / 1e3, s->rfc3550_jitter_ns / 1e3);
+  }
+  for (i = window_steps - 1; i < s->nsteps; i++) {
+    g = window_goodput (s, i, window_steps);
+    if (i == window_steps - 1 || g < gmin) {
+      gmin = g;
+    }
+    if (g > gmax) {
+      gmax = g;
+    }
+  }
+  if (s->nsteps >= window_steps) {
+    printf ("Goodput over %u ms windows (Mbit/s): min %.3f max %.3f\n", window_ms, gmin, gmax);
+  }
+
+  if (!prefix) {
+    return;
+  }
+  if ((fp = open_csv (prefix, "recv", "t_us,bytes"))) {
+    for (i = 0; i < s->nrecvs; i++) {
+      fprintf (fp, "%.3f,%u\n", (s->recvs[i].t_ns - s->start_ns) / 1e3, s->recvs[i].bytes);
+    }
+    fclose (fp);
+  }
+  if ((fp = open_csv (prefix, "messages", "seq,delivered_us,transit_us,jitter_us"))) {
+    for (i = 0; i < s->nmsgs; i++) {
+      fprintf (fp, "%llu,%.3f,%.3f,%.3f\n", (unsigned long long) s->msgs[i].seq,
+               (s->msgs[i].delivered_ns - s->start_ns) / 1e3,
+               (int64_t) (s->msgs[i].delivered_ns - s->msgs[i].sent_ns) / 1e3,
+               s->msgs[i].jitter_ns / 1e3);
+    }
+    fclose (fp);
+  }
+  if ((fp = open_csv (prefix, "goodput", "t_ms,goodput_mbps"))) {
+    for (i = 0; i < s->nsteps; i++) {
+      fprintf (fp, "%zu,%.3f\n", (i + 1) * GOODPUT_STEP_MS, window_goodput (s, i, window_steps));
+    }
+    fclose (fp);
+  }
+  if ((fp = open_csv (prefix, "histograms", "metric,value_us,count"))) {
+    dump_histogram (fp, "inter_arrival", &s->inter_arrival);
+    dump_histogram (fp, "jitter", &s->jitter);
+    fclose (fp);
+  }
+  printf ("Measurements written to %s-{recv,messages,goodput,histograms}.csv\n", prefix);
+}
+
 int
 main(int argc, char **argv) {
-  uint16_t port;
+  int opt;
+  int port = 8080;
+  unsigned window_ms = 1000;
+  char *ipstr = NULL;
+  char *prefix = NULL;
+  ssize_t received;
+  uint64_t t;
+  uint8_t *buffer;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  struct sigaction sa;
+  stats_t stats;
+
+  memset (&stats, 0, sizeof(stats));
+  stats.framed = 1;
+
+  /* A very easy way to parse command line arguments */
+  while ((opt = getopt (argc, argv, "ha:p:o:w:R")) != -1) {
+    switch (opt)
+      {
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'o':
+        prefix = strdup (optarg);
+        break;
+      case 'w':
+        window_ms = atoi (optarg);
+        break;
+      case 'R':
+        stats.framed = 0;
+        break;
+      default:
+        printf (
+            "Usage: traffic_generator_client -a ip -p port [-o prefix] [-w ms] [-R]\n"
+            "Options:\n"
+            "   -a <string>         The IP address of the traffic generator\n"
+            "   -p <int>            The port of the traffic generator\n"
+            "   -o <string>         Write the measurements to <prefix>-*.csv at the end\n"
+            "   -w <int>            Goodput window in milliseconds (default 1000)\n"
+            "   -R                  The stream carries no message headers, skip the jitter\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+  if (!ipstr) {
+    LOG_ERROR("The address of the traffic generator is needed (-a)");
+    exit (EXIT_FAILURE);
+  }
+
+  buffer = malloc (RECV_BUF_LEN);
+  if (!buffer || histogram_init (&stats.inter_arrival, HIST_SUB_BITS) < 0
+      || histogram_init (&stats.jitter, HIST_SUB_BITS) < 0) {
+    LOG_ERROR("Failed to allocate the receive state");
+    exit (EXIT_FAILURE);
+  }
 
   /*
    * Register a signal handler so we can terminate the client with
-   * Ctrl+C
+   * Ctrl+C. No SA_RESTART, the pending microtcp_recv() has to return.
    */
-  signal(SIGINT, sig_handler);
+  memset (&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_handler;
+  sigaction (SIGINT, &sa, NULL);
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    exit (EXIT_FAILURE);
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = inet_addr (ipstr);
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) < 0) {
+    LOG_ERROR("Failed to connect to %s:%d", ipstr, port);
+    exit (EXIT_FAILURE);
+  }
 
-  LOG_INFO("Start receiving traffic from port %u", port);
-  /*TODO: Connect using microtcp_connect() */
+  LOG_INFO("Start receiving traffic from port %d", port);
+  stats.start_ns = now_ns ();
+  stats.last_ns = stats.start_ns;
   while(running) {
-    /* TODO: Measure time */
-    /* TODO: Receive using microtcp_recv()*/
-    /* TODO: Measure time */
-    /* TODO: Do other stuff... */
+    received = microtcp_recv (&sock, buffer, RECV_BUF_LEN, 0);
+    t = now_ns ();
+    if (received <= 0) {
+      if (received == 0) {
+        LOG_INFO("The traffic generator closed the connection");
+      }
+      break;
+    }
+    record (&stats, buffer, received, t);
   }
+  LOG_INFO("Stopping traffic generator client...");
 
   /* Ctrl+C pressed! Store properly time measurements for plotting */
-}
+  dump (&stats, prefix, window_ms);
+  fflush (stdout);
 
+  if (sock.state == ESTABLISHED) {
+    microtcp_shutdown (&sock, SHUT_RDWR);
+  }
+  histogram_free (&stats.inter_arrival);
+  histogram_free (&stats.jitter);
+  free (stats.recvs);
+  free (stats.msgs);
+  free (stats.steps);
+  free (buffer);
+  free (ipstr);
+  free (prefix);
+  return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_HISTOGRAM_H_
+#define UTILS_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Log-linear (HDR style) histogram of 64-bit values. Every power of two
+ * is split in 2^sub_bits linear sub-buckets, so the relative error of a
+ * reported value is at most 2^-sub_bits over the whole range.
+ */
+typedef struct
+{
+  uint32_t sub_bits;            /**< log2 of the sub-buckets per power of two */
+  uint32_t buckets;             /**< Number of counters */
+  uint64_t total;               /**< Number of recorded values */
+  uint64_t min;                 /**< Exact minimum recorded value */
+  uint64_t max;                 /**< Exact maximum recorded value */
+  uint64_t *counts;
+} histogram_t;
+
+/**
+ * Allocates the counters of a histogram.
+ *
+ * @param h the histogram
+ * @param sub_bits the precision, e.g. 3 gives ~12% and 7 gives ~1%
+ * @return 0 on success or -1 on failure
+ */
+static inline int
+histogram_init (histogram_t *h, uint32_t sub_bits)
+{
+  h->sub_bits = sub_bits;
+  h->buckets = (65 - sub_bits) << sub_bits;
+  h->total = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+  h->counts = (uint64_t *) calloc (h->buckets, sizeof(uint64_t));
+  return h->counts ? 0 : -1;
+}
+
+static inline void
+histogram_free (histogram_t *h)
+{
+  free (h->counts);
+  h->counts = NULL;
+}
+
+static inline void
+histogram_reset (histogram_t *h)
+{
+  memset (h->counts, 0, h->buckets * sizeof(uint64_t));
+  h->total = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+}
+
+static inline uint32_t
+histogram_index (const histogram_t *h, uint64_t v)
+{
+  uint32_t mag, shift;
+
+  if (v < (1ULL << h->sub_bits)) {
+    return v;
+  }
+  mag = 63 - __builtin_clzll (v);
+  shift = mag - h->sub_bits;
+  return ((shift + 1) << h->sub_bits) + (uint32_t) ((v >> shift) - (1ULL << h->sub_bits));
+}
+
+/* the highest value that falls in the bucket idx */
+static inline uint64_t
+histogram_value (const histogram_t *h, uint32_t idx)
+{
+  uint32_t block = idx >> h->sub_bits, shift;
+
+  if (block <= 1) {
+    return idx;
+  }
+  shift = block - 1;
+  return ((((uint64_t) idx & ((1ULL << h->sub_bits) - 1)) + (1ULL << h->sub_bits)) << shift)
+      + ((1ULL << shift) - 1);
+}
+
+static inline void
+histogram_record_n (histogram_t *h, uint64_t v, uint64_t n)
+{
+  h->counts[histogram_index (h, v)] += n;
+  h->total += n;
+  if (v < h->min) {
+    h->min = v;
+  }
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+static inline void
+histogram_record (histogram_t *h, uint64_t v)
+{
+  histogram_record_n (h, v, 1);
+}
+
+/**
+ * Records a value taken at a fixed expected interval, back-filling the
+ * samples that a stalled measurement loop failed to take. This corrects
+ * the coordinated omission of closed-loop load generators.
+ *
+ * @param h the histogram
+ * @param v the measured value
+ * @param interval the expected interval between samples, 0 disables
+ * the correction
+ */
+static inline void
+histogram_record_corrected (histogram_t *h, uint64_t v, uint64_t interval)
+{
+  uint64_t missed;
+
+  histogram_record (h, v);
+  if (!interval) {
+    return;
+  }
+  for (missed = v - interval; v > interval && missed >= interval; missed -= interval) {
+    histogram_record (h, missed);
+  }
+}
+
+/**
+ * Merges the counters of src into dst. Both must have the same precision.
+ */
+static inline void
+histogram_add (histogram_t *dst, const histogram_t *src)
+{
+  uint32_t i;
+
+  for (i = 0; i < dst->buckets; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+/**
+ * @param h the histogram
+ * @param p the percentile in [0, 100]
+ * @return the value below which p percent of the recorded values fall
+ */
+static inline uint64_t
+histogram_percentile (const histogram_t *h, double p)
+{
+  uint64_t target, seen = 0, v;
+  uint32_t i;
+
+  if (!h->total) {
+    return 0;
+  }
+  target = (uint64_t) (p / 100.0 * h->total + 0.5);
+  if (target < 1) {
+    target = 1;
+  }
+  for (i = 0; i < h->buckets; i++) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      v = histogram_value (h, i);
+      return v > h->max ? h->max : (v < h->min ? h->min : v);
+    }
+  }
+  return h->max;
+}
+
+#endif /* UTILS_HISTOGRAM_H_ */
@@ -0,0 +1,447 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous backend of log.h: per-thread single producer rings drained
+ * by one background thread that formats and writes in batches.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_RING_RECORDS 512          /* per thread, must be a power of 2 */
+#define LOG_STR_AREA (2 * LOG_STR_LEN)  /* room for copied string arguments */
+#define LOG_OUT_LEN (64 * 1024)         /* write batch of the backend */
+#define LOG_OUT_SLACK 1024              /* flush when less room than this is left */
+
+typedef struct
+{
+  const char *fmt;
+  const char *file;
+  int line;
+  uint8_t level;
+  uint8_t nargs;
+  log_arg_t args[LOG_MAX_ARGS];
+  char strs[LOG_STR_AREA];
+} log_rec_t;
+
+typedef struct log_ring
+{
+  _Atomic uint32_t head;        /* next record the producer writes */
+  _Atomic uint32_t tail;        /* next record the backend formats */
+  _Atomic uint64_t dropped;
+  _Atomic int dead;             /* the owner thread exited */
+  struct log_ring *next;
+  log_rec_t rec[LOG_RING_RECORDS];
+} log_ring_t;
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static __thread log_ring_t *thread_ring;
+static log_ring_t *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t consume_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static char out[LOG_OUT_LEN];
+static size_t out_len;
+
+/* the backend sleeps on wake until a producer sets pending */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static _Atomic int pending;
+
+static const char *level_prefix[] = { "[DEBUG]: ", "[INFO]: ", "[WARNING] ", "[ERROR] " };
+
+
+void
+log_set_level (int level)
+{
+  log_level = level;
+}
+
+
+/* the runtime level can come from the environment */
+__attribute__((constructor)) static void
+log_level_from_env (void)
+{
+  static const char *names[] = { "debug", "info", "warn", "error", "none" };
+  const char *env = getenv("MICROTCP_LOG_LEVEL");
+  int i;
+
+  for (i = 0; env && i <= LOG_LEVEL_NONE; i++) {
+    if (!strcasecmp(env, names[i])) {
+      log_level = i;
+    }
+  }
+}
+
+
+static void
+out_flush (void)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < out_len) {
+    ret = write(STDERR_FILENO, out + done, out_len - done);
+    if (ret <= 0) {
+      break;
+    }
+    done += ret;
+  }
+  out_len = 0;
+}
+
+
+/* takes the return value of an snprintf() at out + out_len, a truncated
+ * result keeps the terminating byte of the batch free */
+static void
+out_advance (int n)
+{
+  size_t room = LOG_OUT_LEN - out_len;
+
+  if (n > 0) {
+    out_len += (size_t)n < room ? (size_t)n : room - 1;
+  }
+}
+
+
+/* appends a conversion spec (already stripped of its length modifiers)
+ * formatted with the argument */
+static void
+out_spec (char *spec, size_t spec_len, char conv, const log_rec_t *r, const log_arg_t *a)
+{
+  char *dst = out + out_len;
+  size_t room = LOG_OUT_LEN - out_len;
+  long long i = 0;
+  unsigned long long u = 0;
+  double d = 0;
+  int n = 0;
+
+  switch (a->kind) {
+    case LOG_ARG_INT:
+      i = a->v.i;
+      u = a->v.i;
+      d = a->v.i;
+      break;
+    case LOG_ARG_UINT:
+      i = a->v.u;
+      u = a->v.u;
+      d = a->v.u;
+      break;
+    case LOG_ARG_DOUBLE:
+      i = a->v.d;
+      u = a->v.d;
+      d = a->v.d;
+      break;
+    default:
+      break;
+  }
+
+  switch (conv) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      /* widen everything to long long */
+      memmove(spec + spec_len + 1, spec + spec_len - 1, 2);
+      spec[spec_len - 1] = 'l';
+      spec[spec_len] = 'l';
+      n = conv == 'd' || conv == 'i' ? snprintf(dst, room, spec, i) : snprintf(dst, room, spec, u);
+      break;
+    case 'c':
+      n = snprintf(dst, room, spec, (int)i);
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      n = snprintf(dst, room, spec, d);
+      break;
+    case 's':
+      n = snprintf(dst, room, spec, a->kind == LOG_ARG_STR ? r->strs + a->v.u : "(?)");
+      break;
+    case 'p':
+      n = snprintf(dst, room, spec, a->v.p);
+      break;
+    default:
+      break;
+  }
+  out_advance(n);
+}
+
+
+/* the value of a '*' width or precision, which takes an int argument */
+static long long
+star_value (const log_arg_t *a)
+{
+  switch (a->kind) {
+    case LOG_ARG_INT:
+      return a->v.i;
+    case LOG_ARG_UINT:
+      return (long long)a->v.u;
+    default:
+      return 0;
+  }
+}
+
+
+/* formats one record at the end of the output batch */
+static void
+out_record (const log_rec_t *r)
+{
+  const char *f = r->fmt;
+  char spec[32];
+  size_t spec_len;
+  long long star;
+  int arg = 0, n;
+
+  if (LOG_OUT_LEN - out_len < LOG_OUT_SLACK) {
+    out_flush();
+  }
+  out_advance(snprintf(out + out_len, LOG_OUT_LEN - out_len, "%s%s:%d: ",
+                       level_prefix[r->level], r->file, r->line));
+
+  while (*f && out_len < LOG_OUT_LEN - 2) {
+    if (*f != '%') {
+      out[out_len++] = *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      out[out_len++] = '%';
+      f += 2;
+      continue;
+    }
+
+    /* copy flags, width and precision, drop the length modifiers. a '*'
+     * takes its value from the next argument, like printf() */
+    spec_len = 0;
+    spec[spec_len++] = *f++;
+    while (*f && strchr("-+ #0123456789.*", *f) && spec_len < sizeof(spec) - 24) {
+      if (*f != '*') {
+        spec[spec_len++] = *f++;
+        continue;
+      }
+      star = arg < r->nargs ? star_value(&r->args[arg++]) : 0;
+      if (star < 0 && spec[spec_len - 1] == '.') {
+        spec_len--;  /* a negative precision is taken as none */
+      } else {
+        n = snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d",
+                     (int)(star < -9999 ? -9999 : star > 9999 ? 9999 : star));
+        spec_len += n;
+      }
+      f++;
+    }
+    while (*f && strchr("hljztL", *f)) {
+      f++;
+    }
+    if (!*f) {
+      break;
+    }
+    spec[spec_len++] = *f;
+    spec[spec_len] = '\0';
+    if (arg < r->nargs) {
+      out_spec(spec, spec_len, *f, r, &r->args[arg++]);
+    }
+    f++;
+  }
+  out[out_len++] = '\n';
+}
+
+
+/* formats whatever the producers have recorded so far */
+static int
+drain (void)
+{
+  log_ring_t *ring, **prev;
+  uint32_t head, tail;
+  uint64_t dropped;
+  int count = 0;
+
+  pthread_mutex_lock(&consume_lock);
+  pthread_mutex_lock(&rings_lock);
+  for (prev = &rings; (ring = *prev) != NULL;) {
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (; tail != head; tail++, count++) {
+      out_record(&ring->rec[tail & (LOG_RING_RECORDS - 1)]);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped) {
+      if (LOG_OUT_LEN - out_len < LOG_OUT_SLACK) {
+        out_flush();
+      }
+      out_advance(snprintf(out + out_len, LOG_OUT_LEN - out_len,
+                           "[WARNING] log: %llu messages dropped\n",
+                           (unsigned long long)dropped));
+    }
+
+    /* rings of exited threads go away once drained */
+    if (atomic_load(&ring->dead) && tail == atomic_load(&ring->head)) {
+      *prev = ring->next;
+      free(ring);
+    } else {
+      prev = &ring->next;
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+  out_flush();
+  pthread_mutex_unlock(&consume_lock);
+  return count;
+}
+
+
+/* sleeps until a producer records something, then drains. a record
+ * that comes in while draining sets pending again */
+static void *
+backend (void *arg)
+{
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&wake_lock);
+    while (!atomic_load(&pending)) {
+      pthread_cond_wait(&wake, &wake_lock);
+    }
+    atomic_store(&pending, 0);
+    pthread_mutex_unlock(&wake_lock);
+    atomic_thread_fence(memory_order_seq_cst);
+    drain();
+  }
+  return NULL;
+}
+
+
+/* only the first record after a drain wakes the backend. the fence
+ * orders the new head before the look at pending, the backend does the
+ * opposite, so one of the two always sees the other */
+static void
+backend_wake (void)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&pending, memory_order_relaxed) || atomic_exchange(&pending, 1)) {
+    return;
+  }
+  pthread_mutex_lock(&wake_lock);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wake_lock);
+}
+
+
+void
+log_flush (void)
+{
+  drain();
+}
+
+
+static void
+ring_release (void *ring)
+{
+  atomic_store(&((log_ring_t *)ring)->dead, 1);
+}
+
+
+static void
+backend_start (void)
+{
+  pthread_t tid;
+  pthread_attr_t attr;
+
+  pthread_key_create(&ring_key, ring_release);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, backend, NULL);
+  pthread_attr_destroy(&attr);
+  atexit(log_flush);
+}
+
+
+static log_ring_t *
+ring_get (void)
+{
+  log_ring_t *ring;
+
+  pthread_once(&backend_once, backend_start);
+  ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+  if (!ring) {
+    return NULL;
+  }
+  pthread_setspecific(ring_key, ring);
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  thread_ring = ring;
+  return ring;
+}
+
+
+void
+log_record (int level, const char *file, int line, const char *fmt,
+            int nargs, const log_arg_t *args)
+{
+  log_ring_t *ring = thread_ring;
+  log_rec_t *r;
+  uint32_t head;
+  size_t used = 0, len;
+  int i;
+
+  if (!ring && !(ring = ring_get())) {
+    return;
+  }
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_RECORDS) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    backend_wake();
+    return;
+  }
+
+  r = &ring->rec[head & (LOG_RING_RECORDS - 1)];
+  r->fmt = fmt;
+  r->file = file;
+  r->line = line;
+  r->level = level;
+  r->nargs = nargs < LOG_MAX_ARGS ? nargs : LOG_MAX_ARGS;
+  for (i = 0; i < r->nargs; i++) {
+    r->args[i] = args[i];
+    /* strings may not outlive the call, keep a copy */
+    if (args[i].kind == LOG_ARG_STR) {
+      len = args[i].v.s ? strnlen(args[i].v.s, LOG_STR_LEN - 1) : 0;
+      if (used + len + 1 > LOG_STR_AREA) {
+        len = used < LOG_STR_AREA ? LOG_STR_AREA - used - 1 : 0;
+      }
+      if (used < LOG_STR_AREA) {
+        memcpy(r->strs + used, args[i].v.s ? args[i].v.s : "", len);
+        r->strs[used + len] = '\0';
+        r->args[i].v.u = used;
+        used += len + 1;
+      } else {
+        r->args[i].kind = LOG_ARG_PTR;
+      }
+    }
+  }
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  backend_wake();
+}
@@ -26,28 +26,199 @@
 #include <string.h>
 #include <sys/syscall.h>
 
+/*
+ * Logging backend
+ *
+ * Messages below LOG_COMPILE_LEVEL are compiled out. The rest are filtered
+ * at runtime against log_level (set with log_set_level() or the
+ * MICROTCP_LOG_LEVEL environment variable: debug, info, warn, error, none).
+ *
+ * From C, a message costs a level check and a copy of the format pointer
+ * and the raw arguments into a per-thread ring. A background thread does
+ * the formatting and writes to stderr in batches. Strings are copied
+ * (up to LOG_STR_LEN bytes), pointers are recorded by value. If the ring
+ * is full the message is dropped and counted, the caller never blocks.
+ * From C++, or with LOG_SYNC defined, messages are printed synchronously.
+ */
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
 /* Set to 0 to disable debug messages at compile time ;) */
+#ifndef ENABLE_DEBUG_MSG
 #define ENABLE_DEBUG_MSG 1
+#endif
 
+#ifndef LOG_COMPILE_LEVEL
 #if ENABLE_DEBUG_MSG
-#define LOG_INFO(M, ...)                                                        \
-                fprintf(stderr, "[INFO]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
 #else
-#define LOG_INFO(M, ...)
+#define LOG_COMPILE_LEVEL LOG_LEVEL_WARN
+#endif
+#endif
+
+#define LOG_MAX_ARGS 8
+#define LOG_STR_LEN 48
+
+#ifdef __cplusplus
+extern "C" {
 #endif
 
-#define LOG_ERROR(M, ...)                                                       \
-        fprintf(stderr, "[ERROR] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+extern int log_level;
 
-#define LOG_WARN(M, ...)                                                                \
-        fprintf(stderr, "[WARNING] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/**
+ * Sets the runtime log level, messages below it are discarded.
+ */
+void
+log_set_level (int level);
+
+/**
+ * Waits until all the recorded messages have been written.
+ */
+void
+log_flush (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if !defined(__cplusplus) && !defined(LOG_SYNC)
+
+#include <stdint.h>
+
+typedef enum
+{
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STR,
+  LOG_ARG_PTR
+} log_arg_kind_t;
+
+/**
+ * A raw argument of a log message, formatted later by the backend
+ */
+typedef struct
+{
+  log_arg_kind_t kind;
+  union
+  {
+    long long i;
+    unsigned long long u;
+    double d;
+    const char *s;
+    const void *p;
+  } v;
+} log_arg_t;
+
+static inline log_arg_t
+log_arg_int (long long i)
+{
+  log_arg_t a;
+  a.kind = LOG_ARG_INT;
+  a.v.i = i;
+  return a;
+}
+
+static inline log_arg_t
+log_arg_uint (unsigned long long u)
+{
+  log_arg_t a;
+  a.kind = LOG_ARG_UINT;
+  a.v.u = u;
+  return a;
+}
+
+static inline log_arg_t
+log_arg_double (double d)
+{
+  log_arg_t a;
+  a.kind = LOG_ARG_DOUBLE;
+  a.v.d = d;
+  return a;
+}
+
+static inline log_arg_t
+log_arg_str (const char *s)
+{
+  log_arg_t a;
+  a.kind = LOG_ARG_STR;
+  a.v.s = s;
+  return a;
+}
+
+static inline log_arg_t
+log_arg_ptr (const void *p)
+{
+  log_arg_t a;
+  a.kind = LOG_ARG_PTR;
+  a.v.p = p;
+  return a;
+}
+
+#define LOG_ARG(x) _Generic((x),                                                \
+        char: log_arg_int, signed char: log_arg_int, short: log_arg_int,        \
+        int: log_arg_int, long: log_arg_int, long long: log_arg_int,            \
+        _Bool: log_arg_uint, unsigned char: log_arg_uint,                       \
+        unsigned short: log_arg_uint, unsigned int: log_arg_uint,               \
+        unsigned long: log_arg_uint, unsigned long long: log_arg_uint,          \
+        float: log_arg_double, double: log_arg_double,                          \
+        char *: log_arg_str, const char *: log_arg_str,                         \
+        default: log_arg_ptr)(x)
+
+/* argument counting and wrapping, up to LOG_MAX_ARGS arguments */
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_WRAP_0()
+#define LOG_WRAP_1(a) LOG_ARG(a)
+#define LOG_WRAP_2(a, ...) LOG_ARG(a), LOG_WRAP_1(__VA_ARGS__)
+#define LOG_WRAP_3(a, ...) LOG_ARG(a), LOG_WRAP_2(__VA_ARGS__)
+#define LOG_WRAP_4(a, ...) LOG_ARG(a), LOG_WRAP_3(__VA_ARGS__)
+#define LOG_WRAP_5(a, ...) LOG_ARG(a), LOG_WRAP_4(__VA_ARGS__)
+#define LOG_WRAP_6(a, ...) LOG_ARG(a), LOG_WRAP_5(__VA_ARGS__)
+#define LOG_WRAP_7(a, ...) LOG_ARG(a), LOG_WRAP_6(__VA_ARGS__)
+#define LOG_WRAP_8(a, ...) LOG_ARG(a), LOG_WRAP_7(__VA_ARGS__)
+
+/**
+ * Records a message in the ring of the calling thread. Use the LOG_*
+ * macros instead of calling this directly.
+ */
+void
+log_record (int level, const char *file, int line, const char *fmt,
+            int nargs, const log_arg_t *args);
+
+#define LOG_AT(L, P, M, ...)                                                    \
+        do {                                                                    \
+          if ((L) >= LOG_COMPILE_LEVEL && (L) >= log_level) {                   \
+            log_arg_t log_args_[LOG_NARGS(__VA_ARGS__) + 1] =                   \
+                { LOG_CAT(LOG_WRAP_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__) };    \
+            log_record ((L), __FILE__, __LINE__, M, LOG_NARGS(__VA_ARGS__),    \
+                        log_args_);                                             \
+          }                                                                     \
+        } while (0)
 
-#if ENABLE_DEBUG_MSG
-#define LOG_DEBUG(M, ...)                                                       \
-        fprintf(stderr, "[DEBUG]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 #else
-#define LOG_DEBUG(M, ...)
+
+#define LOG_AT(L, P, M, ...)                                                    \
+        do {                                                                    \
+          if ((L) >= LOG_COMPILE_LEVEL && (L) >= log_level) {                   \
+            fprintf(stderr, P "%s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+          }                                                                     \
+        } while (0)
+
 #endif
 
+#define LOG_INFO(M, ...) LOG_AT(LOG_LEVEL_INFO, "[INFO]: ", M, ##__VA_ARGS__)
+
+#define LOG_ERROR(M, ...) LOG_AT(LOG_LEVEL_ERROR, "[ERROR] ", M, ##__VA_ARGS__)
+
+#define LOG_WARN(M, ...) LOG_AT(LOG_LEVEL_WARN, "[WARNING] ", M, ##__VA_ARGS__)
+
+#define LOG_DEBUG(M, ...) LOG_AT(LOG_LEVEL_DEBUG, "[DEBUG]: ", M, ##__VA_ARGS__)
+
 #endif /* UTILS_LOG_H_ */
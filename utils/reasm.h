@@ -0,0 +1,178 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_REASM_H_
+#define UTILS_REASM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/* Maximum number of disjoint out-of-order ranges kept per connection */
+#define REASM_MAX_RANGES 8
+
+/**
+ * A range [start, end) of sequence numbers that has been received
+ * out of order
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} reasm_range_t;
+
+/**
+ * Out-of-order bookkeeping of the receiver. Only the ranges are tracked,
+ * the data itself is placed by the caller straight at its final position.
+ * Ranges are kept sorted and never overlap or touch each other.
+ */
+typedef struct
+{
+  reasm_range_t range[REASM_MAX_RANGES];
+  uint32_t count;
+} reasm_t;
+
+/* a < b in the sequence number space, taking wrap around into account */
+static inline int
+reasm_seq_before (uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) < 0;
+}
+
+static inline void
+reasm_clear (reasm_t *r)
+{
+  r->count = 0;
+}
+
+/**
+ * Records that [start, end) has been received, merging it with any
+ * overlapping or adjacent range.
+ *
+ * @param r the reassembly state
+ * @param start the first sequence number of the segment
+ * @param end the sequence number after the last byte of the segment
+ * @return 0 on success or -1 if there is no room for another range
+ */
+static inline int
+reasm_insert (reasm_t *r, uint32_t start, uint32_t end)
+{
+  uint32_t i = 0, j;
+
+  /* skip the ranges that end before the new one begins */
+  while (i < r->count && reasm_seq_before (r->range[i].end, start)) {
+    i++;
+  }
+
+  /* no overlap: insert a new range at position i */
+  if (i == r->count || reasm_seq_before (end, r->range[i].start)) {
+    if (r->count == REASM_MAX_RANGES) {
+      return -1;
+    }
+    for (j = r->count; j > i; j--) {
+      r->range[j] = r->range[j - 1];
+    }
+    r->range[i].start = start;
+    r->range[i].end = end;
+    r->count++;
+    return 0;
+  }
+
+  /* overlap: grow range i and swallow the ones it now reaches */
+  if (reasm_seq_before (start, r->range[i].start)) {
+    r->range[i].start = start;
+  }
+  if (reasm_seq_before (r->range[i].end, end)) {
+    r->range[i].end = end;
+  }
+  for (j = i + 1; j < r->count && !reasm_seq_before (r->range[i].end, r->range[j].start); j++) {
+    if (reasm_seq_before (r->range[i].end, r->range[j].end)) {
+      r->range[i].end = r->range[j].end;
+    }
+  }
+  if (j > i + 1) {
+    memmove (&r->range[i + 1], &r->range[j], (r->count - j) * sizeof(reasm_range_t));
+    r->count -= j - i - 1;
+  }
+  return 0;
+}
+
+/**
+ * Delivers the ranges that became contiguous with the in-order data.
+ *
+ * @param r the reassembly state
+ * @param next the next expected sequence number
+ * @return the next expected sequence number after the delivered ranges
+ */
+static inline uint32_t
+reasm_deliver (reasm_t *r, uint32_t next)
+{
+  uint32_t i = 0;
+
+  while (i < r->count && !reasm_seq_before (next, r->range[i].start)) {
+    if (reasm_seq_before (next, r->range[i].end)) {
+      next = r->range[i].end;
+    }
+    i++;
+  }
+  if (i) {
+    memmove (&r->range[0], &r->range[i], (r->count - i) * sizeof(reasm_range_t));
+    r->count -= i;
+  }
+  return next;
+}
+
+/**
+ * Forgets what has been received at or after end, when the bytes there
+ * are no longer kept.
+ *
+ * @param r the reassembly state
+ * @param end the first sequence number to forget
+ */
+static inline void
+reasm_trim (reasm_t *r, uint32_t end)
+{
+  while (r->count && !reasm_seq_before (r->range[r->count - 1].start, end)) {
+    r->count--;
+  }
+  if (r->count && reasm_seq_before (end, r->range[r->count - 1].end)) {
+    r->range[r->count - 1].end = end;
+  }
+}
+
+/**
+ * Tells whether [start, end) has already been received out of order.
+ *
+ * @return 1 if a single range covers all of it, 0 otherwise
+ */
+static inline int
+reasm_contains (const reasm_t *r, uint32_t start, uint32_t end)
+{
+  uint32_t i;
+
+  for (i = 0; i < r->count; i++) {
+    if (!reasm_seq_before (start, r->range[i].start)
+        && !reasm_seq_before (r->range[i].end, end)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#endif /* UTILS_REASM_H_ */
@@ -0,0 +1,91 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_SIPHASH_H_
+#define UTILS_SIPHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_LEN 16
+
+#define SIPHASH_ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3)                                         \
+  do {                                                                        \
+    v0 += v1; v1 = SIPHASH_ROTL (v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL (v0, 32); \
+    v2 += v3; v3 = SIPHASH_ROTL (v3, 16); v3 ^= v2;                           \
+    v0 += v3; v3 = SIPHASH_ROTL (v3, 21); v3 ^= v0;                           \
+    v2 += v1; v1 = SIPHASH_ROTL (v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL (v2, 32); \
+  } while (0)
+
+static inline uint64_t
+siphash_load64 (const uint8_t *p)
+{
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16)
+      | ((uint64_t) p[3] << 24) | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+      | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+/**
+ * SipHash-2-4, a keyed pseudorandom function. Unlike a CRC, its output
+ * for one input tells nothing about the output for another without the
+ * key, so it can authenticate short values such as addresses.
+ *
+ * @param key the secret key, SIPHASH_KEY_LEN bytes
+ * @param data the buffer containing the data
+ * @param len the length of the buffer
+ * @return the 64-bit tag
+ */
+static inline uint64_t
+siphash24 (const uint8_t *key, const uint8_t *data, size_t len)
+{
+  uint64_t k0 = siphash_load64 (key), k1 = siphash_load64 (key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m, b = (uint64_t) len << 56;
+  const uint8_t *end = data + len - len % 8;
+  size_t i;
+
+  for (; data != end; data += 8) {
+    m = siphash_load64 (data);
+    v3 ^= m;
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for (i = 0; i < len % 8; i++) {
+    b |= (uint64_t) data[i] << (8 * i);
+  }
+
+  v3 ^= b;
+  SIPHASH_ROUND (v0, v1, v2, v3);
+  SIPHASH_ROUND (v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  for (i = 0; i < 4; i++) {
+    SIPHASH_ROUND (v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif /* UTILS_SIPHASH_H_ */
@@ -0,0 +1,185 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_TRACE_H_
+#define UTILS_TRACE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Set to 1 (cmake -DENABLE_TRACE=ON) to compile the event trace in */
+#ifndef MICROTCP_TRACE
+#define MICROTCP_TRACE 0
+#endif
+
+/* Number of events kept per connection, must be a power of 2 */
+#ifndef TRACE_RING_EVENTS
+#define TRACE_RING_EVENTS 16384
+#endif
+
+#define TRACE_MAGIC "MTCPTRC1"
+
+/**
+ * Types of the trace events
+ */
+typedef enum
+{
+  TRACE_TX = 1,         /* data segment sent: seq, len */
+  TRACE_RETX,           /* data segment retransmitted: seq, len */
+  TRACE_RX,             /* data segment received: seq, len */
+  TRACE_ACK,            /* ACK received: ack, window */
+  TRACE_DUPACK,         /* duplicate ACK received: ack */
+  TRACE_TIMEOUT,        /* retransmission timeout: seq of first unacked byte */
+  TRACE_CWND,           /* congestion window changed: cwnd, len holds ssthresh */
+  TRACE_WND             /* peer window changed: window */
+} trace_type_t;
+
+/**
+ * A trace event, 32 bytes so two of them share a cache line
+ */
+typedef struct
+{
+  uint64_t ts_ns;               /**< CLOCK_MONOTONIC timestamp */
+  uint8_t type;                 /**< One of trace_type_t */
+  uint8_t pad[3];
+  uint32_t seq;
+  uint32_t ack;
+  uint32_t len;
+  uint32_t cwnd;                /**< Congestion window at the time of the event */
+  uint32_t window;              /**< Peer window at the time of the event */
+} trace_event_t;
+
+/**
+ * Header of a dumped trace, followed by count events oldest first
+ */
+typedef struct
+{
+  char magic[8];
+  uint32_t event_size;
+  uint32_t dropped;             /**< Events overwritten before the dump */
+  uint64_t count;
+} trace_file_header_t;
+
+/**
+ * Event ring: the threads driving the connection (two with full duplex)
+ * claim slots with an atomic add, anybody may dump them concurrently
+ * without locking. Such a dump may catch the newest event half written.
+ */
+typedef struct trace_ring
+{
+  _Atomic uint64_t head;        /**< Number of events ever written */
+  trace_event_t ev[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static inline trace_ring_t *
+trace_ring_new (void)
+{
+  trace_ring_t *ring = (trace_ring_t *) malloc (sizeof(trace_ring_t));
+
+  if (ring) {
+    atomic_init (&ring->head, 0);
+  }
+  return ring;
+}
+
+static inline void
+trace_push (trace_ring_t *ring, uint8_t type, uint32_t seq, uint32_t ack,
+            uint32_t len, uint32_t cwnd, uint32_t window)
+{
+  struct timespec ts;
+  uint64_t head;
+  trace_event_t *e;
+
+  if (!ring) {
+    return;
+  }
+  head = atomic_fetch_add_explicit (&ring->head, 1, memory_order_relaxed);
+  e = &ring->ev[head & (TRACE_RING_EVENTS - 1)];
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  e->ts_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e->type = type;
+  e->seq = seq;
+  e->ack = ack;
+  e->len = len;
+  e->cwnd = cwnd;
+  e->window = window;
+}
+
+/**
+ * Writes the events still in the ring to fd, see trace_file_header_t.
+ * Events the producer overwrote while they were copied are left out.
+ *
+ * @return 0 on success or -1 on failure
+ */
+static inline int
+trace_dump (trace_ring_t *ring, int fd)
+{
+  trace_file_header_t hdr;
+  trace_event_t *copy;
+  uint64_t head, tail, i, start;
+  ssize_t len;
+
+  copy = (trace_event_t *) malloc (sizeof(ring->ev));
+  if (!copy) {
+    return -1;
+  }
+
+  head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  tail = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+  for (i = tail; i < head; i++) {
+    copy[i - tail] = ring->ev[i & (TRACE_RING_EVENTS - 1)];
+  }
+
+  /* anything the producer got to in the meantime is unreliable */
+  atomic_thread_fence (memory_order_acquire);
+  i = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  start = i + 1 > TRACE_RING_EVENTS + tail ? i + 1 - TRACE_RING_EVENTS - tail : 0;
+  if (start > head - tail) {
+    start = head - tail;
+  }
+
+  memcpy (hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.event_size = sizeof(trace_event_t);
+  hdr.dropped = (uint32_t) (tail + start);
+  hdr.count = head - tail - start;
+
+  len = sizeof(trace_event_t) * hdr.count;
+  if (write (fd, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr)
+      || write (fd, copy + start, len) != len) {
+    free (copy);
+    return -1;
+  }
+  free (copy);
+  return 0;
+}
+
+#if MICROTCP_TRACE
+#define TRACE_EVENT(sock, type, seq, ack, len)                                  \
+        trace_push ((sock)->trace, (type), (seq), (ack), (len), (sock)->cwnd,   \
+                    (sock)->curr_win_size)
+#else
+#define TRACE_EVENT(sock, type, seq, ack, len) do { } while (0)
+#endif
+
+#endif /* UTILS_TRACE_H_ */